@@ -71,6 +71,18 @@ run_test "Testing prefix-only configuration" \
 	/dovecot/imaptest/fts-test
 unset IMAPTEST_NO_SUBSTRING
 
+# Substring searches expand to more terms than allowed; the results must be
+# complete nonetheless.
+LOG_LINES=$(wc -l < $DOVECOT_LOG)
+run_test "Testing query_max_expansion (no lost matches)" \
+	/dovecot/configs/dovecot.conf.query_max_expansion \
+	/dovecot/imaptest/fts-test
+if ! tail -n +$((LOG_LINES + 1)) $DOVECOT_LOG | grep -q "Query budget exceeded (expansion)" ; then
+	echo "ERROR: Failed test (query budget not exceeded)!"
+	cat $DOVECOT_LOG
+	exit 1
+fi
+
 TESTBOX=inbox
 run_test "Testing GitHub Issue #9 (1st pass)" \
 	/dovecot/configs/dovecot.conf.issue-9 \
@@ -95,6 +107,9 @@ unset IMAPTEST_ISSUE_10_GERMAN
 run_test "Testing GitHub Issue #11 (DB Rotation/Deletion)" \
 	/dovecot/configs/dovecot.conf.issue-11 \
 	/dovecot/imaptest/issue-11
+run_test "Testing GitHub Issue #11 (query threads)" \
+	/dovecot/configs/dovecot.conf.query_threads \
+	/dovecot/imaptest/issue-11
 
 run_test "Testing Xapian query keyword parsing" \
 	/dovecot/configs/dovecot.conf.xapian-query-keywords \
@@ -116,6 +131,25 @@ run_test "Testing GitHub Issue #44 (Xapian indexed string too long)" \
 	/dovecot/configs/dovecot.conf \
 	/dovecot/imaptest/issue-44/issue-44
 
+TESTBOX=learntest
+run_test "Testing learned headers (learning)" \
+	/dovecot/configs/dovecot.conf.learn_headers \
+	/dovecot/imaptest/learn_headers/learn_headers
+# Rebuild the index, so that every message carries the learned header
+run_doveadm "-c /dovecot/configs/dovecot.conf.learn_headers fts-flatcurve remove -u $TESTUSER $TESTBOX"
+run_doveadm "-c /dovecot/configs/dovecot.conf.learn_headers index -u $TESTUSER $TESTBOX"
+LOG_LINES=$(wc -l < $DOVECOT_LOG)
+run_test "Testing learned headers (searching the header index)" \
+	/dovecot/configs/dovecot.conf.learn_headers \
+	/dovecot/imaptest/learn_headers/learn_headers
+if ! tail -n +$((LOG_LINES + 1)) $DOVECOT_LOG | \
+	grep -q "Query (.*flatcurvelearn.*) matches=1 maybe_matches=0"; then
+	echo "ERROR: Failed test (learned header not searched in index)!"
+	cat $DOVECOT_LOG
+	exit 1
+fi
+TESTBOX=imaptest
+
 run_test "Testing GitHub Issue #54 (VOLATILEDIR locking)" \
 	/dovecot/configs/dovecot.conf.issue-54 \
 	/dovecot/imaptest/small_mailbox
@@ -166,6 +200,28 @@ run_test "Testing small mailbox (and large expunge from previous test)" \
 	/dovecot/configs/dovecot.conf \
 	/dovecot/imaptest/small_mailbox
 
+LOG_LINES=$(wc -l < $DOVECOT_LOG)
+run_test "Testing rotate_bytes" \
+	/dovecot/configs/dovecot.conf.rotate_bytes \
+	/dovecot/imaptest/large_mailbox
+if ! tail -n +$((LOG_LINES + 1)) $DOVECOT_LOG | grep -q "Rotating index (.*reason: size)" ; then
+	echo "ERROR: Failed test (rotate_bytes did not rotate)!"
+	cat $DOVECOT_LOG
+	exit 1
+fi
+
+# The mailbox now contains multiple shards; searching it can't complete
+# within the timeout, but the search must still succeed.
+LOG_LINES=$(wc -l < $DOVECOT_LOG)
+run_test "Testing query_timeout" \
+	/dovecot/configs/dovecot.conf.query_timeout \
+	/dovecot/imaptest/large_mailbox
+if ! tail -n +$((LOG_LINES + 1)) $DOVECOT_LOG | grep -q "Query budget exceeded (timeout)" ; then
+	echo "ERROR: Failed test (query timeout not exceeded)!"
+	cat $DOVECOT_LOG
+	exit 1
+fi
+
 echo
 echo "Testing rescan"
 run_doveadm "fts rescan -u $TESTUSER"
@@ -176,9 +232,16 @@ echo "Testing optimize"
 run_doveadm "fts optimize -u $TESTUSER"
 echo "Success!"
 
+echo
+echo "Testing rescan and optimize (maintenance workers)"
+run_doveadm "-c /dovecot/configs/dovecot.conf.maintenance_workers fts rescan -u $TESTUSER"
+run_doveadm "-c /dovecot/configs/dovecot.conf.maintenance_workers fts optimize -u $TESTUSER"
+echo "Success!"
+
 echo
 echo "Testing 'doveadm fts-flatcurve check'"
 run_doveadm "fts-flatcurve check -u $TESTUSER rotatetest"
+run_doveadm "fts-flatcurve check -u $TESTUSER -q rotatetest"
 # TODO: Scan for expected input
 echo "Success!"
 
@@ -188,6 +251,18 @@ run_doveadm "fts-flatcurve dump -u $TESTUSER -h rotatetest"
 # TODO: Scan for expected input
 echo "Success!"
 
+echo
+echo "Testing 'doveadm fts-flatcurve dump -n'"
+run_doveadm "fts-flatcurve dump -u $TESTUSER -n 10 -p a rotatetest"
+# TODO: Scan for expected input
+echo "Success!"
+
+echo
+echo "Testing 'doveadm fts-flatcurve reindex'"
+run_doveadm "fts-flatcurve reindex -u $TESTUSER rotatetest"
+# TODO: Scan for expected input
+echo "Success!"
+
 echo
 echo "Testing 'doveadm fts-flatcurve rotate'"
 run_doveadm "fts-flatcurve rotate -u $TESTUSER rotatetest"
@@ -200,12 +275,24 @@ run_doveadm "fts-flatcurve stats -u $TESTUSER rotatetest"
 # TODO: Scan for expected input
 echo "Success!"
 
+echo
+echo "Testing 'doveadm fts-flatcurve stats -s'"
+run_doveadm "fts-flatcurve stats -u $TESTUSER -s rotatetest"
+# TODO: Scan for expected input
+echo "Success!"
+
 echo
 echo "Testing 'doveadm fts-flatcurve stats -A'"
 run_doveadm "fts-flatcurve stats -A rotatetest"
 # TODO: Scan for expected input
 echo "Success!"
 
+echo
+echo "Testing 'doveadm fts-flatcurve warmup'"
+run_doveadm "fts-flatcurve warmup -u $TESTUSER rotatetest"
+# TODO: Scan for expected input
+echo "Success!"
+
 run_test "Testing GitHub Issue #38" \
 	/dovecot/configs/dovecot.conf.issue-38 \
 	/dovecot/imaptest/issue-38/issue-38
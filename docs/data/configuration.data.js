@@ -13,6 +13,40 @@ Commit database changes after this many documents are updated. Higher commit
 limits will result in faster indexing for large transactions (i.e. indexing a
 large mailbox) at the expense of high memory usage. The default value should
 be sufficient to allow indexing in a 256 MB maximum size process.`
+      },
+      fts_flatcurve_learn_headers: {
+        default: "0",
+        value: "integer, set to `0` to disable",
+        summary: `
+The maximum number of headers to learn. Searches on headers that are not listed
+in \`fts_header_indexes\` can only return "maybe" matches, which Dovecot must
+verify by reading each candidate message. If enabled, these headers are
+recorded (per namespace) when searched for, and messages indexed afterwards
+will index them as if they were listed in \`fts_header_indexes\`. Once every
+message in a mailbox has been indexed this way (e.g. after the mailbox index
+has been removed and rebuilt), searches on the header return definite
+matches.`
+      },
+      fts_flatcurve_maintenance_host_limit: {
+        default: "0",
+        value: "integer, set to `0` to disable",
+        summary: `
+The maximum number of mailbox optimizations (across all processes) that may run
+concurrently on the host. This limits the I/O load caused by running
+\`doveadm fts optimize\` for several users at once. Lock files in
+\`mail_temp_dir\` are used to coordinate between processes.`
+      },
+      fts_flatcurve_maintenance_workers: {
+        default: "0",
+        value: "integer, set to `0` to disable",
+        summary: `
+The number of mailboxes of a user that are optimized, or rescanned, at the same
+time by \`doveadm fts optimize\` and \`doveadm fts rescan\`. Each mailbox has its
+own database, so the Xapian work (compacting the database, or reading the list
+of indexed messages) is done concurrently in this many threads. This is also
+the number of index shards of a mailbox that are checked at the same time by
+\`doveadm fts-flatcurve check\`. If disabled, mailboxes (and shards) are
+processed one after another.`
       },
       fts_flatcurve_min_term_size: {
         default: "2",
@@ -24,6 +58,62 @@ be sufficient to allow indexing in a 256 MB maximum size process.`
         value: "integer, set to `0` to disable",
         summary: `Once the database reaches this number of shards, automatically optimize the DB at shutdown.`
       },
+      fts_flatcurve_query_log_uids: {
+        default: "no",
+        value: "boolean (`yes` or `no`)",
+        summary: `
+If enabled, the full lists of matching UIDs are added to the
+\`fts_flatcurve_query\` event (and debug log). Formatting these lists is
+expensive for queries matching many messages, so this should only be enabled
+when debugging.`
+      },
+      fts_flatcurve_query_max_expansion: {
+        default: "0",
+        value: "integer, set to `0` to disable",
+        summary: `
+The maximum number of index terms a single search term (i.e. a prefix or
+substring search) is expanded to. If a search term matches more terms than
+this, the query is not run by Xapian; instead, all messages in the mailbox are
+returned as "maybe" matches, which Dovecot verifies itself. This prevents very
+short or common search terms from using excessive memory in the IMAP process.`
+      },
+      fts_flatcurve_query_threads: {
+        default: "0",
+        value: "integer, set to `0` to disable",
+        summary: `
+The number of threads used to search a mailbox. If enabled, each shard of the
+mailbox database is searched separately and concurrently (using at most this
+many threads), which speeds up searches of mailboxes containing multiple
+shards (i.e. that have not yet been optimized). Mailboxes with a single shard
+or fewer than 10,000 messages are always searched without threads. Relevancy
+scores are computed per shard in this mode.`
+      },
+      fts_flatcurve_query_timeout: {
+        default: "0",
+        value: "integer (milliseconds), set to `0` to disable",
+        summary: `
+The maximum time spent by Xapian searching a mailbox (including the expansion
+of prefix and substring search terms). Once exceeded, the search is stopped.
+The matches found until then are returned, and the messages that were not
+evaluated (those of the shards whose search did not complete, or all messages
+in the mailbox if the timeout was reached while expanding search terms) are
+returned as "maybe" matches, which Dovecot verifies itself. No matches are
+lost, but the search falls back to Dovecot's (slower) non-fts search for those
+messages.`
+      },
+      fts_flatcurve_rotate_bytes: {
+        default: "0",
+        value: "size (e.g. \`256M\`), set to \`0\` to disable",
+        summary: `
+When the "current" fts database is predicted to reach this size on disk at the
+next commit, it is rotated to a read-only database and replaced by a new write
+DB. The prediction uses the size of the database measured at the last commit,
+plus the uncommitted messages at the database's average message size, so
+folders of large messages are rotated after fewer messages than folders of
+small ones. A new database is committed after its first 100 messages, so that
+its average message size is known. This is checked in addition to
+\`fts_flatcurve_rotate_size\` and \`fts_flatcurve_rotate_time\`.`
+      },
       fts_flatcurve_rotate_size: {
         default: "5000",
         value: "integer, set to `0` to disable rotation",
@@ -50,6 +140,20 @@ requires significant additional storage space. Most users today expect
 arguably not the "modern, expected" behavior. Therefore, even though it
 is not strictly RFC compliant, prefix (non-substring) searching is enabled
 by default.`
+      },
+      fts_flatcurve_warmup_bytes: {
+        default: "0",
+        value: "size (e.g. \`64M\`), set to \`0\` to disable",
+        summary: `
+When a mailbox is first searched in a session, ask the kernel to read ahead up
+to this many bytes of the mailbox's Xapian tables used by searches (postlist
+first, then termlist, across all shards) into the page cache, so that searches
+spend less time waiting for random disk reads. The read ahead is done in the
+background by the kernel, and needs \`posix_fadvise()\` support. Indexing does
+not trigger it.
+
+Also used as the limit of \`doveadm fts-flatcurve warmup\` (no limit if
+\`0\`).`
       }
     }
   }
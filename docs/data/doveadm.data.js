@@ -7,12 +7,18 @@ export default {
           // Doveadm command string
           cmd: "doveadm fts-flatcurve check",
           // Doveadm argument string
-          args: "<mailbox mask>",
+          args: "[-q] <mailbox mask>",
           // Summary of command. Processed w/Markdown
           summary: `
 Run a simple check on Dovecot Xapian databases, and attempt to fix basic
 errors (it is the same checking done by the \`xapian-check\` command
-with the \`F\` option).
+with the \`F\` option). Index shards are checked in parallel, using up to
+\`fts_flatcurve_maintenance_workers\` threads.
+
+If \`-q\` command line option is given, a quick check is done instead: the
+metadata, DB version, and document count of every index shard are checked,
+but the full check is only run on shards that have changed since their last
+successful check.
 
 \`<mailbox mask>\` is the list of mailboxes to process. It is
 possible to use wildcards (\`*\` and \`?\`) in this value.
@@ -23,12 +29,13 @@ For each mailbox that has FTS data, it outputs the following key/value fields:`,
             mailbox: "The human-readable mailbox name. (key is hidden)",
             guid: "The GUID of the mailbox.",
             errors: "The number of errors reported by the Xapian library.",
-            shards: "The number of index shards processed."
+            shards: "The number of index shards processed.",
+            checked: "The number of index shards fully checked."
           }
         },
         {
           cmd: "doveadm fts-flatcurve dump",
-          args: "[-h] <mailbox mask>",
+          args: "[-h] [-n <limit>] [-p <prefix>] <mailbox mask>",
           summary: `
 Dump the headers or terms of the Xapian databases.
 
@@ -37,11 +44,24 @@ number of times that header was indexed is output. Without that option, the
 list of search terms are output with the number of times it appears in the
 database.
 
+If \`-n\` is given, only the \`<limit>\` most frequent headers/terms are
+output, most frequent first. Otherwise, all headers/terms are output in
+alphabetical order.
+
+**Note:** Earlier versions sorted the full output (without \`-n\`) by
+frequency, most frequent first. Scripts relying on that order should pass
+\`-n\` or sort the output themselves.
+
+If \`-p\` is given, only headers/terms starting with \`<prefix>\` are output.
+
 \`<mailbox mask>\` is the list of mailboxes to process. It is possible to use
 wildcards (\`*\` and \`?\`) in this value.
 
 All mailboxes are processed together and a single value for all headers/terms
-is given.
+is given. Terms are streamed from the databases, so memory usage does not
+depend on the number of terms (only on \`<limit>\`). At most 128 index
+shards are kept open at once: the terms of each batch of shards are written to
+a sorted temporary file, and these files are merged for the output.
 
 The following key/value fields are output:`,
           fields: {
@@ -50,6 +70,27 @@ The following key/value fields are output:`,
             term: "Term (if `-h` is NOT given)."
           }
         },
+        {
+          cmd: "doveadm fts-flatcurve reindex",
+          args: "<mailbox mask>",
+          summary: `
+Indexes the messages that \`doveadm fts rescan\` found missing from the FTS
+index, and that could not be indexed by the rescan itself. Only those messages
+are indexed. After 3 failed attempts, the messages of the mailbox from the
+first missing UID onwards are removed from the index instead, so that they
+are reindexed by Dovecot the next time the mailbox is updated.
+
+\`<mailbox mask>\` is the list of mailboxes to process. It is possible to use
+wildcards (\`*\` and \`?\`) in this value.
+
+For each mailbox that had messages indexed, it outputs the following
+key/value fields:`,
+          fields: {
+            mailbox: "The human-readable mailbox name. (key is hidden)",
+            guid: "The GUID of the mailbox.",
+            indexed: "The number of messages indexed."
+          }
+        },
         {
           cmd: "doveadm fts-flatcurve remove",
           args: "<mailbox mask>",
@@ -82,13 +123,18 @@ For each mailbox rotated, it outputs the following key/value fields:`,
         },
         {
           cmd: "doveadm fts-flatcurve stats",
-          args: "<mailbox mask>",
+          args: "[-s] <mailbox mask>",
           summary: `
 Returns FTS data for a mailbox.
 
 \`<mailbox mask>\` is the list of mailboxes to process. It is possible to use
 wildcards (\`*\` and \`?\`) in this value.
 
+If \`-s\` command line option is given, one row is output for each index shard
+of the mailbox instead (see the \`-s\` fields below; \`messages\` and
+\`last_uid\` then refer to the shard). Use the doveadm
+\`-f\` option (e.g. \`-f json\` or \`-f tab\`) for machine-readable output.
+
 For each mailbox that has FTS data, it outputs the following key/value fields:`,
           fields: {
             mailbox: "The human-readable mailbox name. (key is hidden)",
@@ -96,7 +142,32 @@ For each mailbox that has FTS data, it outputs the following key/value fields:`,
             last_uid: "The last UID indexed in the mailbox.",
             messages: "The number of messages indexed in the mailbox.",
             shards: "The number of index shards.",
-            version: "The (Dovecot internal) version of the FTS data."
+            version: "The (Dovecot internal) version of the FTS data.",
+            shard: "(\`-s\`) The name of the index shard.",
+            type: "(\`-s\`) \`current\` (the shard new messages are written to) or \`index\`.",
+            bytes: "(\`-s\`) The size of the shard on disk.",
+            first_uid: "(\`-s\`) The first UID in the shard.",
+            terms: "(\`-s\`) The number of unique terms in the shard.",
+            avg_length: "(\`-s\`) The average number of terms per message.",
+            last_commit: "(\`-s\`) The UNIX timestamp of the last change to the shard.",
+            reclaimable: "(\`-s\`) The estimated number of bytes used by expunged messages (assuming UIDs missing from the shard's UID range were expunged), which optimization would reclaim."
+          }
+        },
+        {
+          cmd: "doveadm fts-flatcurve warmup",
+          args: "<mailbox mask>",
+          summary: `
+Read ahead the FTS data of a mailbox into the page cache (see
+\`fts_flatcurve_warmup_bytes\`).
+
+\`<mailbox mask>\` is the list of mailboxes to process. It is possible to use
+wildcards (\`*\` and \`?\`) in this value.
+
+For each mailbox that has FTS data, it outputs the following key/value fields:`,
+          fields: {
+            mailbox: "The human-readable mailbox name. (key is hidden)",
+            guid: "The GUID of the mailbox.",
+            bytes: "The number of bytes read ahead."
           }
         }
       ]
@@ -2,6 +2,36 @@ export default {
   load() {
     // Each event is listed with key as event name and value as object
     return {
+      fts_flatcurve_commit: {
+        summary: "Emitted when changes to a mailbox's Xapian DB shard are committed.",
+        fields: {
+          bytes: "The number of bytes the shard grew on disk with the commit (space freed by the changes is reused, so this can be 0)",
+          changes: "The number of changes committed",
+          doccount: "The number of documents in the shard after the commit",
+          duration: "The time (in msecs) spent committing",
+          mailbox: "The mailbox name",
+          memory_db: "An estimate of the memory (in bytes) held by the read database: a fixed amount per open shard, plus the cached UIDs",
+          memory_document: "An estimate of the memory (in bytes) held by the document being indexed: a fixed amount per distinct term",
+          memory_peak: "The peak of the estimated memory (in bytes) held by the backend (the sum of the other `memory_*` fields, excluding `memory_results`) since it was initialized",
+          memory_pools: "The memory (in bytes) allocated by the backend's memory pools",
+          memory_uncommitted: "An estimate of the memory (in bytes) held by the documents indexed since the last commit (estimated as for `memory_document`)",
+          rotate_reason: "Why the commit triggered a rotation of the shard (`none` if it did not)",
+          shard: "The shard name"
+        },
+        options: {
+          rotate_reason: [ "manual", "none", "size", "time" ]
+        }
+      },
+      fts_flatcurve_deinit: {
+        summary: "Emitted when the backend is deinitialized (i.e. at the end of the session).",
+        fields: {
+          memory_db: "An estimate of the memory (in bytes) held by the read database: a fixed amount per open shard, plus the cached UIDs",
+          memory_document: "An estimate of the memory (in bytes) held by the document being indexed: a fixed amount per distinct term",
+          memory_peak: "The peak of the estimated memory (in bytes) held by the backend (the sum of the other `memory_*` fields, excluding `memory_results`) since it was initialized",
+          memory_pools: "The memory (in bytes) allocated by the backend's memory pools",
+          memory_uncommitted: "An estimate of the memory (in bytes) held by the documents indexed since the last commit (estimated as for `memory_document`)"
+        }
+      },
       fts_flatcurve_expunge: {
         // Summary of event. Processed w/Markdown
         summary: "Emitted when a message is expunged from a mailbox.",
@@ -19,6 +49,27 @@ export default {
           uid: "The UID that was added to the FTS index"
         }
       },
+      fts_flatcurve_index_values: {
+        summary: "Emitted when a date or size value of a message is not stored, because it can't be looked up without reading the message. Date and size searches on the mailbox are then verified by Dovecot.",
+        fields: {
+          field: "The value not stored (`received`, `sent`, or `size`)",
+          mailbox: "The mailbox name",
+          uid: "The UID being indexed"
+        }
+      },
+      fts_flatcurve_index_pending: {
+        summary: "Emitted when the messages found missing by rescan are indexed.",
+        fields: {
+          count: "The number of messages indexed",
+          failures: "The number of failed attempts so far (if indexing failed)",
+          mailbox: "The mailbox name",
+          status: "Status of indexing",
+          uids: "The list of pending UIDs"
+        },
+        options: {
+          status: [ "failed", "gave_up", "ok" ]
+        }
+      },
       fts_flatcurve_index_truncate: {
         summary: "Emitted when an index term is truncated.",
         fields: {
@@ -34,6 +85,41 @@ export default {
           uid: "The last UID contained in the FTS index"
         }
       },
+      fts_flatcurve_learn_header: {
+        summary: "Emitted when a searched header is learned for future indexing.",
+        fields: {
+          header: "The (lowercase) header name"
+        }
+      },
+      fts_flatcurve_lock_wait: {
+        summary: "Emitted when a lock has been acquired (or failed to be acquired).",
+        fields: {
+          duration: "The time (in msecs) spent waiting for the lock",
+          lock: "The lock type: the mailbox lock file (held when rotating shards), the optimize lock file, or the Xapian write lock of a shard",
+          mailbox: "The mailbox name",
+          outcome: "The result of the lock attempt",
+          path: "The lock file path, or the shard name for the write lock",
+          retries: "The number of times the lock was retried (the lock file locks are retried internally, and always report `0`)"
+        },
+        options: {
+          lock: [ "mailbox", "optimize", "write" ],
+          outcome: [ "acquired", "fatal", "timeout" ]
+        }
+      },
+      fts_flatcurve_maintenance: {
+        summary: "Emitted when optimize or rescan of all mailboxes (i.e. `doveadm fts optimize` or `doveadm fts rescan`) is completed.",
+        fields: {
+          action: "The maintenance action",
+          duration: "The time (in msecs) spent processing all mailboxes",
+          failed: "The number of mailboxes that failed",
+          failed_mailboxes: "The comma separated list of mailboxes that failed",
+          mailboxes: "The number of mailboxes processed",
+          workers: "The number of mailboxes processed in parallel"
+        },
+        options: {
+          action: [ "optimize", "rescan" ]
+        }
+      },
       fts_flatcurve_optimize: {
         summary: "Emitted when a mailbox is optimized.",
         fields: {
@@ -45,21 +131,54 @@ export default {
         fields: {
           count: "The number of messages matched",
           mailbox: "The mailbox name",
-          maybe_uids: "The list of maybe UIDs returned by the query (these UIDs need to have their contents directly searched by Dovecot core)",
+          maybe_uids: "The list of maybe UIDs returned by the query (these UIDs need to have their contents directly searched by Dovecot core); only if `fts_flatcurve_query_log_uids` is enabled",
+          memory_db: "An estimate of the memory (in bytes) held by the read database: a fixed amount per open shard, plus the cached UIDs",
+          memory_document: "An estimate of the memory (in bytes) held by the document being indexed: a fixed amount per distinct term",
+          memory_peak: "The peak of the estimated memory (in bytes) held by the backend (the sum of the other `memory_*` fields, excluding `memory_results`) since it was initialized",
+          memory_pools: "The memory (in bytes) allocated by the backend's memory pools",
+          memory_results: "The approximate memory (in bytes) used by the query results",
+          memory_uncommitted: "An estimate of the memory (in bytes) held by the documents indexed since the last commit (estimated as for `memory_document`)",
           query: "The query text sent to Xapian",
-          uids: "The list of UIDs returned by the query"
+          uids: "The list of UIDs returned by the query; only if `fts_flatcurve_query_log_uids` is enabled"
         },
         options: {
           maybe: [ "yes", "no" ]
         }
       },
+      fts_flatcurve_query_budget: {
+        summary: "Emitted when a query exceeds its budget (see `fts_flatcurve_query_max_expansion` and `fts_flatcurve_query_timeout`). The matches found are returned, and the messages that were not evaluated are returned as maybe matches.",
+        fields: {
+          mailbox: "The mailbox name",
+          query: "The query text sent to Xapian",
+          reason: "Why the budget was exceeded",
+          unevaluated: "The number of messages that were not evaluated (all messages of the mailbox if the budget was exceeded before the search started)"
+        },
+        options: {
+          reason: [ "expansion", "timeout" ]
+        }
+      },
+      fts_flatcurve_query_profile: {
+        summary: "Emitted when a query of a mailbox is completed, with the time spent in each of its stages.",
+        fields: {
+          build_usecs: "The time (in usecs) spent building the query from the search arguments (once for all mailboxes searched)",
+          mailbox: "The mailbox name",
+          mset_usecs: "The time (in usecs) spent matching",
+          open_usecs: "The time (in usecs) spent opening (or reopening) the mailbox DB",
+          plan_usecs: "The time (in usecs) spent planning the query, including the wildcard expansions",
+          query: "The query text sent to Xapian",
+          results_usecs: "The time (in usecs) spent assembling the results",
+          shards: "The number of shards searched",
+          wildcard_terms: "The number of index terms the wildcard terms were expanded to",
+          wildcards: "The number of wildcard (prefix or substring) terms expanded"
+        }
+      },
       fts_flatcurve_rescan: {
         summary: "Emitted when a rescan is completed.",
         fields: {
           expunged: "The list of UIDs that were expunged during rescan",
           mailbox: "The mailbox name",
           status: "Status of rescan",
-          uids: "The list of UIDs that triggered a non-ok status response"
+          uids: "The list of UIDs that are missing from the FTS index (these are indexed the next time the mailbox is updated)"
         },
         options: {
           status: [ "expunge_msgs", "missing_msgs", "ok" ]
@@ -68,7 +187,35 @@ export default {
       fts_flatcurve_rotate: {
         summary: "Emitted when a mailbox has its underlying Xapian DB rotated.",
         fields: {
+          doccount: "The number of documents in the rotated shard",
+          duration: "The time (in msecs) spent rotating, including the commit of the shard",
+          from: "The name of the rotated shard before the rotation",
+          mailbox: "The mailbox name",
+          reason: "Why the shard was rotated",
+          to: "The name of the rotated shard after the rotation"
+        },
+        options: {
+          reason: [ "manual", "optimize", "size", "time" ]
+        }
+      },
+      fts_flatcurve_update: {
+        summary: "Emitted when an update (indexing) transaction is completed.",
+        fields: {
+          duration: "The time (in msecs) spent in the transaction",
+          mailbox: "The mailbox name",
+          memory_db: "An estimate of the memory (in bytes) held by the read database: a fixed amount per open shard, plus the cached UIDs",
+          memory_document: "An estimate of the memory (in bytes) held by the document being indexed: a fixed amount per distinct term",
+          memory_peak: "The peak of the estimated memory (in bytes) held by the backend (the sum of the other `memory_*` fields, excluding `memory_results`) since it was initialized",
+          memory_pools: "The memory (in bytes) allocated by the backend's memory pools",
+          memory_uncommitted: "An estimate of the memory (in bytes) held by the documents indexed since the last commit (estimated as for `memory_document`)"
+        }
+      },
+      fts_flatcurve_warmup: {
+        summary: "Emitted when a mailbox's Xapian DB is read ahead into the page cache (see `fts_flatcurve_warmup_bytes`).",
+        fields: {
+          bytes: "The number of bytes read ahead",
           mailbox: "The mailbox name",
+          shards: "The number of index shards"
         }
       }
     }
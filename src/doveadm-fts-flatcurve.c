@@ -6,9 +6,10 @@
 #include "doveadm-mail.h"
 #include "doveadm-mailbox-list-iter.h"
 #include "doveadm-print.h"
-#include "hash.h"
 #include "mail-search.h"
+#include "priorityq.h"
 #include "str.h"
+#include "strnum.h"
 #include "fts-backend-flatcurve.h"
 #include "fts-backend-flatcurve-xapian.h"
 #include "fts-flatcurve-config.h"
@@ -16,9 +17,11 @@
 
 #define DOVEADM_FLATCURVE_CMD_NAME_CHECK FTS_FLATCURVE_LABEL " check"
 #define DOVEADM_FLATCURVE_CMD_NAME_DUMP FTS_FLATCURVE_LABEL " dump"
+#define DOVEADM_FLATCURVE_CMD_NAME_REINDEX FTS_FLATCURVE_LABEL " reindex"
 #define DOVEADM_FLATCURVE_CMD_NAME_REMOVE FTS_FLATCURVE_LABEL " remove"
 #define DOVEADM_FLATCURVE_CMD_NAME_ROTATE FTS_FLATCURVE_LABEL " rotate"
 #define DOVEADM_FLATCURVE_CMD_NAME_STATS FTS_FLATCURVE_LABEL " stats"
+#define DOVEADM_FLATCURVE_CMD_NAME_WARMUP FTS_FLATCURVE_LABEL " warmup"
 
 const char *doveadm_fts_flatcurve_plugin_version = DOVECOT_ABI_VERSION;
 
@@ -28,9 +31,11 @@ void doveadm_fts_flatcurve_plugin_deinit(void);
 enum fts_flatcurve_cmd_type {
 	FTS_FLATCURVE_CMD_CHECK,
 	FTS_FLATCURVE_CMD_DUMP,
+	FTS_FLATCURVE_CMD_REINDEX,
 	FTS_FLATCURVE_CMD_REMOVE,
 	FTS_FLATCURVE_CMD_ROTATE,
-	FTS_FLATCURVE_CMD_STATS
+	FTS_FLATCURVE_CMD_STATS,
+	FTS_FLATCURVE_CMD_WARMUP
 };
 
 struct fts_flatcurve_mailbox_cmd_context {
@@ -38,15 +43,60 @@ struct fts_flatcurve_mailbox_cmd_context {
 	enum fts_flatcurve_cmd_type cmd_type;
 	struct mail_search_args *search_args;
 
-	HASH_TABLE_TYPE(term_counter) terms;
+	struct fts_flatcurve_xapian_terms *dump_terms;
+	const char *dump_prefix;
+	unsigned int dump_limit;
+	bool check_quick:1;
 	bool dump_header:1;
+	bool stats_shards:1;
 };
 
 struct fts_flatcurve_dump_term {
-	const char *term;
+	struct priorityq_item item;
+	char *term;
 	unsigned int count;
 };
 
+static const char *cmd_fts_flatcurve_mailbox_guid(struct mailbox *box)
+{
+	struct mailbox_metadata metadata;
+
+	return (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) < 0)
+		? ""
+		: guid_128_to_string(metadata.guid);
+}
+
+static void
+cmd_fts_flatcurve_stats_shards(struct flatcurve_fts_backend *backend,
+			       struct mailbox *box)
+{
+	ARRAY_TYPE(fts_flatcurve_xapian_shard_stats) stats;
+	const struct fts_flatcurve_xapian_shard_stats *s;
+	const char *guid;
+
+	t_array_init(&stats, 8);
+	fts_flatcurve_xapian_mailbox_shard_stats(backend, pool_datastack_create(),
+						 &stats);
+	if (array_count(&stats) == 0)
+		return;
+
+	guid = cmd_fts_flatcurve_mailbox_guid(box);
+	array_foreach(&stats, s) {
+		doveadm_print(str_c(backend->boxname));
+		doveadm_print(guid);
+		doveadm_print(s->shard);
+		doveadm_print(s->type);
+		doveadm_print_num(s->bytes);
+		doveadm_print_num(s->messages);
+		doveadm_print_num(s->first_uid);
+		doveadm_print_num(s->last_uid);
+		doveadm_print_num(s->terms);
+		doveadm_print(t_strdup_printf("%.1f", s->avg_length));
+		doveadm_print_num(s->last_commit);
+		doveadm_print_num(s->reclaimable);
+	}
+}
+
 static void
 cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 				  struct fts_flatcurve_mailbox_cmd_context *ctx,
@@ -54,22 +104,27 @@ cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 {
 	struct fts_flatcurve_xapian_db_check check;
 	const char *guid;
+	int indexed;
 	uint32_t last_uid;
-	struct mailbox_metadata metadata;
 	bool result;
 	struct fts_flatcurve_xapian_db_stats stats;
+	uoff_t warmup, warmup_limit;
 
 	switch (ctx->cmd_type) {
 	case FTS_FLATCURVE_CMD_CHECK:
-		fts_flatcurve_xapian_mailbox_check(backend, &check);
+		fts_flatcurve_xapian_mailbox_check(backend, &check,
+						   ctx->check_quick);
 		result = (check.shards > 0);
 		break;
 	case FTS_FLATCURVE_CMD_DUMP:
-		if (ctx->dump_header)
-			fts_flatcurve_xapian_mailbox_headers(backend, ctx->terms);
-		else
-			fts_flatcurve_xapian_mailbox_terms(backend, ctx->terms);
+		fts_flatcurve_xapian_terms_add(ctx->dump_terms);
 		return;
+	case FTS_FLATCURVE_CMD_REINDEX:
+		indexed = fts_backend_flatcurve_index_pending(backend, box);
+		if (indexed < 0)
+			doveadm_mail_failed_error(&ctx->ctx, MAIL_ERROR_TEMP);
+		result = (indexed > 0);
+		break;
 	case FTS_FLATCURVE_CMD_REMOVE:
 		result = (fts_backend_flatcurve_delete_dir(backend, str_c(backend->db_path)) > 0) ;
 		break;
@@ -77,11 +132,23 @@ cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 		result = fts_flatcurve_xapian_mailbox_rotate(backend);
 		break;
 	case FTS_FLATCURVE_CMD_STATS:
+		if (ctx->stats_shards) {
+			T_BEGIN {
+				cmd_fts_flatcurve_stats_shards(backend, box);
+			} T_END;
+			return;
+		}
 		fts_flatcurve_xapian_mailbox_stats(backend, &stats);
 		if ((result = (stats.version > 0)))
 			fts_flatcurve_xapian_get_last_uid(backend,
 							  &last_uid);
 		break;
+	case FTS_FLATCURVE_CMD_WARMUP:
+		warmup_limit = backend->fuser->set.warmup_bytes;
+		warmup = fts_flatcurve_xapian_warmup(backend,
+			(warmup_limit == 0) ? (uoff_t)-1 : warmup_limit);
+		result = (warmup > 0);
+		break;
 	default:
 		i_unreached();
 	}
@@ -89,9 +156,7 @@ cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 	if (!result)
 		return;
 
-	guid = (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) < 0)
-		? ""
-		: guid_128_to_string(metadata.guid);
+	guid = cmd_fts_flatcurve_mailbox_guid(box);
 	doveadm_print(str_c(backend->boxname));
 	doveadm_print(guid);
 
@@ -99,6 +164,10 @@ cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 	case FTS_FLATCURVE_CMD_CHECK:
 		doveadm_print_num(check.errors);
 		doveadm_print_num(check.shards);
+		doveadm_print_num(check.checked);
+		break;
+	case FTS_FLATCURVE_CMD_REINDEX:
+		doveadm_print_num(indexed);
 		break;
 	case FTS_FLATCURVE_CMD_STATS:
 		doveadm_print_num(last_uid);
@@ -106,18 +175,78 @@ cmd_fts_flatcurve_mailbox_run_box(struct flatcurve_fts_backend *backend,
 		doveadm_print_num(stats.shards);
 		doveadm_print_num(stats.version);
 		break;
+	case FTS_FLATCURVE_CMD_WARMUP:
+		doveadm_print_num(warmup);
+		break;
 	default:
 		break;
 	}
 }
 
-static int
-cmd_fts_flatcurve_dump_sort(struct fts_flatcurve_dump_term *const *n1,
-			    struct fts_flatcurve_dump_term *const *n2)
+/* The term output last (the least frequent one) is at the head of the
+ * queue. */
+static int cmd_fts_flatcurve_dump_cmp(const void *p1, const void *p2)
+{
+	const struct fts_flatcurve_dump_term *t1 = p1, *t2 = p2;
+
+	if (t1->count != t2->count)
+		return (t1->count < t2->count) ? -1 : 1;
+	return strcmp(t2->term, t1->term);
+}
+
+static void
+cmd_fts_flatcurve_dump(struct fts_flatcurve_mailbox_cmd_context *ctx)
 {
-	return ((*n1)->count == (*n2)->count)
-		? strcmp((*n1)->term, (*n2)->term)
-		: ((*n1)->count < (*n2)->count);
+	ARRAY(struct fts_flatcurve_dump_term *) dterms;
+	struct fts_flatcurve_dump_term *dterm;
+	struct priorityq *pq;
+	const char *term;
+	unsigned int count, i;
+
+	if (ctx->dump_limit == 0) {
+		/* Output everything in term order, as it is read. */
+		while (fts_flatcurve_xapian_terms_next(ctx->dump_terms, &term,
+						       &count)) {
+			doveadm_print(term);
+			doveadm_print_num(count);
+		}
+		return;
+	}
+
+	/* Only keep the most frequent terms. Terms are read in term order,
+	 * so a term with the same count as the head of the queue is never
+	 * preferred over it. */
+	pq = priorityq_init(cmd_fts_flatcurve_dump_cmp, ctx->dump_limit);
+	while (fts_flatcurve_xapian_terms_next(ctx->dump_terms, &term, &count)) {
+		if (priorityq_count(pq) < ctx->dump_limit)
+			dterm = i_new(struct fts_flatcurve_dump_term, 1);
+		else {
+			dterm = (struct fts_flatcurve_dump_term *)
+				priorityq_peek(pq);
+			if (dterm->count >= count)
+				continue;
+			priorityq_remove(pq, &dterm->item);
+			i_free(dterm->term);
+		}
+		dterm->term = i_strdup(term);
+		dterm->count = count;
+		priorityq_add(pq, &dterm->item);
+	}
+
+	i_array_init(&dterms, priorityq_count(pq));
+	while ((dterm = (struct fts_flatcurve_dump_term *)
+			priorityq_pop(pq)) != NULL)
+		array_push_back(&dterms, &dterm);
+	priorityq_deinit(&pq);
+
+	for (i = array_count(&dterms); i > 0; i--) {
+		dterm = array_idx_elem(&dterms, i - 1);
+		doveadm_print(dterm->term);
+		doveadm_print_num(dterm->count);
+		i_free(dterm->term);
+		i_free(dterm);
+	}
+	array_free(&dterms);
 }
 
 static int
@@ -126,17 +255,18 @@ cmd_fts_flatcurve_mailbox_run_do(struct flatcurve_fts_backend *backend,
 				 struct fts_flatcurve_mailbox_cmd_context *ctx)
 {
 	struct mailbox *box;
-	ARRAY(struct fts_flatcurve_dump_term *) dterms;
-	struct hash_iterate_context *hiter;
 	const struct mailbox_info *info;
 	struct doveadm_mailbox_list_iter *iter;
-	char *k;
 	enum mailbox_list_iter_flags iter_flags =
 		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
 		MAILBOX_LIST_ITER_SKIP_ALIASES |
 		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
-	struct fts_flatcurve_dump_term *term;
-	void *v;
+
+	if (ctx->cmd_type == FTS_FLATCURVE_CMD_DUMP) {
+		ctx->dump_terms = fts_flatcurve_xapian_terms_init(
+			backend, (ctx->dump_prefix == NULL)
+				? "" : ctx->dump_prefix, ctx->dump_header);
+	}
 
 	iter = doveadm_mailbox_list_iter_init(&ctx->ctx, user,
 					      ctx->search_args, iter_flags);
@@ -150,24 +280,8 @@ cmd_fts_flatcurve_mailbox_run_do(struct flatcurve_fts_backend *backend,
 
 	switch (ctx->cmd_type) {
 	case FTS_FLATCURVE_CMD_DUMP:
-		p_array_init(&dterms, backend->pool,
-			     hash_table_count(ctx->terms));
-		hiter = hash_table_iterate_init(ctx->terms);
-	        while (hash_table_iterate(hiter, ctx->terms, &k, &v)) {
-			term = p_new(backend->pool,
-				     struct fts_flatcurve_dump_term, 1);
-			term->count = POINTER_CAST_TO(v, unsigned int);
-			term->term = k;
-			array_push_back(&dterms, &term);
-		}
-	        hash_table_iterate_deinit(&hiter);
-
-		array_sort(&dterms, cmd_fts_flatcurve_dump_sort);
-		array_foreach_elem(&dterms, term) {
-			doveadm_print(term->term);
-			doveadm_print_num(term->count);
-		}
-		array_free(&dterms);
+		cmd_fts_flatcurve_dump(ctx);
+		fts_flatcurve_xapian_terms_deinit(&ctx->dump_terms);
 		break;
 	default:
 		break;
@@ -211,16 +325,36 @@ cmd_fts_flatcurve_mailbox_run(struct doveadm_mail_cmd_context *_ctx,
 	case FTS_FLATCURVE_CMD_CHECK:
 		doveadm_print_header_simple("errors");
 		doveadm_print_header_simple("shards");
+		doveadm_print_header_simple("checked");
 		break;
 	case FTS_FLATCURVE_CMD_DUMP:
 		doveadm_print_header_simple("count");
 		break;
+	case FTS_FLATCURVE_CMD_REINDEX:
+		doveadm_print_header_simple("indexed");
+		break;
 	case FTS_FLATCURVE_CMD_STATS:
+		if (ctx->stats_shards) {
+			doveadm_print_header_simple("shard");
+			doveadm_print_header_simple("type");
+			doveadm_print_header_simple("bytes");
+			doveadm_print_header_simple("messages");
+			doveadm_print_header_simple("first_uid");
+			doveadm_print_header_simple("last_uid");
+			doveadm_print_header_simple("terms");
+			doveadm_print_header_simple("avg_length");
+			doveadm_print_header_simple("last_commit");
+			doveadm_print_header_simple("reclaimable");
+			break;
+		}
 		doveadm_print_header_simple("last_uid");
 		doveadm_print_header_simple("messages");
 		doveadm_print_header_simple("shards");
 		doveadm_print_header_simple("version");
 		break;
+	case FTS_FLATCURVE_CMD_WARMUP:
+		doveadm_print_header_simple("bytes");
+		break;
 	default:
 		break;
 	}
@@ -243,6 +377,9 @@ cmd_fts_flatcurve_mailbox_init(struct doveadm_mail_cmd_context *_ctx,
 		case FTS_FLATCURVE_CMD_DUMP:
 			doveadm_mail_help_name(DOVEADM_FLATCURVE_CMD_NAME_DUMP);
 			break;
+		case FTS_FLATCURVE_CMD_REINDEX:
+			doveadm_mail_help_name(DOVEADM_FLATCURVE_CMD_NAME_REINDEX);
+			break;
 		case FTS_FLATCURVE_CMD_REMOVE:
 			doveadm_mail_help_name(DOVEADM_FLATCURVE_CMD_NAME_REMOVE);
 			break;
@@ -252,6 +389,9 @@ cmd_fts_flatcurve_mailbox_init(struct doveadm_mail_cmd_context *_ctx,
 		case FTS_FLATCURVE_CMD_STATS:
 			doveadm_mail_help_name(DOVEADM_FLATCURVE_CMD_NAME_STATS);
 			break;
+		case FTS_FLATCURVE_CMD_WARMUP:
+			doveadm_mail_help_name(DOVEADM_FLATCURVE_CMD_NAME_WARMUP);
+			break;
 		default:
 			i_unreached();
 		}
@@ -266,15 +406,6 @@ cmd_fts_flatcurve_mailbox_deinit(struct doveadm_mail_cmd_context *_ctx)
 	struct fts_flatcurve_mailbox_cmd_context *ctx =
 		(struct fts_flatcurve_mailbox_cmd_context *)_ctx;
 
-	switch (ctx->cmd_type) {
-	case FTS_FLATCURVE_CMD_DUMP:
-		if (hash_table_is_created(ctx->terms))
-			hash_table_destroy(&ctx->terms);
-		break;
-	default:
-		break;
-	}
-
 	if (ctx->search_args != NULL)
 		mail_search_args_unref(&ctx->search_args);
 }
@@ -295,9 +426,32 @@ cmd_fts_flatcurve_mailbox_alloc(enum fts_flatcurve_cmd_type type)
 	return &ctx->ctx;
 }
 
+static bool
+cmd_fts_flatcurve_check_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
+{
+	struct fts_flatcurve_mailbox_cmd_context *ctx =
+		(struct fts_flatcurve_mailbox_cmd_context *)_ctx;
+
+	switch (c) {
+	case 'q':
+		ctx->check_quick = TRUE;
+		break;
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_check_alloc(void)
 {
-	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_CHECK);
+	struct doveadm_mail_cmd_context *_ctx;
+
+	_ctx = cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_CHECK);
+	_ctx->getopt_args = "q";
+	_ctx->v.parse_arg = cmd_fts_flatcurve_check_parse_arg;
+
+	return _ctx;
 }
 
 static bool
@@ -310,6 +464,13 @@ cmd_fts_flatcurve_dump_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
 	case 'h':
 		ctx->dump_header = TRUE;
 		break;
+	case 'n':
+		if (str_to_uint(optarg, &ctx->dump_limit) < 0)
+			return FALSE;
+		break;
+	case 'p':
+		ctx->dump_prefix = p_strdup(_ctx->pool, optarg);
+		break;
 	default:
 		return FALSE;
 	}
@@ -320,18 +481,19 @@ cmd_fts_flatcurve_dump_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
 static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_dump_alloc(void)
 {
 	struct doveadm_mail_cmd_context *_ctx;
-	struct fts_flatcurve_mailbox_cmd_context *ctx;
 
 	_ctx = cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_DUMP);
-	_ctx->getopt_args = "h";
+	_ctx->getopt_args = "hn:p:";
 	_ctx->v.parse_arg = cmd_fts_flatcurve_dump_parse_arg;
 
-	ctx = (struct fts_flatcurve_mailbox_cmd_context *)_ctx;
-	hash_table_create(&ctx->terms, default_pool, 1024, str_hash, strcmp);
-
 	return _ctx;
 }
 
+static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_reindex_alloc(void)
+{
+	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_REINDEX);
+}
+
 static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_remove_alloc(void)
 {
 	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_REMOVE);
@@ -342,28 +504,68 @@ static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_rotate_alloc(void)
 	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_ROTATE);
 }
 
+static bool
+cmd_fts_flatcurve_stats_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
+{
+	struct fts_flatcurve_mailbox_cmd_context *ctx =
+		(struct fts_flatcurve_mailbox_cmd_context *)_ctx;
+
+	switch (c) {
+	case 's':
+		ctx->stats_shards = TRUE;
+		break;
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_stats_alloc(void)
 {
-	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_STATS);
+	struct doveadm_mail_cmd_context *_ctx;
+
+	_ctx = cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_STATS);
+	_ctx->getopt_args = "s";
+	_ctx->v.parse_arg = cmd_fts_flatcurve_stats_parse_arg;
+
+	return _ctx;
+}
+
+static struct doveadm_mail_cmd_context *cmd_fts_flatcurve_warmup_alloc(void)
+{
+	return cmd_fts_flatcurve_mailbox_alloc(FTS_FLATCURVE_CMD_WARMUP);
 }
 
 static struct doveadm_cmd_ver2 fts_flatcurve_commands[] = {
 	{
 		.name = DOVEADM_FLATCURVE_CMD_NAME_CHECK,
-		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<mailbox query>",
+		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-q] <mailbox query>",
 		.mail_cmd = cmd_fts_flatcurve_check_alloc,
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('q', "quick", CMD_PARAM_BOOL, 0)
 DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 	},
 	{
 		.name = DOVEADM_FLATCURVE_CMD_NAME_DUMP,
-		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-h] <mailbox query>",
+		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-h] [-n <limit>] [-p <prefix>] <mailbox query>",
 		.mail_cmd = cmd_fts_flatcurve_dump_alloc,
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
 DOVEADM_CMD_PARAM('h', "header", CMD_PARAM_BOOL, 0)
+DOVEADM_CMD_PARAM('n', "limit", CMD_PARAM_INT64, 0)
+DOVEADM_CMD_PARAM('p', "prefix", CMD_PARAM_STR, 0)
+DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
+DOVEADM_CMD_PARAMS_END
+	},
+	{
+		.name = DOVEADM_FLATCURVE_CMD_NAME_REINDEX,
+		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<mailbox query>",
+		.mail_cmd = cmd_fts_flatcurve_reindex_alloc,
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
 DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 	},
@@ -387,10 +589,20 @@ DOVEADM_CMD_PARAMS_END
 	},
 	{
 		.name = DOVEADM_FLATCURVE_CMD_NAME_STATS,
-		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<mailbox query>",
+		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-s] <mailbox query>",
 		.mail_cmd = cmd_fts_flatcurve_stats_alloc,
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('s', "shards", CMD_PARAM_BOOL, 0)
+DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
+DOVEADM_CMD_PARAMS_END
+	},
+	{
+		.name = DOVEADM_FLATCURVE_CMD_NAME_WARMUP,
+		.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<mailbox query>",
+		.mail_cmd = cmd_fts_flatcurve_warmup_alloc,
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
 DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 	}
@@ -9,8 +9,17 @@
 
 #include <xapian.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <set>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
 #include "fts-flatcurve-config.h"
 extern "C" {
 #include "lib.h"
@@ -23,12 +32,15 @@ extern "C" {
 #include "md5.h"
 #include "sleep.h"
 #include "str.h"
+#include "strnum.h"
 #include "time-util.h"
 #include "unichar.h"
 #include "fts-backend-flatcurve.h"
 #include "fts-backend-flatcurve-xapian.h"
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/file.h>
 };
 
 /* How Xapian DBs work in fts-flatcurve: all data lives in under one
@@ -58,7 +70,15 @@ extern "C" {
  * Data storage: Xapian does not support substring searches by default, so
  * (if substring searching is enabled) we instead need to explicitly store all
  * substrings of the string, up to the point where the substring becomes
- * smaller than min_term_size. */
+ * smaller than min_term_size.
+ *
+ * Each document additionally stores the received date, sent date, and
+ * virtual size of the message as values, so that date and size searches can
+ * be filtered by Xapian. Documents indexed before values were added will not
+ * have them, nor will documents whose value could not be looked up without
+ * reading the message; if any document in the DB is missing a value,
+ * searches on it fall back to returning "maybe" results that Dovecot
+ * verifies. */
 #define FLATCURVE_XAPIAN_DB_PREFIX "index."
 #define FLATCURVE_XAPIAN_DB_CURRENT_PREFIX "current."
 
@@ -76,29 +96,101 @@ extern "C" {
 #define FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX   "A"
 #define FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX "B"
 #define FLATCURVE_XAPIAN_HEADER_PREFIX        "H"
+#define FLATCURVE_XAPIAN_PROMOTED_PREFIX      "P"
+
+/* Value slots: message dates and size, used to filter date and size
+ * searches inside of Xapian. */
+#define FLATCURVE_XAPIAN_VALUE_RECEIVED 0
+#define FLATCURVE_XAPIAN_VALUE_SENT     1
+#define FLATCURVE_XAPIAN_VALUE_SIZE     2
+#define FLATCURVE_XAPIAN_VALUE_NONE     Xapian::BAD_VALUENO
 
 #define FLATCURVE_XAPIAN_ALL_HEADERS_QP "allhdrs"
 #define FLATCURVE_XAPIAN_HEADER_BOOL_QP "hdr_bool"
 #define FLATCURVE_XAPIAN_HEADER_QP      "hdr_"
 #define FLATCURVE_XAPIAN_BODY_QP        "body"
+#define FLATCURVE_XAPIAN_RECEIVED_QP    "received"
+#define FLATCURVE_XAPIAN_SENT_QP        "sent"
+#define FLATCURVE_XAPIAN_SIZE_QP        "size"
 
 /* Version database, so that any schema changes can be caught. */
 #define FLATCURVE_XAPIAN_DB_KEY_PREFIX "dovecot."
 #define FLATCURVE_XAPIAN_DB_VERSION_KEY FLATCURVE_XAPIAN_DB_KEY_PREFIX \
 	FTS_FLATCURVE_LABEL
 #define FLATCURVE_XAPIAN_DB_VERSION 1
+/* UUID and revision of the shard after its last successful full check (a
+ * compacted shard has a new UUID). */
+#define FLATCURVE_XAPIAN_DB_CHECKED_KEY FLATCURVE_XAPIAN_DB_KEY_PREFIX \
+	"checked"
+/* Checkpoint of a manual optimization: "<shards fingerprint>:<last docid>". */
+#define FLATCURVE_XAPIAN_DB_REBUILD_KEY FLATCURVE_XAPIAN_DB_KEY_PREFIX \
+	"rebuild"
 
 #define FLATCURVE_DBW_LOCK_RETRY_SECS 1
 #define FLATCURVE_DBW_LOCK_RETRY_MAX 60
-#define FLATCURVE_MANUAL_OPTIMIZE_COMMIT_LIMIT 500
+
+/* Below this number of hits, query results are sorted with a comparison
+ * sort rather than a radix sort. */
+#define FLATCURVE_XAPIAN_RADIX_SORT_MIN 65536
+
+/* Below this number of documents, a mailbox is searched on the calling
+ * thread even if fts_flatcurve_query_threads is set: starting the threads
+ * and copying the queries would cost more than the search itself. */
+#define FLATCURVE_XAPIAN_QUERY_THREADS_MIN_DOCS 10000
+
+#define FLATCURVE_MANUAL_OPTIMIZE_COMMIT_LIMIT 2000
+
+/* fts_flatcurve_rotate_bytes: a current shard that hasn't been measured with
+ * documents in it yet is committed (and measured) after this many changes,
+ * so that its size can be predicted. */
+#define FLATCURVE_XAPIAN_ROTATE_BYTES_MEASURE_DOCS 100
+
+/* The query planner expands wildcards itself (once per distinct pattern in
+ * a query), so the expansion can be shared by all subqueries using it.
+ * Wildcards expanding to more terms than this are left for Xapian to
+ * expand at match time. */
+#define FLATCURVE_XAPIAN_PLAN_EXPAND_MAX 10000
+
+/* Maximum number of terms stored in the (process wide) wildcard expansion
+ * cache of index shards. The cache is emptied once this is reached. */
+#define FLATCURVE_XAPIAN_EXPAND_CACHE_MAX_TERMS 100000
+
+/* doveadm fts-flatcurve dump: maximum number of shards kept open at once.
+ * The terms of each batch of shards are written to a sorted temporary file,
+ * and the files are merged when the terms are read. */
+#define FLATCURVE_XAPIAN_TERMS_BATCH_SHARDS 128
+
+/* How often (in matched documents) the query deadline is checked. */
+#define FLATCURVE_XAPIAN_DEADLINE_CHECK 64
+
+/* Optimization: lock files (in mail_temp_dir) used to limit the number of
+ * concurrent optimizations on a host, and how often (in msecs) to retry
+ * when all of them are in use. */
+#define FLATCURVE_XAPIAN_OPTIMIZE_SLOT_FNAME FTS_FLATCURVE_LABEL "-optimize"
+#define FLATCURVE_XAPIAN_OPTIMIZE_SLOT_WAIT_MSECS 500
+/* Number of times the compaction is restarted if a shard is modified (e.g.
+ * by expunges) too often while it is being read. */
+#define FLATCURVE_XAPIAN_OPTIMIZE_RETRIES 3
+/* Number of times (once per second) replacing the shards with the optimized
+ * DB is retried while another process is writing to one of them. */
+#define FLATCURVE_XAPIAN_OPTIMIZE_SWAP_RETRIES 30
 
 /* Dotlock: needed to ensure we don't run into race conditions when
  * manipulating current directory. */
 #define FLATCURVE_XAPIAN_LOCK_FNAME "flatcurve-lock"
 #define FLATCURVE_XAPIAN_LOCK_TIMEOUT_SECS 5
+#define FLATCURVE_XAPIAN_LOCK_OPTIMIZE_SUFFIX ".optimize"
 
 #define ENUM_EMPTY(x) ((enum x) 0)
 
+/* Warm-up: the (file name prefixes of the) Xapian tables read when
+ * searching, most important first. */
+static const char *const flatcurve_xapian_warmup_tables[] = {
+	"postlist.",
+	"termlist.",
+	NULL
+};
+
 
 struct flatcurve_xapian_db_path {
 	const char *fname;
@@ -119,6 +211,11 @@ struct flatcurve_xapian_db {
 	struct flatcurve_xapian_db_path *dbpath;
 	unsigned int changes;
 	enum flatcurve_xapian_db_type type;
+	/* Size on disk, and number of documents, of the shard when it was
+	 * last committed (only measured if fts_flatcurve_rotate_bytes is
+	 * set). */
+	uoff_t size;
+	unsigned int size_docs;
 };
 HASH_TABLE_DEFINE_TYPE(xapian_db, char *, struct flatcurve_xapian_db *);
 
@@ -129,6 +226,14 @@ struct flatcurve_xapian {
 	HASH_TABLE_TYPE(xapian_db) dbs;
 	unsigned int shards;
 
+	/* Sorted UIDs of all documents in db_read; calculated on demand and
+	 * cached until db_read changes. */
+	std::vector<uint32_t> *uids;
+#ifdef XAPIAN_HAS_GET_REVISION
+	/* Sum of the shard revisions when uids was calculated. */
+	uint64_t uids_revision;
+#endif
+
 	/* Locking for current shard manipulation. */
 	struct file_lock *lock;
 	const char *lock_path;
@@ -144,6 +249,12 @@ struct flatcurve_xapian {
 	unsigned int doc_updates;
 	bool doc_created:1;
 
+	/* Approximate memory of the documents indexed since the last commit,
+	 * and the peak memory held since init (see
+	 * fts_flatcurve_xapian_memory()). */
+	size_t uncommitted_bytes;
+	size_t memory_peak;
+
 	/* List of mailboxes to optimize at shutdown. */
 	HASH_TABLE(char *, char *) optimize;
 
@@ -151,17 +262,260 @@ struct flatcurve_xapian {
 	bool closing:1;
 };
 
-struct flatcurve_fts_query_xapian_maybe {
+struct flatcurve_fts_query_xapian_arg {
+	/* Positive (non-negated) form of the search argument. */
 	Xapian::Query *query;
+	/* The terms (or wildcard prefixes) that make up the query; used by
+	 * the query planner to estimate the number of matching documents. */
+	ARRAY_TYPE(const_string) terms;
+
+	/* Non-indexed header searches: the (lowercase) header name, and the
+	 * query to use instead if the header has been promoted to a
+	 * dedicated header index in every document of the DB. */
+	const char *hdr;
+	Xapian::Query *hdr_query;
+	ARRAY_TYPE(const_string) hdr_terms;
+
+	/* Date/size searches: the value slot being filtered on. */
+	Xapian::valueno slot;
+
+	bool match_not:1;
+	bool maybe:1;
+	bool wildcard:1;
 };
 
 struct flatcurve_fts_query_xapian {
+	/* Queries generated by the planner for the DB currently being
+	 * searched. */
 	Xapian::Query *query;
-	ARRAY(struct flatcurve_fts_query_xapian_maybe) maybe_queries;
+	Xapian::Query *maybe_query;
+	/* Negations evaluated as a complement: documents NOT matching this
+	 * query are added to the results. */
+	Xapian::Query *not_query;
+
+	ARRAY(struct flatcurve_fts_query_xapian_arg) args;
+
+	/* Of the last run of the query. */
+	struct fts_flatcurve_xapian_query_profile profile;
 
 	bool and_search:1;
 	bool maybe:1;
 	bool start:1;
+	/* A wildcard expanded to more terms than allowed. */
+	bool truncated:1;
+	/* The query timeout was reached while planning the query. */
+	bool timed_out:1;
+};
+
+struct flatcurve_fts_query_xapian_plan {
+	Xapian::doccount estimate;
+	const Xapian::Query *query;
+
+	bool operator<(const struct flatcurve_fts_query_xapian_plan &p) const
+	{
+		return estimate < p.estimate;
+	}
+};
+
+struct flatcurve_fts_query_xapian_expansion {
+	Xapian::Query query;
+	Xapian::doccount estimate;
+	/* The number of terms the pattern was expanded to (limited to
+	 * enough terms to know whether the expansion is truncated). */
+	unsigned int terms;
+	/* More than fts_flatcurve_query_max_expansion terms. */
+	bool truncated;
+};
+typedef std::map<std::string, struct flatcurve_fts_query_xapian_expansion>
+	flatcurve_fts_query_xapian_expansions;
+
+typedef std::vector<std::pair<std::string, Xapian::doccount> >
+	flatcurve_xapian_expand_terms;
+
+#ifdef XAPIAN_HAS_GET_REVISION
+/* Wildcard expansion of an index shard. "index" shards are only modified
+ * by expunges and optimization, so expansions can be reused across queries
+ * (and sessions in the same process) until the shard revision changes. */
+struct flatcurve_xapian_expand_cache_entry {
+	Xapian::rev revision;
+	/* The maximum number of terms that were looked up. */
+	unsigned int limit;
+	/* All matching terms are contained in terms. */
+	bool complete;
+	flatcurve_xapian_expand_terms terms;
+};
+/* Key: shard path + NUL + shard UUID + NUL + pattern (the UUID changes if
+ * the shard is replaced, e.g. by an optimization, at the same path). */
+static std::map<std::string, struct flatcurve_xapian_expand_cache_entry>
+	flatcurve_xapian_expand_cache;
+static size_t flatcurve_xapian_expand_cache_terms = 0;
+#endif
+
+struct flatcurve_fts_query_xapian_hit {
+	uint32_t uid;
+	float score;
+};
+
+/* Query run against a single Database (a shard when searching in parallel,
+ * otherwise the combined DB). Only Xapian objects and std containers may be
+ * used by these, since Dovecot code is not thread safe. */
+struct flatcurve_xapian_shard_query {
+	Xapian::Database *db;
+	/* Searching the combined DB (docids are interleaved). */
+	bool combined;
+
+	/* Copies of the planned queries (see fts_flatcurve_xapian_plan_query;
+	 * maybe_query is combined with query). Xapian::Query objects are
+	 * reference counted without locking, so each job needs its own copy,
+	 * which is not shared with any other job. */
+	Xapian::Query query, maybe_query, not_query;
+	bool has_query, has_maybe_query, has_not_query;
+	bool maybe;
+
+	/* Query time budget (see fts_flatcurve_query_timeout). */
+	std::chrono::steady_clock::time_point deadline;
+	bool use_deadline;
+	bool timed_out;
+
+	std::vector<struct flatcurve_fts_query_xapian_hit> hits, maybe_hits, nots;
+	std::string error;
+};
+
+/* Thrown by the deadline decider to abort Enquire::get_mset(). */
+struct flatcurve_xapian_deadline_exceeded {};
+
+/* Enquire::set_time_limit() only turns off check_at_least, which is not
+ * used (all matches are needed), so the deadline is enforced by aborting
+ * the match instead. The documents matched up to that point are recorded,
+ * so they can be returned as partial results. */
+class flatcurve_xapian_deadline_decider : public Xapian::MatchDecider {
+	const struct flatcurve_xapian_shard_query *sq;
+	mutable unsigned int calls;
+
+public:
+	mutable std::vector<struct flatcurve_fts_query_xapian_hit> matched;
+
+	explicit flatcurve_xapian_deadline_decider(const struct flatcurve_xapian_shard_query *_sq)
+		: sq(_sq), calls(0) { }
+
+	bool operator()(const Xapian::Document &doc) const
+	{
+		struct flatcurve_fts_query_xapian_hit hit;
+
+		if (((++calls % FLATCURVE_XAPIAN_DEADLINE_CHECK) == 0) &&
+		    (std::chrono::steady_clock::now() >= sq->deadline))
+			throw flatcurve_xapian_deadline_exceeded();
+
+		hit.uid = doc.get_docid();
+		hit.score = 0;
+		matched.push_back(hit);
+		return true;
+	}
+};
+
+/* Work shared between the threads of fts_flatcurve_xapian_run_jobs(). */
+typedef void flatcurve_xapian_job_t(void *context, unsigned int idx);
+struct flatcurve_xapian_jobs {
+	flatcurve_xapian_job_t *job;
+	void *context;
+	unsigned int count;
+	std::atomic<unsigned int> next;
+};
+
+/* Check of a single shard. The shard paths are collected by the main thread;
+ * the check jobs only use Xapian, so that shards can be checked in
+ * parallel. */
+struct flatcurve_xapian_check_shard {
+	std::string fname, path;
+
+	/* Set by the check job. */
+	std::string error;
+	size_t errors;
+	bool checked;
+};
+
+struct flatcurve_xapian_check {
+	std::vector<struct flatcurve_xapian_check_shard> shards;
+	bool quick;
+};
+
+/* Optimization of a single mailbox. The mailbox is locked (and its shards
+ * listed) by the main thread; the compaction job only uses Xapian, so that
+ * several mailboxes can be compacted at the same time. */
+struct flatcurve_xapian_optimize_box {
+	const char *boxname, *db_path;
+	std::vector<std::string> shards;
+	std::string target;
+	struct file_lock *lock;
+	/* Fingerprint of the shards, for the manual optimization checkpoint.
+	 * If resume is set, target holds an interrupted manual optimization
+	 * of the same shards. */
+	std::string fingerprint;
+	bool resume;
+
+	/* Set by the compaction job. states are the shard states that were
+	 * compacted, to detect changes made to the shards meanwhile. */
+	std::vector<std::string> states;
+	std::string error, fallback;
+	Xapian::docid resumed;
+	bool checkpoint;
+	unsigned int msecs;
+};
+
+/* Shard being copied by fts_flatcurve_xapian_optimize_rebuild(). */
+struct flatcurve_xapian_rebuild_shard {
+	Xapian::Database db;
+	Xapian::PostingIterator p;
+};
+
+/* Indexed UIDs of a mailbox (for rescan). The shards are listed by the
+ * main thread, and read by a job. */
+struct flatcurve_xapian_prefetch_box {
+	std::vector<std::string> shards;
+	std::vector<uint32_t> uids;
+	std::string error;
+	bool exists;
+};
+
+struct fts_flatcurve_xapian_prefetch {
+	struct flatcurve_fts_backend *backend;
+	std::vector<struct flatcurve_xapian_prefetch_box> boxes;
+};
+
+struct fts_flatcurve_xapian_terms_run {
+	FILE *fp;
+	std::string term;
+	unsigned int count;
+	bool eof;
+};
+
+/* Body terms and (prefix stripped) all headers terms are counted together,
+ * so both are merged while iterating. */
+struct fts_flatcurve_xapian_terms {
+	struct flatcurve_fts_backend *backend;
+	/* Shards of the current batch. */
+	Xapian::Database db;
+	unsigned int db_shards;
+	/* Sorted (term, count) files of the earlier batches. */
+	std::vector<struct fts_flatcurve_xapian_terms_run> runs;
+	std::string prefix;
+	std::string term;
+	Xapian::TermIterator t, tend, a, aend;
+	bool headers;
+	bool started;
+	bool merging;
+	bool failed;
+};
+
+struct fts_flatcurve_xapian_optimize {
+	struct flatcurve_fts_backend *backend;
+	pool_t pool;
+	std::vector<struct flatcurve_xapian_optimize_box *> boxes;
+	ARRAY_TYPE(const_string) failed;
+
+	/* Host wide limit of concurrent optimizations. */
+	std::string slot_prefix;
+	unsigned int slots;
 };
 
 struct flatcurve_xapian_db_iter {
@@ -186,21 +540,9 @@ enum flatcurve_xapian_db_close {
 	FLATCURVE_XAPIAN_DB_CLOSE_WDB        = BIT(1),
 	FLATCURVE_XAPIAN_DB_CLOSE_DB         = BIT(2),
 	FLATCURVE_XAPIAN_DB_CLOSE_ROTATE     = BIT(3),
-	FLATCURVE_XAPIAN_DB_CLOSE_MBOX       = BIT(4)
-};
-
-/* Externally accessible struct. */
-struct fts_flatcurve_xapian_query_iter {
-	struct flatcurve_fts_backend *backend;
-	struct flatcurve_fts_query *query;
-	Xapian::Database *db;
-	Xapian::Enquire *enquire;
-	Xapian::MSetIterator i;
-	Xapian::MSet m;
-	struct fts_flatcurve_xapian_query_result *result;
-
-	bool init:1;
-	bool main_query:1;
+	FLATCURVE_XAPIAN_DB_CLOSE_MBOX       = BIT(4),
+	/* Rotation requested by the user (doveadm fts-flatcurve rotate). */
+	FLATCURVE_XAPIAN_DB_CLOSE_MANUAL     = BIT(5)
 };
 
 static void
@@ -216,6 +558,11 @@ fts_flatcurve_xapian_close_dbs(struct flatcurve_fts_backend *backend,
 static bool
 fts_flatcurve_xapian_db_populate(struct flatcurve_fts_backend *backend,
 				 enum flatcurve_xapian_db_opts opts);
+static uoff_t fts_flatcurve_xapian_db_size(const char *path, time_t *mtime_r);
+static void
+fts_flatcurve_xapian_measure_db(struct flatcurve_fts_backend *backend,
+				struct flatcurve_xapian_db *xdb);
+static void fts_flatcurve_xapian_uids_reset(struct flatcurve_xapian *x);
 
 
 void fts_flatcurve_xapian_init(struct flatcurve_fts_backend *backend)
@@ -245,6 +592,7 @@ void fts_flatcurve_xapian_deinit(struct flatcurve_fts_backend *backend)
 		hash_table_destroy(&x->optimize);
 	}
 	hash_table_destroy(&x->dbs);
+	fts_flatcurve_xapian_uids_reset(x);
 	pool_unref(&x->pool);
 	x->deinit = FALSE;
 }
@@ -340,6 +688,32 @@ fts_flatcurve_xapian_db_iter_deinit(struct flatcurve_xapian_db_iter **_iter)
 	p_free(iter->backend->xapian->pool, iter);
 }
 
+/* Emits the time spent acquiring a lock: the mailbox (or optimize) lock
+ * file, or the Xapian lock of a shard (write). */
+static void
+fts_flatcurve_xapian_lock_wait(struct flatcurve_fts_backend *backend,
+			       const char *lock, const char *name,
+			       const struct timeval *start,
+			       unsigned int retries, const char *outcome)
+{
+	struct timeval now;
+	long long diff;
+
+	i_gettimeofday(&now);
+	diff = timeval_diff_msecs(&now, start);
+
+	e_debug(event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_lock_wait")->
+		add_str("mailbox", str_c(backend->boxname))->
+		add_str("lock", lock)->
+		add_str("path", name)->
+		add_int("duration", diff)->
+		add_int("retries", retries)->
+		add_str("outcome", outcome)->event(),
+		"Lock wait (%s; %s): %s after %lld msecs, retries=%u", lock,
+		name, outcome, diff, retries);
+}
+
 // throws Exception on error
 static struct flatcurve_xapian_db *
 fts_flatcurve_xapian_write_db_get_do(struct flatcurve_fts_backend *backend,
@@ -348,8 +722,10 @@ fts_flatcurve_xapian_write_db_get_do(struct flatcurve_fts_backend *backend,
 {
 	enum flatcurve_xapian_db_opts opts =
 		FLATCURVE_XAPIAN_DB_NOCLOSE_CURRENT;
-	unsigned int wait = 0;
+	struct timeval start;
+	unsigned int retries = 0, wait = 0;
 
+	i_gettimeofday(&start);
 	while (xdb->dbw == NULL) {
 		try {
 			xdb->dbw = new Xapian::WritableDatabase(
@@ -357,14 +733,25 @@ fts_flatcurve_xapian_write_db_get_do(struct flatcurve_fts_backend *backend,
 		} catch (Xapian::DatabaseLockError &e) {
 			e_debug(backend->event, "Waiting for DB (RW; %s) lock",
 				xdb->dbpath->fname);
+			++retries;
 			wait += FLATCURVE_DBW_LOCK_RETRY_SECS;
-			if (wait > FLATCURVE_DBW_LOCK_RETRY_MAX)
+			if (wait > FLATCURVE_DBW_LOCK_RETRY_MAX) {
+				fts_flatcurve_xapian_lock_wait(backend,
+					"write", xdb->dbpath->fname, &start,
+					retries, "timeout");
 				i_fatal(FTS_FLATCURVE_DEBUG_PREFIX "Could not "
 					"obtain DB lock (RW; %s)",
 					xdb->dbpath->fname);
+			}
 			i_sleep_intr_secs(FLATCURVE_DBW_LOCK_RETRY_SECS);
+		} catch (Xapian::Error &e) {
+			fts_flatcurve_xapian_lock_wait(backend, "write",
+				xdb->dbpath->fname, &start, retries, "fatal");
+			throw;
 		}
 	}
+	fts_flatcurve_xapian_lock_wait(backend, "write", xdb->dbpath->fname,
+				       &start, retries, "acquired");
 
 	return xdb;
 }
@@ -391,8 +778,10 @@ fts_flatcurve_xapian_write_db_get(struct flatcurve_fts_backend *backend,
 		return NULL;
 	}
 
-	if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT)
+	if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) {
 		fts_flatcurve_xapian_check_db_version(backend, xdb);
+		fts_flatcurve_xapian_measure_db(backend, xdb);
+	}
 
 	e_debug(backend->event, "Opened DB (RW; %s) messages=%u version=%u",
 		xdb->dbpath->fname, xdb->dbw->get_doccount(),
@@ -513,16 +902,46 @@ fts_flatcurve_xapian_db_add(struct flatcurve_fts_backend *backend,
 	return xdb;
 }
 
-static int fts_flatcurve_xapian_lock(struct flatcurve_fts_backend *backend)
+static int
+fts_flatcurve_xapian_lock_do(struct flatcurve_fts_backend *backend,
+			     const char *lock, const char *path,
+			     struct file_lock **lock_r)
 {
 	struct file_create_settings set;
-	struct flatcurve_xapian *x = backend->xapian;
+	struct timeval start;
+	bool created;
+	const char *error;
+	int ret;
 
 	i_zero(&set);
 	set.lock_timeout_secs = FLATCURVE_XAPIAN_LOCK_TIMEOUT_SECS;
 	set.lock_settings.close_on_free = TRUE;
 	set.lock_settings.unlink_on_free = TRUE;
 	set.lock_settings.lock_method = backend->parsed_lock_method;
+	if (str_len(backend->volatile_dir) > 0)
+		set.mkdir_mode = 0700;
+
+	/* The lock is retried (until the timeout) by file_create_locked(),
+	 * so no retries are counted. */
+	i_gettimeofday(&start);
+	ret = file_create_locked(path, &set, lock_r, &created, &error);
+	if (ret < 0) {
+		e_error(backend->event, "file_create_locked(%s) failed: %m",
+			path);
+		fts_flatcurve_xapian_lock_wait(backend, lock, path, &start, 0,
+			(errno == EAGAIN) ? "timeout" : "fatal");
+	} else {
+		fts_flatcurve_xapian_lock_wait(backend, lock, path, &start, 0,
+					       "acquired");
+	}
+
+	return ret;
+}
+
+static const char *
+fts_flatcurve_xapian_lock_path(struct flatcurve_fts_backend *backend)
+{
+	struct flatcurve_xapian *x = backend->xapian;
 
 	if (x->lock_path == NULL) {
 		if (str_len(backend->volatile_dir) > 0) {
@@ -533,7 +952,6 @@ static int fts_flatcurve_xapian_lock(struct flatcurve_fts_backend *backend)
 				x->pool, "%s/" FLATCURVE_XAPIAN_LOCK_FNAME ".%s",
 				str_c(backend->volatile_dir),
 				binary_to_hex(db_path_hash, sizeof(db_path_hash)));
-			set.mkdir_mode = 0700;
 		} else {
 			x->lock_path = p_strdup_printf(
 				x->pool, "%s" FLATCURVE_XAPIAN_LOCK_FNAME,
@@ -541,21 +959,166 @@ static int fts_flatcurve_xapian_lock(struct flatcurve_fts_backend *backend)
 		}
 	}
 
-	bool created;
-	const char *error;
-	int ret = file_create_locked(x->lock_path, &set, &x->lock, &created, &error);
-	if (ret < 0)
-		e_error(backend->event, "file_create_locked(%s) failed: %m",
-			x->lock_path);
+	return x->lock_path;
+}
 
-	return ret;
+static int fts_flatcurve_xapian_lock(struct flatcurve_fts_backend *backend)
+{
+	return fts_flatcurve_xapian_lock_do(
+		backend, "mailbox", fts_flatcurve_xapian_lock_path(backend),
+		&backend->xapian->lock);
+}
+
+#ifdef XAPIAN_HAS_COMPACT
+/* Only one process at a time can optimize a mailbox. This is a separate lock,
+ * as the mailbox lock is only held while the shards are rotated and swapped,
+ * not while they are being compacted. */
+static int
+fts_flatcurve_xapian_lock_optimize(struct flatcurve_fts_backend *backend,
+				   struct file_lock **lock_r)
+{
+	return fts_flatcurve_xapian_lock_do(
+		backend, "optimize",
+		t_strconcat(fts_flatcurve_xapian_lock_path(backend),
+			    FLATCURVE_XAPIAN_LOCK_OPTIMIZE_SUFFIX, NULL),
+		lock_r);
 }
+#endif
 
 static void fts_flatcurve_xapian_unlock(struct flatcurve_fts_backend *backend)
 {
 	file_lock_free(&backend->xapian->lock);
 }
 
+static void fts_flatcurve_xapian_uids_reset(struct flatcurve_xapian *x)
+{
+	delete(x->uids);
+	x->uids = NULL;
+}
+
+#ifdef XAPIAN_HAS_GET_REVISION
+/* Every commit to a shard increases its revision, so the sum changes
+ * whenever the documents of the mailbox DB may have. Throws Xapian::Error. */
+static uint64_t fts_flatcurve_xapian_uids_revision(struct flatcurve_xapian *x)
+{
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	struct flatcurve_xapian_db *xdb;
+	uint64_t rev = 0;
+
+	iter = hash_table_iterate_init(x->dbs);
+	try {
+		while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+			xdb = (struct flatcurve_xapian_db *)val;
+			if (xdb->db != NULL)
+				rev += xdb->db->get_revision();
+		}
+	} catch (Xapian::Error &e) {
+		hash_table_iterate_deinit(&iter);
+		throw;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	return rev;
+}
+#endif
+
+/* Returns the sorted UIDs of all documents in the mailbox DB. Throws
+ * Xapian::Error. */
+static const std::vector<uint32_t> *
+fts_flatcurve_xapian_all_uids(struct flatcurve_fts_backend *backend)
+{
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	Xapian::PostingIterator p;
+	std::vector<uint32_t> *uids;
+	struct flatcurve_xapian_db *xdb;
+	struct flatcurve_xapian *x = backend->xapian;
+
+	if (x->uids != NULL)
+		return x->uids;
+
+	uids = new std::vector<uint32_t>();
+	if (x->db_read != NULL)
+		uids->reserve(x->db_read->get_doccount());
+
+	/* The combined DB returns interleaved docids, so walk the shards
+	 * (which use the UIDs as docids) individually. */
+	iter = hash_table_iterate_init(x->dbs);
+	try {
+		while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+			xdb = (struct flatcurve_xapian_db *)val;
+			if (xdb->db == NULL)
+				continue;
+			for (p = xdb->db->postlist_begin("");
+			     p != xdb->db->postlist_end(""); ++p)
+				uids->push_back(*p);
+		}
+	} catch (Xapian::Error &e) {
+		hash_table_iterate_deinit(&iter);
+		delete(uids);
+		throw;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	if (x->shards > 1) {
+		std::sort(uids->begin(), uids->end());
+		uids->erase(std::unique(uids->begin(), uids->end()),
+			    uids->end());
+	}
+
+#ifdef XAPIAN_HAS_GET_REVISION
+	try {
+		x->uids_revision = fts_flatcurve_xapian_uids_revision(x);
+	} catch (Xapian::Error &e) {
+		delete(uids);
+		throw;
+	}
+#endif
+	x->uids = uids;
+	return uids;
+}
+
+static void fts_flatcurve_xapian_run_jobs_worker(struct flatcurve_xapian_jobs *jobs)
+{
+	unsigned int idx;
+
+	while ((idx = jobs->next++) < jobs->count)
+		jobs->job(jobs->context, idx);
+}
+
+/* Run job(context, idx) for every idx in [0, count), using up to "threads"
+ * threads (including the calling thread). Jobs must not use any Dovecot
+ * APIs (e.g. pools, events, logging) and must not throw. If threads can't
+ * be created, the remaining jobs are run by the calling thread. */
+static void
+fts_flatcurve_xapian_run_jobs(unsigned int threads, unsigned int count,
+			      flatcurve_xapian_job_t *job, void *context)
+{
+	struct flatcurve_xapian_jobs jobs;
+	std::vector<std::thread> workers;
+	unsigned int i;
+
+	jobs.job = job;
+	jobs.context = context;
+	jobs.count = count;
+	jobs.next = 0;
+
+	for (i = 1; (i < threads) && (i < count); ++i) {
+		try {
+			workers.push_back(std::thread(
+				fts_flatcurve_xapian_run_jobs_worker, &jobs));
+		} catch (std::system_error &e) {
+			break;
+		}
+	}
+
+	fts_flatcurve_xapian_run_jobs_worker(&jobs);
+
+	for (i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
 static bool
 fts_flatcurve_xapian_db_read_add(struct flatcurve_fts_backend *backend,
 				 struct flatcurve_xapian_db *xdb)
@@ -686,6 +1249,66 @@ fts_flatcurve_xapian_write_db_current(struct flatcurve_fts_backend *backend,
 						 wopts);
 }
 
+#ifdef XAPIAN_HAS_GET_REVISION
+/* The expansion cache key prefix of a shard. Throws Xapian::Error. */
+static std::string
+fts_flatcurve_xapian_expand_cache_shard(struct flatcurve_xapian_db *xdb)
+{
+	return std::string(xdb->dbpath->path) + '\0' + xdb->db->get_uuid() +
+		'\0';
+}
+
+/* Drop the cached expansions of shards of this mailbox that are no longer
+ * part of the DB (rotated, merged by an optimization, or deleted), so that
+ * they don't occupy the cache until it is full. */
+static void
+fts_flatcurve_xapian_expand_cache_evict(struct flatcurve_fts_backend *backend)
+{
+	std::map<std::string, struct flatcurve_xapian_expand_cache_entry>::iterator it;
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	std::set<std::string> shards;
+	std::string prefix, shard;
+	struct flatcurve_xapian_db *xdb;
+	struct flatcurve_xapian *x = backend->xapian;
+
+	if (flatcurve_xapian_expand_cache.empty())
+		return;
+
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if ((xdb->db == NULL) ||
+		    (xdb->type != FLATCURVE_XAPIAN_DB_TYPE_INDEX))
+			continue;
+		try {
+			shards.insert(
+				fts_flatcurve_xapian_expand_cache_shard(xdb));
+		} catch (Xapian::Error &e) {
+			/* Its entries are evicted. */
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+
+	/* All keys of the mailbox share the DB path prefix, and are
+	 * therefore adjacent in the map. */
+	prefix = str_c(backend->db_path);
+	it = flatcurve_xapian_expand_cache.lower_bound(prefix);
+	while ((it != flatcurve_xapian_expand_cache.end()) &&
+	       (it->first.compare(0, prefix.size(), prefix) == 0)) {
+		shard = it->first.substr(0, it->first.find('\0',
+					 it->first.find('\0') + 1) + 1);
+		if (shards.find(shard) == shards.end()) {
+			flatcurve_xapian_expand_cache_terms -=
+				it->second.terms.size();
+			flatcurve_xapian_expand_cache.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+#endif
+
 static Xapian::Database *
 fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
 			     enum flatcurve_xapian_db_opts opts)
@@ -698,7 +1321,16 @@ fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
 
 	if (x->db_read != NULL) {
 		try {
-			(void)x->db_read->reopen();
+			/* Database::reopen() doesn't report whether the DB
+			 * changed in all Xapian versions, so check the shard
+			 * revisions (if available) to keep the cached UIDs. */
+			x->db_read->reopen();
+#ifdef XAPIAN_HAS_GET_REVISION
+			if ((x->uids != NULL) &&
+			    (fts_flatcurve_xapian_uids_revision(x) !=
+			     x->uids_revision))
+#endif
+				fts_flatcurve_xapian_uids_reset(x);
 		} catch (Xapian::DatabaseNotFoundError &e) {
 			/* This means that the underlying databases have
 			 * changed (i.e. DB rotation by another process).
@@ -730,6 +1362,10 @@ fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
 	}
 	hash_table_iterate_deinit(&iter);
 
+#ifdef XAPIAN_HAS_GET_REVISION
+	fts_flatcurve_xapian_expand_cache_evict(backend);
+#endif
+
 	fts_flatcurve_xapian_mailbox_stats(backend, &stats);
 
 	e_debug(backend->event, "Opened DB (RO) messages=%u version=%u "
@@ -738,10 +1374,101 @@ fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
 	return x->db_read;
 }
 
+/* Checks that don't need to read the whole shard: opening the shard reads
+ * its version file and metadata, the DB version must be current, and (as
+ * docids are UIDs) there can't be more documents than the last docid.
+ * Returns TRUE if the shard hasn't changed since its last successful full
+ * check. Runs in a job. Throws Xapian::Error. */
+static bool
+fts_flatcurve_xapian_check_quick(struct flatcurve_xapian_check_shard &cs,
+				 Xapian::rev &rev)
+{
+	Xapian::Database db(cs.path);
+	std::ostringstream ss;
+	std::string ver;
+
+	ver = db.get_metadata(FLATCURVE_XAPIAN_DB_VERSION_KEY);
+	if (std::atoi(ver.c_str()) != FLATCURVE_XAPIAN_DB_VERSION) {
+		cs.error = "Invalid DB version (" + ver + ")";
+		++cs.errors;
+	}
+
+	if (db.get_doccount() > db.get_lastdocid()) {
+		cs.error = "Document count exceeds last docid";
+		++cs.errors;
+	}
+
+	if (cs.errors > 0)
+		return FALSE;
+
+#ifdef XAPIAN_HAS_GET_REVISION
+	rev = db.get_revision();
+	ss << db.get_uuid() << ":" << rev;
+	return (db.get_metadata(FLATCURVE_XAPIAN_DB_CHECKED_KEY) == ss.str());
+#else
+	(void)rev;
+	return FALSE;
+#endif
+}
+
+#ifdef XAPIAN_HAS_GET_REVISION
+/* Record a successful full check of revision "rev" of the shard. If the shard
+ * is being written to (or has changed since it was checked), nothing is
+ * recorded and the next quick check will check it again. Runs in a job.
+ * Throws Xapian::Error. */
+static void
+fts_flatcurve_xapian_check_record(struct flatcurve_xapian_check_shard &cs,
+				  Xapian::rev rev)
+{
+	std::ostringstream ss;
+
+	try {
+		Xapian::WritableDatabase db(cs.path, Xapian::DB_OPEN);
+
+		if (db.get_revision() != rev)
+			return;
+
+		/* Committing the metadata creates the next revision, which
+		 * is the one that has been checked. */
+		ss << db.get_uuid() << ":" << (rev + 1);
+		db.set_metadata(FLATCURVE_XAPIAN_DB_CHECKED_KEY, ss.str());
+		db.commit();
+	} catch (Xapian::DatabaseLockError &e) {
+		/* Being written to; nothing recorded. */
+	}
+}
+#endif
+
+static void fts_flatcurve_xapian_check_job(void *context, unsigned int idx)
+{
+	struct flatcurve_xapian_check *c =
+		(struct flatcurve_xapian_check *)context;
+	struct flatcurve_xapian_check_shard &cs = c->shards[idx];
+	Xapian::rev rev = 0;
+
+	try {
+		if (fts_flatcurve_xapian_check_quick(cs, rev) && c->quick)
+			return;
+
+		cs.errors += Xapian::Database::check(cs.path,
+						     Xapian::DBCHECK_FIX, NULL);
+		cs.checked = TRUE;
+#ifdef XAPIAN_HAS_GET_REVISION
+		if (cs.errors == 0)
+			fts_flatcurve_xapian_check_record(cs, rev);
+#endif
+	} catch (const Xapian::Error &e) {
+		cs.error = e.get_description();
+		++cs.errors;
+	}
+}
+
 void
 fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
-				   struct fts_flatcurve_xapian_db_check *check)
+				   struct fts_flatcurve_xapian_db_check *check,
+				   bool quick)
 {
+	struct flatcurve_xapian_check c;
 	struct hash_iterate_context *iter;
 	void *key, *val;
 	enum flatcurve_xapian_db_opts opts =
@@ -750,6 +1477,7 @@ fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
 		  FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
 	struct flatcurve_xapian *x = backend->xapian;
 	struct flatcurve_xapian_db *xdb;
+	std::vector<struct flatcurve_xapian_check_shard>::const_iterator i;
 
 	i_zero(check);
 
@@ -759,17 +1487,32 @@ fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
 	iter = hash_table_iterate_init(x->dbs);
 	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
 		xdb = (struct flatcurve_xapian_db *)val;
-		try {
-			check->errors += Xapian::Database::check(
-						std::string(xdb->dbpath->path),
-						Xapian::DBCHECK_FIX, NULL);
-		} catch (const Xapian::Error &e) {
-			e_debug(backend->event, "Check failed; %s",
-				e.get_description().c_str());
-		}
-		++check->shards;
+		c.shards.push_back(flatcurve_xapian_check_shard());
+		c.shards.back().fname = xdb->dbpath->fname;
+		c.shards.back().path = xdb->dbpath->path;
+		c.shards.back().errors = 0;
+		c.shards.back().checked = FALSE;
 	}
 	hash_table_iterate_deinit(&iter);
+
+	/* Shards are checked by path, and a successful check is recorded
+	 * in the shard itself, so don't keep them open. */
+	fts_flatcurve_xapian_close(backend);
+
+	c.quick = quick;
+	fts_flatcurve_xapian_run_jobs(
+		I_MAX(backend->fuser->set.maintenance_workers, 1),
+		c.shards.size(), fts_flatcurve_xapian_check_job, &c);
+
+	for (i = c.shards.begin(); i != c.shards.end(); ++i) {
+		if (!i->error.empty())
+			e_debug(backend->event, "Check failed (%s); %s",
+				i->fname.c_str(), i->error.c_str());
+		check->errors += i->errors;
+		if (i->checked)
+			++check->checked;
+		++check->shards;
+	}
 }
 
 bool fts_flatcurve_xapian_mailbox_rotate(struct flatcurve_fts_backend *backend)
@@ -784,7 +1527,9 @@ bool fts_flatcurve_xapian_mailbox_rotate(struct flatcurve_fts_backend *backend)
 		return FALSE;
 
 	fts_flatcurve_xapian_close_db(backend, xdb,
-				      FLATCURVE_XAPIAN_DB_CLOSE_ROTATE);
+		(enum flatcurve_xapian_db_close)
+		 (FLATCURVE_XAPIAN_DB_CLOSE_ROTATE |
+		  FLATCURVE_XAPIAN_DB_CLOSE_MANUAL));
 
 	return TRUE;
 }
@@ -809,66 +1554,357 @@ fts_flatcurve_xapian_mailbox_stats(struct flatcurve_fts_backend *backend,
 	}
 }
 
-static void
-fts_flatcurve_xapian_mailbox_terms_do(struct flatcurve_fts_backend *backend,
-				      HASH_TABLE_TYPE(term_counter) terms,
-				      const char *prefix)
+static bool
+fts_flatcurve_xapian_shard_cmp(const struct flatcurve_xapian_db *xdb1,
+			       const struct flatcurve_xapian_db *xdb2)
 {
-	unsigned int counter;
-	Xapian::Database *db;
-	const char *key, *pkey;
-	void *k, *v;
+	return (strcmp(xdb1->dbpath->fname, xdb2->dbpath->fname) < 0);
+}
+
+void
+fts_flatcurve_xapian_mailbox_shard_stats(struct flatcurve_fts_backend *backend,
+					 pool_t pool,
+					 ARRAY_TYPE(fts_flatcurve_xapian_shard_stats) *stats)
+{
+	struct hash_iterate_context *iter;
+	void *key, *val;
 	enum flatcurve_xapian_db_opts opts =
 		(enum flatcurve_xapian_db_opts)
 		 (FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
 		  FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
-	Xapian::TermIterator t, tend;
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db *xdb;
+	std::vector<struct flatcurve_xapian_db *> shards;
+	std::vector<struct flatcurve_xapian_db *>::const_iterator i;
+	struct fts_flatcurve_xapian_shard_stats *s;
+	Xapian::PostingIterator p;
+	Xapian::TermIterator t;
+	uint32_t range;
 
-	if ((db = fts_flatcurve_xapian_read_db(backend, opts)) == NULL)
+	if ((x->db_read == NULL) &&
+	    (fts_flatcurve_xapian_read_db(backend, opts) == NULL))
 		return;
 
-	for (t = db->allterms_begin(prefix), tend = db->allterms_end(prefix); t != tend; ++t) {
-		const std::string &term = *t;
-		key = term.data();
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (xdb->db != NULL)
+			shards.push_back(xdb);
+	}
+	hash_table_iterate_deinit(&iter);
+	std::sort(shards.begin(), shards.end(), fts_flatcurve_xapian_shard_cmp);
+
+	for (i = shards.begin(); i != shards.end(); ++i) {
+		xdb = *i;
+		s = array_append_space(stats);
+		s->shard = p_strdup(pool, xdb->dbpath->fname);
+		s->type = (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT)
+			? "current" : "index";
+		s->bytes = fts_flatcurve_xapian_db_size(xdb->dbpath->path,
+							&s->last_commit);
 
-		if (strlen(prefix) > 0) {
-			if (strncmp(key, FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX, 1) != 0)
-				continue;
-			++key;
-		} else if (strncmp(key, FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX, 1) == 0) {
-			++key;
-		} else if ((strncmp(key, FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX, 1) == 0) ||
-			   (strncmp(key, FLATCURVE_XAPIAN_HEADER_PREFIX, 1) == 0)) {
-			continue;
+		try {
+			s->messages = xdb->db->get_doccount();
+			s->last_uid = xdb->db->get_lastdocid();
+			s->avg_length = xdb->db->get_avlength();
+			p = xdb->db->postlist_begin("");
+			if (p != xdb->db->postlist_end(""))
+				s->first_uid = *p;
+			for (t = xdb->db->allterms_begin();
+			     t != xdb->db->allterms_end(); ++t)
+				++s->terms;
+		} catch (Xapian::Error &e) {
+			e_debug(backend->event, "Cannot read DB stats (%s); %s",
+				xdb->dbpath->fname,
+				e.get_description().c_str());
+		}
+
+		/* Assume UIDs missing from the shard's UID range were
+		 * expunged, and that they used the same space as the
+		 * remaining messages. */
+		if ((s->messages > 0) && (s->first_uid > 0)) {
+			range = s->last_uid - s->first_uid + 1;
+			if (range > s->messages)
+				s->reclaimable = s->bytes *
+					(range - s->messages) / range;
 		}
+	}
+}
+
+struct fts_flatcurve_xapian_terms *
+fts_flatcurve_xapian_terms_init(struct flatcurve_fts_backend *backend,
+				const char *prefix, bool headers)
+{
+	struct fts_flatcurve_xapian_terms *terms;
+
+	terms = new fts_flatcurve_xapian_terms();
+	terms->backend = backend;
+	terms->prefix = prefix;
+	terms->headers = headers;
+
+	return terms;
+}
+
+/* Moves the term iterator past the prefixed (non-body) terms. */
+static void
+fts_flatcurve_xapian_terms_skip(struct fts_flatcurve_xapian_terms *terms)
+{
+	char c;
+
+	while (terms->t != terms->tend) {
+		c = (*terms->t)[0];
+		if ((c != FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX[0]) &&
+		    (c != FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX[0]) &&
+		    (c != FLATCURVE_XAPIAN_HEADER_PREFIX[0]) &&
+		    (c != FLATCURVE_XAPIAN_PROMOTED_PREFIX[0]))
+			break;
+		/* All terms with this prefix are sorted together. */
+		terms->t.skip_to(std::string(1, c + 1));
+	}
+}
 
-		if (hash_table_lookup_full(terms, key, &k, &v)) {
-			counter = POINTER_CAST_TO(v, unsigned int);
-			pkey = (const char *)k;
+/* Reads the next term of the current batch of shards into terms->term.
+ * Throws Xapian::Error. */
+static bool
+fts_flatcurve_xapian_terms_read(struct fts_flatcurve_xapian_terms *terms,
+				unsigned int *count_r)
+{
+	int cmp = 0;
+	bool have_a, have_t;
+
+	if (!terms->started) {
+		terms->started = TRUE;
+		if (terms->headers) {
+			std::string p(FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX +
+				      terms->prefix);
+			terms->t = terms->db.allterms_begin(p);
+			terms->tend = terms->db.allterms_end(p);
 		} else {
-			counter = 0;
-			/* Using backend memory pool, since expectation is
-			 * that this will only be called from doveadm. */
-			pkey = p_strdup(backend->pool, key);
+			std::string p(FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX +
+				      terms->prefix);
+			terms->t = terms->db.allterms_begin(terms->prefix);
+			terms->tend = terms->db.allterms_end(terms->prefix);
+			terms->a = terms->db.allterms_begin(p);
+			terms->aend = terms->db.allterms_end(p);
+		}
+	}
+
+	if (!terms->headers)
+		fts_flatcurve_xapian_terms_skip(terms);
+	have_t = (terms->t != terms->tend);
+	have_a = !terms->headers && (terms->a != terms->aend);
+	if (!have_t && !have_a)
+		return FALSE;
+
+	if (have_t && have_a)
+		cmp = (*terms->t).compare((*terms->a).substr(1));
+
+	if (have_t && (!have_a || (cmp <= 0))) {
+		terms->term = terms->headers
+			? (*terms->t).substr(1) : *terms->t;
+		*count_r = terms->t.get_termfreq();
+		++terms->t;
+		if (have_a && (cmp == 0)) {
+			*count_r += terms->a.get_termfreq();
+			++terms->a;
 		}
-		counter += t.get_termfreq();
-		hash_table_update(terms, pkey, POINTER_CAST(counter));
+	} else {
+		terms->term = (*terms->a).substr(1);
+		*count_r = terms->a.get_termfreq();
+		++terms->a;
 	}
+
+	return TRUE;
 }
 
-void
-fts_flatcurve_xapian_mailbox_terms(struct flatcurve_fts_backend *backend,
-				   HASH_TABLE_TYPE(term_counter) terms)
+/* Writes the terms of the current batch of shards to a temporary file and
+ * closes the shards. */
+static bool
+fts_flatcurve_xapian_terms_flush(struct fts_flatcurve_xapian_terms *terms)
+{
+	struct fts_flatcurve_xapian_terms_run run;
+	unsigned int count;
+	uint32_t len;
+
+	if (terms->failed || (terms->db_shards == 0))
+		return !terms->failed;
+
+	run.fp = tmpfile();
+	if (run.fp == NULL) {
+		e_error(terms->backend->event, "tmpfile() failed: %m");
+		terms->failed = TRUE;
+		return FALSE;
+	}
+	run.count = 0;
+	run.eof = FALSE;
+	terms->runs.push_back(run);
+
+	try {
+		while (fts_flatcurve_xapian_terms_read(terms, &count)) {
+			len = terms->term.size();
+			if ((fwrite(&len, sizeof(len), 1, run.fp) != 1) ||
+			    (fwrite(terms->term.data(), 1, len,
+				    run.fp) != len) ||
+			    (fwrite(&count, sizeof(count), 1, run.fp) != 1)) {
+				e_error(terms->backend->event,
+					"fwrite(terms temporary file) failed: %m");
+				terms->failed = TRUE;
+				return FALSE;
+			}
+		}
+	} catch (Xapian::Error &e) {
+		e_error(terms->backend->event, "Cannot read terms; %s",
+			e.get_description().c_str());
+		terms->failed = TRUE;
+		return FALSE;
+	}
+
+	/* The iterators hold references to the shards too. */
+	terms->t = terms->tend = terms->a = terms->aend =
+		Xapian::TermIterator();
+	terms->db = Xapian::Database();
+	terms->db_shards = 0;
+	terms->started = FALSE;
+
+	return TRUE;
+}
+
+/* Reads the next (term, count) record of a temporary file. */
+static void
+fts_flatcurve_xapian_terms_run_next(struct fts_flatcurve_xapian_terms *terms,
+				    struct fts_flatcurve_xapian_terms_run *run)
+{
+	uint32_t len;
+
+	if (fread(&len, sizeof(len), 1, run->fp) != 1) {
+		run->eof = TRUE;
+		if (ferror(run->fp) != 0) {
+			e_error(terms->backend->event,
+				"fread(terms temporary file) failed: %m");
+			terms->failed = TRUE;
+		}
+		return;
+	}
+
+	run->term.resize(len);
+	if (((len > 0) &&
+	     (fread(&run->term[0], 1, len, run->fp) != len)) ||
+	    (fread(&run->count, sizeof(run->count), 1, run->fp) != 1)) {
+		run->eof = TRUE;
+		e_error(terms->backend->event,
+			"fread(terms temporary file) failed: %s",
+			(ferror(run->fp) != 0) ? strerror(errno) : "truncated");
+		terms->failed = TRUE;
+	}
+}
+
+void fts_flatcurve_xapian_terms_add(struct fts_flatcurve_xapian_terms *terms)
+{
+	struct flatcurve_fts_backend *backend = terms->backend;
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	enum flatcurve_xapian_db_opts opts =
+		(enum flatcurve_xapian_db_opts)
+		 (FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
+		  FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db *xdb;
+
+	i_assert(!terms->started);
+
+	if ((x->db_read == NULL) &&
+	    (fts_flatcurve_xapian_read_db(backend, opts) == NULL))
+		return;
+
+	/* The shards are opened separately, since the mailbox DBs are closed
+	 * before the terms are read. */
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (xdb->db == NULL)
+			continue;
+		try {
+			terms->db.add_database(
+				Xapian::Database(xdb->dbpath->path));
+			terms->db_shards++;
+		} catch (Xapian::Error &e) {
+			e_error(backend->event, "Cannot open DB (%s); %s",
+				xdb->dbpath->fname,
+				e.get_description().c_str());
+		}
+		if (terms->db_shards >= FLATCURVE_XAPIAN_TERMS_BATCH_SHARDS)
+			(void)fts_flatcurve_xapian_terms_flush(terms);
+	}
+	hash_table_iterate_deinit(&iter);
+}
+
+bool fts_flatcurve_xapian_terms_next(struct fts_flatcurve_xapian_terms *terms,
+				     const char **term_r,
+				     unsigned int *count_r)
 {
-	fts_flatcurve_xapian_mailbox_terms_do(backend, terms, "");
+	struct fts_flatcurve_xapian_terms_run *min;
+
+	if (terms->failed)
+		return FALSE;
+
+	if (terms->runs.empty()) {
+		/* Everything fit in a single batch: stream it directly. */
+		try {
+			if (!fts_flatcurve_xapian_terms_read(terms, count_r))
+				return FALSE;
+		} catch (Xapian::Error &e) {
+			e_error(terms->backend->event, "Cannot read terms; %s",
+				e.get_description().c_str());
+			return FALSE;
+		}
+		*term_r = terms->term.c_str();
+		return TRUE;
+	}
+
+	if (!terms->merging) {
+		terms->merging = TRUE;
+		if (!fts_flatcurve_xapian_terms_flush(terms))
+			return FALSE;
+		for (auto &run : terms->runs) {
+			rewind(run.fp);
+			fts_flatcurve_xapian_terms_run_next(terms, &run);
+		}
+	}
+
+	/* Merge the sorted files, summing the counts of equal terms. There
+	 * are few files, so a linear scan for the smallest term is enough. */
+	min = NULL;
+	for (auto &run : terms->runs) {
+		if (!run.eof && ((min == NULL) || (run.term < min->term)))
+			min = &run;
+	}
+	if ((min == NULL) || terms->failed)
+		return FALSE;
+
+	terms->term = min->term;
+	*count_r = 0;
+	for (auto &run : terms->runs) {
+		if (!run.eof && (run.term == terms->term)) {
+			*count_r += run.count;
+			fts_flatcurve_xapian_terms_run_next(terms, &run);
+		}
+	}
+	if (terms->failed)
+		return FALSE;
+
+	*term_r = terms->term.c_str();
+	return TRUE;
 }
 
 void
-fts_flatcurve_xapian_mailbox_headers(struct flatcurve_fts_backend *backend,
-				     HASH_TABLE_TYPE(term_counter) hdrs)
+fts_flatcurve_xapian_terms_deinit(struct fts_flatcurve_xapian_terms **_terms)
 {
-	fts_flatcurve_xapian_mailbox_terms_do(
-		backend, hdrs, FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX);
+	struct fts_flatcurve_xapian_terms *terms = *_terms;
+
+	for (auto &run : terms->runs)
+		fclose(run.fp);
+	delete(terms);
+	*_terms = NULL;
 }
 
 void fts_flatcurve_xapian_set_mailbox(struct flatcurve_fts_backend *backend)
@@ -878,6 +1914,72 @@ void fts_flatcurve_xapian_set_mailbox(struct flatcurve_fts_backend *backend)
 		str_c(backend->boxname)));
 }
 
+uoff_t fts_flatcurve_xapian_warmup(struct flatcurve_fts_backend *backend,
+				   uoff_t limit)
+{
+#ifdef HAVE_POSIX_FADVISE
+	DIR *dirp;
+	struct dirent *d;
+	struct stat st;
+	std::vector<std::string> shards;
+	std::vector<std::string>::const_iterator i;
+	uoff_t len, total = 0;
+	unsigned int j;
+	int fd;
+
+	if ((dirp = opendir(str_c(backend->db_path))) == NULL)
+		return 0;
+	while ((d = readdir(dirp)) != NULL) {
+		if (str_begins(d->d_name, FLATCURVE_XAPIAN_DB_PREFIX) ||
+		    str_begins(d->d_name, FLATCURVE_XAPIAN_DB_CURRENT_PREFIX))
+			shards.push_back(std::string(str_c(backend->db_path)) +
+					 d->d_name);
+	}
+	(void)closedir(dirp);
+
+	/* Every shard is searched, so a table is read ahead in all of them
+	 * before moving on to the next (less important) table. */
+	for (j = 0; flatcurve_xapian_warmup_tables[j] != NULL; ++j) {
+		for (i = shards.begin();
+		     (i != shards.end()) && (total < limit); ++i) {
+			if ((dirp = opendir(i->c_str())) == NULL)
+				continue;
+			while ((total < limit) &&
+			       ((d = readdir(dirp)) != NULL)) {
+				if (!str_begins(d->d_name,
+						flatcurve_xapian_warmup_tables[j]))
+					continue;
+				std::string path(*i + "/" + d->d_name);
+				if ((fd = open(path.c_str(), O_RDONLY)) < 0)
+					continue;
+				if ((fstat(fd, &st) == 0) &&
+				    S_ISREG(st.st_mode)) {
+					len = I_MIN((uoff_t)st.st_size,
+						    limit - total);
+					if (posix_fadvise(fd, 0, len,
+						POSIX_FADV_WILLNEED) == 0)
+						total += len;
+				}
+				i_close_fd(&fd);
+			}
+			(void)closedir(dirp);
+		}
+	}
+
+	e_debug(event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_warmup")->
+		add_str("mailbox", str_c(backend->boxname))->
+		add_int("bytes", total)->
+		add_int("shards", shards.size())->
+		event(), "Warmed up index (bytes=%"PRIuUOFF_T"; shards=%u)",
+		total, (unsigned int)shards.size());
+
+	return total;
+#else
+	return 0;
+#endif
+}
+
 static void
 fts_flatcurve_xapian_check_db_version(struct flatcurve_fts_backend *backend,
 				      struct flatcurve_xapian_db *xdb)
@@ -956,6 +2058,84 @@ fts_flatcurve_xapian_write_db_by_uid(struct flatcurve_fts_backend *backend,
 		: fts_flatcurve_xapian_write_db_get(backend, xdb, wopts);
 }
 
+/* Returns TRUE if the current shard is predicted to reach
+ * fts_flatcurve_rotate_bytes at the next commit: the size measured at the
+ * last commit, plus the documents written until the next commit (at the
+ * average document size of the shard). Until the shard has been measured
+ * with documents in it, only its measured size is known (see
+ * fts_flatcurve_xapian_check_commit_limit()). */
+static bool
+fts_flatcurve_xapian_rotate_bytes(struct flatcurve_fts_backend *backend,
+				  struct flatcurve_xapian_db *xdb)
+{
+	struct fts_flatcurve_user *fuser = backend->fuser;
+	struct flatcurve_xapian *x = backend->xapian;
+	uoff_t size = xdb->size;
+	unsigned int docs = xdb->changes;
+
+	if ((fuser->set.rotate_bytes == 0) ||
+	    (xdb->type != FLATCURVE_XAPIAN_DB_TYPE_CURRENT))
+		return FALSE;
+
+	if (xdb->size_docs > 0) {
+		if (fuser->set.commit_limit > x->doc_updates)
+			docs += fuser->set.commit_limit - x->doc_updates;
+		size += (uoff_t)docs * (xdb->size / xdb->size_docs);
+	}
+
+	if (size < fuser->set.rotate_bytes)
+		return FALSE;
+
+	e_debug(backend->event, "Rotating DB as size limit will be reached; "
+		"size=%"PRIuUOFF_T" predicted=%"PRIuUOFF_T" limit=%"PRIuUOFF_T,
+		xdb->size, size, fuser->set.rotate_bytes);
+	return TRUE;
+}
+
+/* Returns the size of the files of a shard on disk, and the last time one of
+ * them was modified (i.e. the last commit). */
+static uoff_t
+fts_flatcurve_xapian_db_size(const char *path, time_t *mtime_r)
+{
+	DIR *dirp;
+	struct dirent *d;
+	struct stat st;
+	uoff_t size = 0;
+
+	*mtime_r = 0;
+	if ((dirp = opendir(path)) == NULL)
+		return 0;
+
+	while ((d = readdir(dirp)) != NULL) {
+		std::string fpath(path);
+		fpath += "/";
+		fpath += d->d_name;
+		if ((stat(fpath.c_str(), &st) == 0) && S_ISREG(st.st_mode)) {
+			size += st.st_size;
+			*mtime_r = I_MAX(*mtime_r, st.st_mtime);
+		}
+	}
+	(void)closedir(dirp);
+
+	return size;
+}
+
+/* Measures the size of the shard's files on disk (after a commit). */
+static void
+fts_flatcurve_xapian_measure_db(struct flatcurve_fts_backend *backend,
+				struct flatcurve_xapian_db *xdb)
+{
+	time_t mtime;
+
+	if ((backend->fuser->set.rotate_bytes == 0) ||
+	    (xdb->type != FLATCURVE_XAPIAN_DB_TYPE_CURRENT) ||
+	    (xdb->dbw == NULL))
+		return;
+
+	xdb->size = fts_flatcurve_xapian_db_size(xdb->dbpath->path, &mtime);
+	xdb->size_docs = xdb->dbw->get_doccount();
+}
+
 static void
 fts_flatcurve_xapian_check_commit_limit(struct flatcurve_fts_backend *backend,
 					struct flatcurve_xapian_db *xdb)
@@ -967,10 +2147,22 @@ fts_flatcurve_xapian_check_commit_limit(struct flatcurve_fts_backend *backend,
 	++xdb->changes;
 
 	if ((xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) &&
-	    (fuser->set.rotate_size > 0) &&
-	    (xdb->dbw->get_doccount() >= fuser->set.rotate_size)) {
+	    (((fuser->set.rotate_size > 0) &&
+	      (xdb->dbw->get_doccount() >= fuser->set.rotate_size)) ||
+	     fts_flatcurve_xapian_rotate_bytes(backend, xdb))) {
 		fts_flatcurve_xapian_close_db(
 			backend, xdb, FLATCURVE_XAPIAN_DB_CLOSE_ROTATE);
+	} else if ((fuser->set.rotate_bytes > 0) &&
+		   (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) &&
+		   (xdb->size_docs == 0) &&
+		   (xdb->changes >= FLATCURVE_XAPIAN_ROTATE_BYTES_MEASURE_DOCS)) {
+		/* A new shard: commit early, so that its average document
+		 * size can be measured and the size at the next commit be
+		 * predicted. */
+		fts_flatcurve_xapian_close_db(
+			backend, xdb, FLATCURVE_XAPIAN_DB_CLOSE_WDB_COMMIT);
+		e_debug(backend->event, "Committing DB to measure its size; "
+			"docs=%d", FLATCURVE_XAPIAN_ROTATE_BYTES_MEASURE_DOCS);
 	} else if ((fuser->set.commit_limit > 0) &&
 		   (x->doc_updates >= fuser->set.commit_limit)) {
 		fts_flatcurve_xapian_close_dbs(
@@ -988,10 +2180,16 @@ fts_flatcurve_xapian_clear_document(struct flatcurve_fts_backend *backend)
 		ENUM_EMPTY(flatcurve_xapian_db_opts);
 	struct flatcurve_xapian_db *xdb;
 
+	struct fts_flatcurve_xapian_memory mem;
+
 	if ((x->doc == NULL) ||
 	    ((xdb = fts_flatcurve_xapian_write_db_current(backend, opts)) == NULL))
 		return;
 
+	/* Updates the peak: the document is complete. */
+	fts_flatcurve_xapian_memory(backend, &mem);
+	x->uncommitted_bytes += mem.document;
+
 	try {
 		xdb->dbw->replace_document(x->doc_uid, *x->doc);
 	} catch (std::bad_alloc &b) {
@@ -1015,21 +2213,78 @@ fts_flatcurve_xapian_clear_document(struct flatcurve_fts_backend *backend)
 	fts_flatcurve_xapian_check_commit_limit(backend, xdb);
 }
 
+/* Xapian objects do not report the memory they hold, so it is estimated
+ * with fixed amounts: per distinct term of a document (its string, wdf and
+ * node in the document's term map; the same is assumed for its postings
+ * until they are committed), and per shard open for reading (the cursor
+ * blocks of its tables). The events document these figures as estimates. */
+#define FLATCURVE_XAPIAN_MEMORY_TERM_BYTES 128
+#define FLATCURVE_XAPIAN_MEMORY_SHARD_BYTES (64 * 1024)
+
+void fts_flatcurve_xapian_memory(struct flatcurve_fts_backend *backend,
+				 struct fts_flatcurve_xapian_memory *mem_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+
+	i_zero(mem_r);
+	if (x->doc != NULL)
+		mem_r->document = x->doc->termlist_count() *
+			FLATCURVE_XAPIAN_MEMORY_TERM_BYTES;
+	mem_r->uncommitted = x->uncommitted_bytes;
+	if (x->db_read != NULL)
+		mem_r->db = x->shards * FLATCURVE_XAPIAN_MEMORY_SHARD_BYTES;
+	if (x->uids != NULL)
+		mem_r->db += x->uids->capacity() * sizeof(uint32_t);
+	mem_r->pools = pool_alloconly_get_total_alloc_size(backend->pool) +
+		pool_alloconly_get_total_alloc_size(x->pool);
+	if (backend->learn_pool != NULL)
+		mem_r->pools += pool_alloconly_get_total_alloc_size(
+			backend->learn_pool);
+
+	x->memory_peak = I_MAX(x->memory_peak, mem_r->document +
+			       mem_r->uncommitted + mem_r->db + mem_r->pools);
+	mem_r->peak = x->memory_peak;
+}
+
+struct event_passthrough *
+fts_flatcurve_xapian_memory_event(struct flatcurve_fts_backend *backend,
+				  struct event_passthrough *e)
+{
+	struct fts_flatcurve_xapian_memory mem;
+
+	fts_flatcurve_xapian_memory(backend, &mem);
+
+	return e->add_int("memory_document", mem.document)->
+		add_int("memory_uncommitted", mem.uncommitted)->
+		add_int("memory_db", mem.db)->
+		add_int("memory_pools", mem.pools)->
+		add_int("memory_peak", mem.peak);
+}
+
 static void
 fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 			      struct flatcurve_xapian_db *xdb,
 			      enum flatcurve_xapian_db_close opts)
 {
-	bool commit = FALSE, rotate = FALSE;
-	unsigned int diff;
-	const char *fname;
+	bool commit = FALSE;
+	unsigned int changes, diff, doccount = 0;
+	const char *fname, *reason = NULL;
 	struct timeval now, start;
+	time_t mtime;
+	uoff_t bytes = 0, size = 0;
 	struct flatcurve_xapian *x = backend->xapian;
 
 	fts_flatcurve_xapian_clear_document(backend);
 
 	if (xdb->dbw != NULL) {
 		i_gettimeofday(&start);
+		/* Includes the uncommitted changes (and is not available
+		 * once the DB is closed). */
+		doccount = xdb->dbw->get_doccount();
+		/* The commit event reports how much the shard grew. */
+		if (xdb->changes > 0)
+			size = fts_flatcurve_xapian_db_size(xdb->dbpath->path,
+							    &mtime);
 
 		if (HAS_ANY_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_WDB | FLATCURVE_XAPIAN_DB_CLOSE_MBOX)) {
 			xdb->dbw->close();
@@ -1048,33 +2303,64 @@ fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 		i_gettimeofday(&now);
 		diff = (unsigned int) timeval_diff_msecs(&now, &start);
 
-		if (xdb->changes > 0)
-			e_debug(backend->event, "Committed %u changes to DB "
-				"(RW; %s) in %u.%03u secs", xdb->changes,
-				xdb->dbpath->fname, diff/1000, diff%1000);
-
+		changes = xdb->changes;
+		if (changes > 0) {
+			bytes = fts_flatcurve_xapian_db_size(
+				xdb->dbpath->path, &mtime);
+			bytes = (bytes > size) ? bytes - size : 0;
+		}
 		xdb->changes = 0;
+		fts_flatcurve_xapian_measure_db(backend, xdb);
+
+		if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) {
+			if (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_MANUAL))
+				reason = "manual";
+			else if (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_ROTATE))
+				reason = "size";
+			else if ((backend->fuser->set.rotate_time > 0) &&
+				 (diff > backend->fuser->set.rotate_time))
+				reason = "time";
+		}
 
-		if ((xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) &&
-		    (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_ROTATE) ||
-		     (backend->fuser->set.rotate_time > 0) &&
-		     (diff > backend->fuser->set.rotate_time)))
-			rotate = TRUE;
+		if (changes > 0)
+			e_debug(fts_flatcurve_xapian_memory_event(backend,
+				event_create_passthrough(backend->event)->
+				set_name("fts_flatcurve_commit")->
+				add_str("mailbox", str_c(backend->boxname))->
+				add_str("shard", xdb->dbpath->fname)->
+				add_int("changes", changes)->
+				add_int("duration", diff)->
+				add_int("bytes", bytes)->
+				add_int("doccount", doccount)->
+				add_str("rotate_reason",
+					(reason == NULL) ? "none" : reason))->
+				event(),
+				"Committed %u changes to DB (RW; %s) in "
+				"%u.%03u secs", changes, xdb->dbpath->fname,
+				diff/1000, diff%1000);
+		x->uncommitted_bytes = 0;
 	}
 
-	if (rotate && (fts_flatcurve_xapian_lock(backend) >= 0)) {
+	if ((reason != NULL) && (fts_flatcurve_xapian_lock(backend) >= 0)) {
 		fname = p_strdup(x->pool, xdb->dbpath->fname);
 
-		if (!fts_flatcurve_xapian_create_current(backend, (enum flatcurve_xapian_db_close)(x->closing ? FLATCURVE_XAPIAN_DB_CLOSE_MBOX : 0)))
+		if (!fts_flatcurve_xapian_create_current(backend, (enum flatcurve_xapian_db_close)(x->closing ? FLATCURVE_XAPIAN_DB_CLOSE_MBOX : 0))) {
 			e_debug(backend->event, "Error when rotating DB (%s)",
 				xdb->dbpath->fname);
-		else
+		} else {
+			i_gettimeofday(&now);
+			diff = (unsigned int) timeval_diff_msecs(&now, &start);
 			e_debug(event_create_passthrough(backend->event)->
 				set_name("fts_flatcurve_rotate")->
 				add_str("mailbox", str_c(backend->boxname))->
-				event(),
-				"Rotating index (from: %s, to: %s)", fname,
-				xdb->dbpath->fname);
+				add_str("from", fname)->
+				add_str("to", xdb->dbpath->fname)->
+				add_int("duration", diff)->
+				add_int("doccount", doccount)->
+				add_str("reason", reason)->event(),
+				"Rotating index (from: %s, to: %s, reason: %s)",
+				fname, xdb->dbpath->fname, reason);
+		}
 
 		fts_flatcurve_xapian_unlock(backend);
 	}
@@ -1126,6 +2412,7 @@ void fts_flatcurve_xapian_close(struct flatcurve_fts_backend *backend)
 		delete(x->db_read);
 		x->db_read = NULL;
 	}
+	fts_flatcurve_xapian_uids_reset(x);
 
 	p_clear(x->pool);
 }
@@ -1175,17 +2462,107 @@ void fts_flatcurve_xapian_get_last_uid(struct flatcurve_fts_backend *backend,
 	*last_uid_r = 0;
 }
 
-int fts_flatcurve_xapian_uid_exists(struct flatcurve_fts_backend *backend,
-				    uint32_t uid)
+struct fts_flatcurve_xapian_prefetch *
+fts_flatcurve_xapian_prefetch_init(struct flatcurve_fts_backend *backend)
+{
+	struct fts_flatcurve_xapian_prefetch *pf;
+
+	pf = new fts_flatcurve_xapian_prefetch();
+	pf->backend = backend;
+
+	return pf;
+}
+
+void fts_flatcurve_xapian_prefetch_add(struct fts_flatcurve_xapian_prefetch *pf)
 {
+	struct flatcurve_fts_backend *backend = pf->backend;
+	struct hash_iterate_context *iter;
+	void *key, *val;
 	enum flatcurve_xapian_db_opts opts =
 		(enum flatcurve_xapian_db_opts)
 		(FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
 		 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
+	struct flatcurve_xapian *x = backend->xapian;
+
+	pf->boxes.push_back(flatcurve_xapian_prefetch_box());
+	struct flatcurve_xapian_prefetch_box &pb = pf->boxes.back();
+
+	if (fts_flatcurve_xapian_read_db(backend, opts) == NULL)
+		return;
+
+	pb.exists = TRUE;
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val))
+		pb.shards.push_back(
+			((struct flatcurve_xapian_db *)val)->dbpath->path);
+	hash_table_iterate_deinit(&iter);
+
+	fts_flatcurve_xapian_close(backend);
+}
+
+static void fts_flatcurve_xapian_prefetch_job(void *context, unsigned int idx)
+{
+	struct fts_flatcurve_xapian_prefetch *pf =
+		(struct fts_flatcurve_xapian_prefetch *)context;
+	struct flatcurve_xapian_prefetch_box &pb = pf->boxes[idx];
+	std::vector<std::string>::const_iterator i;
+	Xapian::PostingIterator p;
+
+	try {
+		for (i = pb.shards.begin(); i != pb.shards.end(); ++i) {
+			Xapian::Database db(*i);
+			for (p = db.postlist_begin(""); p != db.postlist_end("");
+			     ++p)
+				pb.uids.push_back(*p);
+		}
+	} catch (Xapian::Error &e) {
+		pb.error = e.get_description();
+		return;
+	} catch (std::bad_alloc &e) {
+		pb.error = "Out of memory";
+		return;
+	}
+
+	if (pb.shards.size() > 1) {
+		std::sort(pb.uids.begin(), pb.uids.end());
+		pb.uids.erase(std::unique(pb.uids.begin(), pb.uids.end()),
+			      pb.uids.end());
+	}
+}
+
+void fts_flatcurve_xapian_prefetch_run(struct fts_flatcurve_xapian_prefetch *pf,
+				       unsigned int threads)
+{
+	fts_flatcurve_xapian_run_jobs(threads, pf->boxes.size(),
+				      fts_flatcurve_xapian_prefetch_job, pf);
+}
+
+int fts_flatcurve_xapian_prefetch_uids(struct fts_flatcurve_xapian_prefetch *pf,
+				       unsigned int idx,
+				       ARRAY_TYPE(uint32_t) *uids)
+{
+	const struct flatcurve_xapian_prefetch_box &pb = pf->boxes[idx];
+
+	if (!pb.exists)
+		return 0;
+
+	if (!pb.error.empty()) {
+		e_error(pf->backend->event, "Cannot read DB UIDs; %s",
+			pb.error.c_str());
+		return -1;
+	}
 
-	return (fts_flatcurve_xapian_read_db(backend, opts) == NULL)
-		? -1
-		: (int)(fts_flatcurve_xapian_uid_exists_db(backend, uid) != NULL);
+	if (!pb.uids.empty())
+		array_append(uids, &pb.uids[0], pb.uids.size());
+
+	return 1;
+}
+
+void
+fts_flatcurve_xapian_prefetch_deinit(struct fts_flatcurve_xapian_prefetch **_pf)
+{
+	delete(*_pf);
+	*_pf = NULL;
 }
 
 void fts_flatcurve_xapian_expunge(struct flatcurve_fts_backend *backend,
@@ -1209,32 +2586,119 @@ void fts_flatcurve_xapian_expunge(struct flatcurve_fts_backend *backend,
 	}
 }
 
-bool
-fts_flatcurve_xapian_init_msg(struct flatcurve_fts_backend_update_context *ctx)
+void fts_flatcurve_xapian_expunge_from(struct flatcurve_fts_backend *backend,
+				       uint32_t first_uid)
 {
+	struct hash_iterate_context *iter;
+	void *key, *val;
 	enum flatcurve_xapian_db_opts opts =
 		ENUM_EMPTY(flatcurve_xapian_db_opts);
-	struct flatcurve_xapian *x = ctx->backend->xapian;
+	enum flatcurve_xapian_wdb wopts = ENUM_EMPTY(flatcurve_xapian_wdb);
+	Xapian::PostingIterator p;
+	std::vector<std::pair<struct flatcurve_xapian_db *,
+			      std::vector<uint32_t> > > shards;
+	std::vector<uint32_t>::const_iterator u;
 	struct flatcurve_xapian_db *xdb;
+	unsigned int i;
 
-	if (ctx->uid == x->doc_uid) {
-		return TRUE;
-	}
-
-	fts_flatcurve_xapian_clear_document(ctx->backend);
-
-	if ((xdb = fts_flatcurve_xapian_write_db_current(ctx->backend, opts)) == NULL)
-		return FALSE;
+	if (fts_flatcurve_xapian_read_db(backend, opts) == NULL)
+		return;
 
+	/* Shards use the UIDs as docids, so only the tail of each shard's
+	 * postlist needs to be read. */
+	iter = hash_table_iterate_init(backend->xapian->dbs);
 	try {
-		(void)xdb->dbw->get_document(ctx->uid);
-		return FALSE;
-	} catch (Xapian::DocNotFoundError &e) {
-		x->doc = new Xapian::Document();
-		x->doc_created = TRUE;
+		while (hash_table_iterate(iter, backend->xapian->dbs,
+					  &key, &val)) {
+			xdb = (struct flatcurve_xapian_db *)val;
+			if (xdb->db == NULL)
+				continue;
+			p = xdb->db->postlist_begin("");
+			p.skip_to(first_uid);
+			if (p == xdb->db->postlist_end(""))
+				continue;
+			shards.push_back(std::make_pair(xdb,
+						std::vector<uint32_t>()));
+			for (; p != xdb->db->postlist_end(""); ++p)
+				shards.back().second.push_back(*p);
+		}
 	} catch (Xapian::Error &e) {
-		ctx->ctx.failed = TRUE;
-		return FALSE;
+		e_error(backend->event, "Expunge failed uid>=%u; %s",
+			first_uid, e.get_description().c_str());
+		hash_table_iterate_deinit(&iter);
+		return;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	for (i = 0; i < shards.size(); ++i) {
+		xdb = fts_flatcurve_xapian_write_db_get(backend,
+							shards[i].first,
+							wopts);
+		if (xdb == NULL)
+			continue;
+		try {
+			for (u = shards[i].second.begin();
+			     u != shards[i].second.end(); ++u) {
+				xdb->dbw->delete_document(*u);
+				fts_flatcurve_xapian_check_commit_limit(backend,
+									xdb);
+			}
+		} catch (Xapian::Error &e) {
+			e_error(backend->event, "Expunge failed uid>=%u; %s",
+				first_uid, e.get_description().c_str());
+		}
+	}
+}
+
+bool
+fts_flatcurve_xapian_init_msg(struct flatcurve_fts_backend_update_context *ctx)
+{
+	const char *const *hdr;
+	enum flatcurve_xapian_db_opts opts =
+		ENUM_EMPTY(flatcurve_xapian_db_opts);
+	struct flatcurve_xapian *x = ctx->backend->xapian;
+	struct flatcurve_xapian_db *xdb;
+
+	if (ctx->uid == x->doc_uid) {
+		return TRUE;
+	}
+
+	fts_flatcurve_xapian_clear_document(ctx->backend);
+
+	if ((xdb = fts_flatcurve_xapian_write_db_current(ctx->backend, opts)) == NULL)
+		return FALSE;
+
+	try {
+		(void)xdb->dbw->get_document(ctx->uid);
+		return FALSE;
+	} catch (Xapian::DocNotFoundError &e) {
+		x->doc = new Xapian::Document();
+		x->doc_created = TRUE;
+	} catch (Xapian::Error &e) {
+		ctx->ctx.failed = TRUE;
+		return FALSE;
+	}
+
+	if (ctx->has_received_date)
+		x->doc->add_value(FLATCURVE_XAPIAN_VALUE_RECEIVED,
+			Xapian::sortable_serialise((double)ctx->received_date));
+	if (ctx->has_sent_date)
+		x->doc->add_value(FLATCURVE_XAPIAN_VALUE_SENT,
+			Xapian::sortable_serialise((double)ctx->sent_date));
+	if (ctx->has_size)
+		x->doc->add_value(FLATCURVE_XAPIAN_VALUE_SIZE,
+			Xapian::sortable_serialise((double)ctx->size));
+
+	/* Mark the document as having dedicated header indexes for all
+	 * learned headers (whether or not the header exists in the message),
+	 * so that queries can determine whether all documents in a DB
+	 * can be searched via the header index. */
+	if (array_is_created(&ctx->backend->learn_hdrs)) {
+		array_foreach(&ctx->backend->learn_hdrs, hdr) {
+			x->doc->add_boolean_term(
+				FLATCURVE_XAPIAN_PROMOTED_PREFIX +
+				std::string(*hdr));
+		}
 	}
 
 	x->doc_uid = ctx->uid;
@@ -1325,89 +2789,187 @@ void fts_flatcurve_xapian_delete_index(struct flatcurve_fts_backend *backend)
 }
 
 #ifdef XAPIAN_HAS_COMPACT
-static bool
-fts_flatcurve_xapian_optimize_rebuild(struct flatcurve_fts_backend *backend,
-				      Xapian::Database *db,
-				      struct flatcurve_xapian_db_path *path)
+/* Opens a shard for writing, so that nothing changes while it is rotated or
+ * replaced by the optimized DB. Doesn't wait: returns NULL if another
+ * process is writing to the shard. Throws Xapian::Error. */
+static Xapian::WritableDatabase *
+fts_flatcurve_xapian_optimize_lock_shard(const std::string &path)
 {
-	Xapian::Document doc;
-	Xapian::Enquire enquire(*db);
-	Xapian::MSetIterator i;
-	Xapian::MSet m;
-	unsigned int updates = 0;
-	struct flatcurve_xapian *x = backend->xapian;
-	struct flatcurve_xapian_db *xdb;
+	try {
+		return new Xapian::WritableDatabase(path,
+			Xapian::DB_OPEN | Xapian::DB_NO_SYNC);
+	} catch (Xapian::DatabaseLockError &e) {
+		return NULL;
+	}
+}
 
-	/* Create the optimize shard. */
-	xdb = p_new(x->pool, struct flatcurve_xapian_db, 1);
-	xdb->dbpath = path;
-	xdb->type = FLATCURVE_XAPIAN_DB_TYPE_OPTIMIZE;
+static void
+fts_flatcurve_xapian_optimize_unlock_shard(Xapian::WritableDatabase **_dbw)
+{
+	Xapian::WritableDatabase *dbw = *_dbw;
 
-	if (fts_flatcurve_xapian_write_db_get(backend, xdb, FLATCURVE_XAPIAN_WDB_CREATE) == NULL)
-		return FALSE;
+	*_dbw = NULL;
+	try {
+		dbw->close();
+	} catch (Xapian::Error &e) {
+	}
+	delete(dbw);
+}
 
-	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
-	enquire.set_query(Xapian::Query::MatchAll);
-	m = enquire.get_mset(0, db->get_doccount());
-	i = m.begin();
-
-	while (i != m.end()) {
-		doc = i.get_document();
-	        try {
-	                xdb->dbw->replace_document(doc.get_docid(), doc);
-	        } catch (Xapian::Error &e) {
-			return FALSE;
+/* Identifies the contents of a shard: the UUID changes when the shard is
+ * replaced, the revision on every commit. Throws Xapian::Error. */
+static std::string
+fts_flatcurve_xapian_shard_state(const Xapian::Database &db)
+{
+	std::ostringstream ss;
+
+	ss << db.get_uuid() << "/";
+#ifdef XAPIAN_HAS_GET_REVISION
+	ss << db.get_revision();
+#else
+	ss << db.get_doccount() << "/" << db.get_lastdocid();
+#endif
+	return ss.str();
+}
+
+/* Identifies the shards, so that an interrupted manual optimization is only
+ * resumed for the same shards. Changes made to them since (expunges) are
+ * reconciled when the optimized DB replaces them. Throws Xapian::Error. */
+static std::string
+fts_flatcurve_xapian_optimize_fingerprint(const std::vector<std::string> &shards)
+{
+	std::vector<std::string>::const_iterator i;
+	std::ostringstream ss;
+
+	for (i = shards.begin(); i != shards.end(); ++i)
+		ss << Xapian::Database(*i).get_uuid() << ",";
+
+	return ss.str();
+}
+
+/* Manual optimization: copy the documents of all shards to the target, in
+ * docid order. The shards are walked in parallel (merging their postlists),
+ * so only one document is read at a time; documents in more than one shard
+ * are only copied once. Every commit also stores a checkpoint, so that an
+ * interrupted rebuild can be resumed. Throws Xapian::Error. */
+static void
+fts_flatcurve_xapian_optimize_rebuild(struct flatcurve_xapian_optimize_box *ob)
+{
+	std::string cp;
+	Xapian::docid did, last = 0;
+	unsigned int i, j = 0, updates = 0;
+	std::vector<struct flatcurve_xapian_rebuild_shard> s(ob->shards.size());
+	Xapian::WritableDatabase dbw(ob->target, Xapian::DB_NO_SYNC |
+		(ob->resume ? Xapian::DB_OPEN : Xapian::DB_CREATE_OR_OVERWRITE));
+
+	if (ob->resume) {
+		/* An unparseable checkpoint means starting over (documents
+		 * already in the target are replaced). */
+		cp = dbw.get_metadata(FLATCURVE_XAPIAN_DB_REBUILD_KEY);
+		if ((cp.size() <= ob->fingerprint.size()) ||
+		    (str_to_uint32(cp.c_str() + ob->fingerprint.size() + 1,
+				   &last) < 0))
+			last = 0;
+		ob->resumed = last;
+	}
+
+	for (i = 0; i < s.size(); ++i) {
+		s[i].db = Xapian::Database(ob->shards[i]);
+		s[i].p = s[i].db.postlist_begin("");
+		if (last > 0)
+			s[i].p.skip_to(last + 1);
+	}
+
+	for (;;) {
+		did = 0;
+		for (i = 0; i < s.size(); ++i) {
+			if ((s[i].p != s[i].db.postlist_end("")) &&
+			    ((did == 0) || (*s[i].p < did))) {
+				did = *s[i].p;
+				j = i;
+			}
 		}
-		if (++updates > FLATCURVE_MANUAL_OPTIMIZE_COMMIT_LIMIT) {
-			xdb->dbw->commit();
+		if (did == 0)
+			break;
+
+		dbw.replace_document(did, s[j].db.get_document(did));
+
+		for (i = 0; i < s.size(); ++i) {
+			if ((s[i].p != s[i].db.postlist_end("")) &&
+			    (*s[i].p == did))
+				++s[i].p;
+		}
+
+		if (++updates >= FLATCURVE_MANUAL_OPTIMIZE_COMMIT_LIMIT) {
+			std::ostringstream ss;
+			ss << ob->fingerprint << ":" << did;
+			dbw.set_metadata(FLATCURVE_XAPIAN_DB_REBUILD_KEY,
+					 ss.str());
+			dbw.commit();
+			ob->checkpoint = TRUE;
 			updates = 0;
 		}
-		++i;
 	}
 
-	fts_flatcurve_xapian_close_db(backend, xdb,
-				      FLATCURVE_XAPIAN_DB_CLOSE_WDB);
-
-	return TRUE;
+	dbw.set_metadata(FLATCURVE_XAPIAN_DB_REBUILD_KEY, "");
+	dbw.commit();
+	dbw.close();
 }
 
-// Return value = whether to output debug error message; not success
-static bool
-fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
-				     Xapian::Database *db)
+/* Waits for a free host wide optimize slot (see
+ * fts_flatcurve_maintenance_host_limit). Returns the locked slot fd, or -1 if
+ * no slot file can be opened (in which case the limit is not enforced). */
+static int
+fts_flatcurve_xapian_optimize_slot(const struct fts_flatcurve_xapian_optimize *opt)
 {
-	unsigned int diff;
-	struct hash_iterate_context *hiter;
-	struct flatcurve_xapian_db_iter *iter;
-	void *key, *val;
-	struct flatcurve_xapian_db_path *n, *o;
-	struct timeval now, start;
-	enum flatcurve_xapian_db_opts opts =
-		ENUM_EMPTY(flatcurve_xapian_db_opts);
-	struct flatcurve_xapian *x = backend->xapian;
-	enum flatcurve_xapian_wdb wopts = ENUM_EMPTY(flatcurve_xapian_wdb);
-
-	/* We need to lock all of the mailboxes so nothing changes while we
-	 * are optimizing. */
-	hiter = hash_table_iterate_init(x->dbs);
-	while (hash_table_iterate(hiter, x->dbs, &key, &val)) {
-		(void)fts_flatcurve_xapian_write_db_get(
-			backend, (struct flatcurve_xapian_db *)val, wopts);
+	bool opened;
+	unsigned int i;
+	int fd;
+
+	for (;;) {
+		opened = FALSE;
+		for (i = 0; i < opt->slots; ++i) {
+			std::ostringstream ss;
+			ss << opt->slot_prefix << i;
+			fd = open(ss.str().c_str(),
+				  O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+			if (fd == -1)
+				continue;
+			opened = TRUE;
+			if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+				return fd;
+			(void)close(fd);
+		}
+		if (!opened)
+			return -1;
+		std::this_thread::sleep_for(std::chrono::milliseconds(
+			FLATCURVE_XAPIAN_OPTIMIZE_SLOT_WAIT_MSECS));
 	}
-	hash_table_iterate_deinit(&hiter);
+}
 
-	/* Create the optimize target. */
-	o = fts_flatcurve_xapian_create_db_path(backend,
-						FLATCURVE_XAPIAN_DB_OPTIMIZE);
-	fts_flatcurve_xapian_delete(backend, o);
-	i_gettimeofday(&start);
+/* Compacts the shards into the target. The shards aren't locked, so that
+ * they can still be written to (expunges) meanwhile. Throws Xapian::Error. */
+static void
+fts_flatcurve_xapian_optimize_compact(struct flatcurve_xapian_optimize_box *ob)
+{
+	Xapian::Database db;
+	std::vector<std::string>::const_iterator i;
+
+	ob->states.clear();
+	for (i = ob->shards.begin(); i != ob->shards.end(); ++i) {
+		Xapian::Database shard(*i);
+		ob->states.push_back(fts_flatcurve_xapian_shard_state(shard));
+		db.add_database(shard);
+	}
 
-	try {
+	/* An interrupted manual optimization is continued instead. */
+	if (!ob->resume && ob->fallback.empty()) {
 		try {
-			(void)db->reopen();
-			db->compact(o->path, Xapian::DBCOMPACT_NO_RENUMBER |
-					     Xapian::DBCOMPACT_MULTIPASS |
-					     Xapian::Compactor::FULLER);
+			db.compact(ob->target,
+				   Xapian::DBCOMPACT_NO_RENUMBER |
+				   Xapian::DBCOMPACT_MULTIPASS |
+				   Xapian::Compactor::FULLER);
+			return;
 		} catch (Xapian::InvalidOperationError &e) {
 			/* This exception is not as specific as it could be...
 			 * but the likely reason it happens is due to
@@ -1422,62 +2984,290 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 			 * through all DBs and copying, ignoring duplicate
 			 * documents. Let's try to be awesome and do the
 			 * latter. */
-			e_debug(backend->event, "Native optimize failed, "
-				"fallback to manual optimization; %s",
-				e.get_description().c_str());
-			if (!fts_flatcurve_xapian_optimize_rebuild(backend, db, o))
-				throw;
+			ob->fallback = e.get_description();
+		}
+	}
+
+	fts_flatcurve_xapian_optimize_rebuild(ob);
+}
+
+static void fts_flatcurve_xapian_optimize_job(void *context, unsigned int idx)
+{
+	const struct fts_flatcurve_xapian_optimize *opt =
+		(const struct fts_flatcurve_xapian_optimize *)context;
+	struct flatcurve_xapian_optimize_box *ob = opt->boxes[idx];
+	std::chrono::steady_clock::time_point start;
+	unsigned int retries = 0;
+	int slot = -1;
+
+	if (opt->slots > 0)
+		slot = fts_flatcurve_xapian_optimize_slot(opt);
+	start = std::chrono::steady_clock::now();
+
+	for (;;) {
+		try {
+			fts_flatcurve_xapian_optimize_compact(ob);
+		} catch (Xapian::DatabaseModifiedError &e) {
+			/* A shard was modified more than once while being
+			 * read. Start again with a manual optimization, as
+			 * it overwrites the target (or continues from its
+			 * last checkpoint). */
+			if (++retries <= FLATCURVE_XAPIAN_OPTIMIZE_RETRIES) {
+				ob->fallback = e.get_description();
+				ob->resume = ob->checkpoint;
+				continue;
+			}
+			ob->error = e.get_description();
+		} catch (Xapian::Error &e) {
+			ob->error = e.get_description();
+		} catch (std::bad_alloc &e) {
+			ob->error = "Out of memory";
+		}
+		break;
+	}
+
+	if (slot != -1)
+		(void)close(slot);
+
+	ob->msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/* Appends the docids (UIDs) of a shard. Throws Xapian::Error. */
+static void
+fts_flatcurve_xapian_shard_uids(const Xapian::Database &db,
+				std::vector<uint32_t> &uids)
+{
+	Xapian::PostingIterator p;
+
+	for (p = db.postlist_begin(""); p != db.postlist_end(""); ++p)
+		uids.push_back(*p);
+}
+
+/* Brings the optimized DB up to date with the (locked) shards it was built
+ * from: messages expunged from the shards while they were being compacted
+ * are deleted, and messages written to them since (by a process that was
+ * still writing to the rotated "current" shard) are copied. Throws
+ * Xapian::Error. */
+static void
+fts_flatcurve_xapian_optimize_reconcile(struct flatcurve_fts_backend *backend,
+					struct flatcurve_xapian_optimize_box *ob,
+					std::vector<Xapian::WritableDatabase *> &shards)
+{
+	std::vector<uint32_t> added, expunged, live, optimized;
+	std::vector<uint32_t>::const_iterator i;
+	unsigned int j;
+	bool changed = FALSE;
+
+	for (j = 0; j < shards.size(); ++j) {
+		if ((j >= ob->states.size()) ||
+		    (fts_flatcurve_xapian_shard_state(*shards[j]) !=
+		     ob->states[j]))
+			changed = TRUE;
+	}
+	if (!changed)
+		return;
+
+	Xapian::WritableDatabase dbw(ob->target,
+				     Xapian::DB_OPEN | Xapian::DB_NO_SYNC);
+
+	fts_flatcurve_xapian_shard_uids(dbw, optimized);
+	for (j = 0; j < shards.size(); ++j)
+		fts_flatcurve_xapian_shard_uids(*shards[j], live);
+	std::sort(live.begin(), live.end());
+	live.erase(std::unique(live.begin(), live.end()), live.end());
+
+	std::set_difference(optimized.begin(), optimized.end(),
+			    live.begin(), live.end(),
+			    std::back_inserter(expunged));
+	std::set_difference(live.begin(), live.end(),
+			    optimized.begin(), optimized.end(),
+			    std::back_inserter(added));
+
+	for (i = expunged.begin(); i != expunged.end(); ++i)
+		dbw.delete_document(*i);
+	for (i = added.begin(); i != added.end(); ++i) {
+		for (j = 0; j < shards.size(); ++j) {
+			try {
+				dbw.replace_document(
+					*i, shards[j]->get_document(*i));
+				break;
+			} catch (Xapian::DocNotFoundError &e) {
+			}
+		}
+	}
+
+	dbw.commit();
+	dbw.close();
+
+	e_debug(backend->event, "Optimize reconciled changes made during "
+		"compaction; expunged=%u added=%u",
+		(unsigned int)expunged.size(), (unsigned int)added.size());
+}
+
+/* Replaces the shards with the optimized DB. The shards are locked while
+ * the changes made to them during the compaction are reconciled and they
+ * are deleted. The shard locks are taken before the mailbox lock, without
+ * waiting: if a shard is being written to, the mailbox is left alone
+ * (nothing is deleted) and 0 is returned, so that the caller can retry
+ * later. Returns 1 on success, -1 on error. */
+static int
+fts_flatcurve_xapian_optimize_finish(struct flatcurve_fts_backend *backend,
+				     struct flatcurve_xapian_optimize_box *ob)
+{
+	struct flatcurve_xapian_db_path *n, *o;
+	std::vector<Xapian::WritableDatabase *> locks;
+	std::vector<std::string>::const_iterator i;
+	Xapian::WritableDatabase *dbw;
+	struct flatcurve_xapian *x = backend->xapian;
+	unsigned int j;
+	bool busy = FALSE, locked = FALSE, ret = TRUE;
+
+	o = fts_flatcurve_xapian_create_db_path(backend,
+						FLATCURVE_XAPIAN_DB_OPTIMIZE);
+
+	if (!ob->fallback.empty())
+		e_debug(backend->event, "Native optimize failed, "
+			"fallback to manual optimization; %s",
+			ob->fallback.c_str());
+	else if (ob->resume)
+		e_debug(backend->event, "Resumed manual optimization "
+			"after uid=%u", ob->resumed);
+
+	if (!ob->error.empty()) {
+		e_error(backend->event, "Optimize failed; %s",
+			ob->error.c_str());
+		/* Keep a checkpointed manual optimization, so that the next
+		 * optimization can continue it. */
+		if (!ob->checkpoint)
+			fts_flatcurve_xapian_delete(backend, o);
+		return -1;
+	}
+
+	try {
+		for (i = ob->shards.begin(); i != ob->shards.end(); ++i) {
+			if ((dbw = fts_flatcurve_xapian_optimize_lock_shard(*i)) == NULL) {
+				busy = TRUE;
+				break;
+			}
+			locks.push_back(dbw);
 		}
 	} catch (Xapian::Error &e) {
 		e_error(backend->event, "Optimize failed; %s",
 			e.get_description().c_str());
-		return TRUE;
+		ret = FALSE;
+	}
+
+	if (ret && !busy) {
+		if (fts_flatcurve_xapian_lock(backend) < 0)
+			ret = FALSE;
+		else
+			locked = TRUE;
 	}
 
-	n = p_new(x->pool, struct flatcurve_xapian_db_path, 1);
-	n->fname = p_strdup(x->pool, o->fname);
-	n->path = p_strdup(x->pool, o->path);
+	if (locked) {
+		try {
+			fts_flatcurve_xapian_optimize_reconcile(backend, ob,
+								locks);
+		} catch (Xapian::Error &e) {
+			e_error(backend->event, "Optimize failed; %s",
+				e.get_description().c_str());
+			ret = FALSE;
+		}
 
-	/* Delete old indexes. */
-	if ((iter = fts_flatcurve_xapian_db_iter_init(backend, opts)) == NULL)
-		return FALSE;
-	while (fts_flatcurve_xapian_db_iter_next(iter)) {
-		if ((iter->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX) ||
-		    (iter->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT))
-			fts_flatcurve_xapian_delete(backend, iter->path);
+		/* Delete old indexes (while they are still locked). */
+		if (ret) {
+			for (i = ob->shards.begin(); i != ob->shards.end(); ++i)
+				(void)fts_backend_flatcurve_delete_dir(backend,
+								       i->c_str());
+		}
 	}
-	fts_flatcurve_xapian_db_iter_deinit(&iter);
 
-	/* Rename optimize index to an active index. */
-	if (fts_flatcurve_xapian_rename_db(backend, n) == NULL) {
-		fts_flatcurve_xapian_delete(backend, o);
-		return FALSE;
+	for (j = 0; j < locks.size(); ++j)
+		fts_flatcurve_xapian_optimize_unlock_shard(&locks[j]);
+
+	if (busy) {
+		e_debug(backend->event, "Optimize: shard is being written "
+			"to, retrying later");
+		return 0;
 	}
 
-	i_gettimeofday(&now);
-	diff = (unsigned int) timeval_diff_msecs(&now, &start);
+	if (ret) {
+		n = p_new(x->pool, struct flatcurve_xapian_db_path, 1);
+		n->fname = p_strdup(x->pool, o->fname);
+		n->path = p_strdup(x->pool, o->path);
 
-	e_debug(backend->event, "Optimized DB in %u.%03u secs", diff/1000,
-		diff%1000);
+		/* Rename optimize index to an active index. */
+		ret = (fts_flatcurve_xapian_rename_db(backend, n) != NULL);
+	}
 
-	return TRUE;
+	if (locked)
+		fts_flatcurve_xapian_unlock(backend);
+
+	if (!ret) {
+		fts_flatcurve_xapian_delete(backend, o);
+		return -1;
+	}
+
+	e_debug(backend->event, "Optimized DB in %u.%03u secs",
+		ob->msecs/1000, ob->msecs%1000);
+
+	return 1;
 }
 #endif
 
-void fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend)
+struct fts_flatcurve_xapian_optimize *
+fts_flatcurve_xapian_optimize_init(struct flatcurve_fts_backend *backend)
+{
+	struct fts_flatcurve_xapian_optimize *opt;
+	struct mail_user *user = backend->backend.ns->user;
+
+	opt = new fts_flatcurve_xapian_optimize();
+	opt->backend = backend;
+	opt->pool = pool_alloconly_create(FTS_FLATCURVE_LABEL " optimize",
+					  1024);
+	p_array_init(&opt->failed, opt->pool, 4);
+
+	opt->slots = backend->fuser->set.maintenance_host_limit;
+	if (opt->slots > 0)
+		opt->slot_prefix = t_strconcat(user->set->mail_temp_dir, "/",
+					       FLATCURVE_XAPIAN_OPTIMIZE_SLOT_FNAME,
+					       ".", NULL);
+
+	return opt;
+}
+
+/* Prepares the current mailbox for optimization: the "current" shard is
+ * rotated (so that new messages are written to a new shard while the others
+ * are being compacted) and the shards to optimize are listed. The DB is then
+ * closed, so that another mailbox can be prepared while this one is being
+ * compacted. */
+void fts_flatcurve_xapian_optimize_add(struct fts_flatcurve_xapian_optimize *opt)
 {
 #ifdef XAPIAN_HAS_COMPACT
-	Xapian::Database *db;
+	struct flatcurve_fts_backend *backend = opt->backend;
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	const char *fname, *name;
+	struct flatcurve_xapian_optimize_box *ob;
+	struct flatcurve_xapian_db_path *o;
+	struct flatcurve_xapian_db *xdb;
+	struct timeval now, start;
+	unsigned int doccount;
 	enum flatcurve_xapian_db_opts opts =
 		(enum flatcurve_xapian_db_opts)
 		(FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
 		 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
+	struct flatcurve_xapian *x = backend->xapian;
+	struct file_lock *lock = NULL;
+	Xapian::WritableDatabase *dbw = NULL;
+	std::string cp;
+	struct stat st;
 
-	if ((db = fts_flatcurve_xapian_read_db(backend, opts)) == NULL)
+	if (fts_flatcurve_xapian_read_db(backend, opts) == NULL)
 		return;
 
-	if (backend->xapian->deinit &&
-	    !fts_flatcurve_xapian_need_optimize(backend)) {
+	if (x->deinit && !fts_flatcurve_xapian_need_optimize(backend)) {
 		fts_flatcurve_xapian_close(backend);
 		return;
 	}
@@ -1487,56 +3277,393 @@ void fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend)
 		add_str("mailbox", str_c(backend->boxname))->event(),
 		"Optimizing");
 
-	if ((fts_flatcurve_xapian_lock(backend) >= 0) &&
-	    (!fts_flatcurve_xapian_optimize_box_do(backend, db)))
-		e_error(backend->event, "Optimize failed");
+	if ((fts_flatcurve_xapian_lock_optimize(backend, &lock) < 0) ||
+	    (fts_flatcurve_xapian_lock(backend) < 0)) {
+		file_lock_free(&lock);
+		name = p_strdup(opt->pool, str_c(backend->boxname));
+		array_push_back(&opt->failed, &name);
+		fts_flatcurve_xapian_close(backend);
+		return;
+	}
 
-	fts_flatcurve_xapian_close(backend);
+	/* Rotate a non-empty current shard, unless another process is
+	 * writing to it: its write lock is held (unless this process is the
+	 * writer) while the shard is renamed. A busy current shard is simply
+	 * not optimized this time. */
+	xdb = x->dbw_current;
+	if ((xdb != NULL) && (xdb->db != NULL) &&
+	    ((doccount = xdb->db->get_doccount()) > 0)) {
+		if (xdb->dbw == NULL) {
+			try {
+				dbw = fts_flatcurve_xapian_optimize_lock_shard(
+					xdb->dbpath->path);
+			} catch (Xapian::Error &e) {
+				dbw = NULL;
+			}
+			if (dbw == NULL) {
+				e_debug(backend->event, "Optimize: current "
+					"shard is busy, not rotating it");
+				xdb = NULL;
+			}
+		}
+	} else {
+		xdb = NULL;
+	}
+	if (xdb != NULL) {
+		fname = p_strdup(x->pool, xdb->dbpath->fname);
+		i_gettimeofday(&start);
+		if (fts_flatcurve_xapian_create_current(
+			backend, FLATCURVE_XAPIAN_DB_CLOSE_WDB)) {
+			i_gettimeofday(&now);
+			e_debug(event_create_passthrough(backend->event)->
+				set_name("fts_flatcurve_rotate")->
+				add_str("mailbox", str_c(backend->boxname))->
+				add_str("from", fname)->
+				add_str("to", xdb->dbpath->fname)->
+				add_int("duration",
+					timeval_diff_msecs(&now, &start))->
+				add_int("doccount", doccount)->
+				add_str("reason", "optimize")->event(),
+				"Rotating index (from: %s, to: %s, "
+				"reason: optimize)", fname,
+				xdb->dbpath->fname);
+		}
+		if (dbw != NULL)
+			fts_flatcurve_xapian_optimize_unlock_shard(&dbw);
+	}
+
+	ob = new flatcurve_xapian_optimize_box();
+	ob->boxname = p_strdup(opt->pool, str_c(backend->boxname));
+	ob->db_path = p_strdup(opt->pool, str_c(backend->db_path));
+
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX)
+			ob->shards.push_back(xdb->dbpath->path);
+	}
+	hash_table_iterate_deinit(&iter);
 	fts_flatcurve_xapian_unlock(backend);
+
+	if (ob->shards.empty()) {
+		delete(ob);
+		file_lock_free(&lock);
+		fts_flatcurve_xapian_close(backend);
+		return;
+	}
+
+	/* Fixed order, for the fingerprint. */
+	std::sort(ob->shards.begin(), ob->shards.end());
+
+	/* Create the optimize target, unless it holds an interrupted manual
+	 * optimization of these shards. */
+	o = fts_flatcurve_xapian_create_db_path(backend,
+						FLATCURVE_XAPIAN_DB_OPTIMIZE);
+	ob->target = o->path;
+	try {
+		ob->fingerprint = fts_flatcurve_xapian_optimize_fingerprint(
+							ob->shards);
+		if (stat(o->path, &st) == 0) {
+			Xapian::Database db(ob->target);
+			cp = db.get_metadata(FLATCURVE_XAPIAN_DB_REBUILD_KEY);
+			ob->resume = (cp.compare(0, ob->fingerprint.size() + 1,
+						 ob->fingerprint + ":") == 0);
+		}
+	} catch (Xapian::Error &e) {
+		ob->resume = FALSE;
+	}
+	if (!ob->resume)
+		fts_flatcurve_xapian_delete(backend, o);
+
+	/* The optimize lock is held until the optimization is finished. */
+	ob->lock = lock;
+	fts_flatcurve_xapian_close(backend);
+
+	opt->boxes.push_back(ob);
 #endif
 }
 
-static void
-fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
-				   struct mail_search_arg *arg,
-				   const char *term)
+/* Compacts the prepared mailboxes (using up to "threads" threads), and then
+ * replaces their shards with the optimized DBs. Returns the number of
+ * mailboxes that failed. */
+unsigned int
+fts_flatcurve_xapian_optimize_run(struct fts_flatcurve_xapian_optimize *opt,
+				  unsigned int threads)
 {
-	const char *hdr;
-	bool maybe_or = FALSE;
-	struct flatcurve_fts_query_xapian_maybe *mquery;
-	Xapian::Query::op op = Xapian::Query::OP_INVALID;
-	Xapian::Query *oldq, q;
+	unsigned int failed = 0;
+#ifdef XAPIAN_HAS_COMPACT
+	struct flatcurve_fts_backend *backend = opt->backend;
+	struct flatcurve_xapian_optimize_box *ob;
+	std::vector<struct flatcurve_xapian_optimize_box *> busy;
+	unsigned int i, retries = 0;
+	int ret;
+
+	fts_flatcurve_xapian_run_jobs(threads, opt->boxes.size(),
+				      fts_flatcurve_xapian_optimize_job, opt);
+
+	/* Mailboxes with a shard being written to are retried after the
+	 * others, so that no mailbox lock is held while waiting. */
+	for (;;) {
+		for (i = 0; i < opt->boxes.size(); ++i) {
+			ob = opt->boxes[i];
+
+			fts_backend_flatcurve_close_mailbox(backend);
+			str_append(backend->boxname, ob->boxname);
+			str_append(backend->db_path, ob->db_path);
+
+			ret = fts_flatcurve_xapian_optimize_finish(backend, ob);
+			if ((ret == 0) &&
+			    (retries < FLATCURVE_XAPIAN_OPTIMIZE_SWAP_RETRIES)) {
+				busy.push_back(ob);
+				fts_backend_flatcurve_close_mailbox(backend);
+				continue;
+			}
+			if (ret == 0) {
+				e_error(backend->event, "Optimize failed; "
+					"shards still being written to");
+				if (!ob->checkpoint)
+					fts_flatcurve_xapian_delete(backend,
+						fts_flatcurve_xapian_create_db_path(
+							backend,
+							FLATCURVE_XAPIAN_DB_OPTIMIZE));
+			}
+			if (ret <= 0) {
+				array_push_back(&opt->failed, &ob->boxname);
+				++failed;
+			}
+
+			fts_backend_flatcurve_close_mailbox(backend);
+			file_lock_free(&ob->lock);
+			delete(ob);
+		}
+
+		opt->boxes.swap(busy);
+		busy.clear();
+		if (opt->boxes.empty())
+			break;
+		++retries;
+		std::this_thread::sleep_for(std::chrono::seconds(
+			FLATCURVE_DBW_LOCK_RETRY_SECS));
+	}
+#endif
+	return failed;
+}
+
+const ARRAY_TYPE(const_string) *
+fts_flatcurve_xapian_optimize_failed(struct fts_flatcurve_xapian_optimize *opt)
+{
+	return &opt->failed;
+}
+
+void
+fts_flatcurve_xapian_optimize_deinit(struct fts_flatcurve_xapian_optimize **_opt)
+{
+	struct fts_flatcurve_xapian_optimize *opt = *_opt;
+	unsigned int i;
+
+	*_opt = NULL;
+
+	for (i = 0; i < opt->boxes.size(); ++i) {
+		file_lock_free(&opt->boxes[i]->lock);
+		delete(opt->boxes[i]);
+	}
+	pool_unref(&opt->pool);
+	delete(opt);
+}
+
+void fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend)
+{
+	struct fts_flatcurve_xapian_optimize *opt;
+
+	opt = fts_flatcurve_xapian_optimize_init(backend);
+	fts_flatcurve_xapian_optimize_add(opt);
+	(void)fts_flatcurve_xapian_optimize_run(opt, 1);
+	fts_flatcurve_xapian_optimize_deinit(&opt);
+}
+
+static Xapian::Query
+fts_flatcurve_build_query_wildcard(struct flatcurve_fts_query *query,
+				   const char *pattern)
+{
+	unsigned int max = query->backend->fuser->set.query_max_expansion;
+
+	if (max == 0)
+		return Xapian::Query(Xapian::Query::OP_WILDCARD, pattern);
+
+	/* The planner detects if this limit is reached (and doesn't run the
+	 * query then). Should it be exceeded anyway, fail the search rather
+	 * than silently dropping terms, which would lose matches. */
+	return Xapian::Query(Xapian::Query::OP_WILDCARD, pattern, max,
+			     Xapian::Query::WILDCARD_LIMIT_ERROR);
+}
+
+static struct flatcurve_fts_query_xapian_arg *
+fts_flatcurve_build_query_arg_add(struct flatcurve_fts_query *query,
+				  struct mail_search_arg *arg)
+{
+	struct flatcurve_fts_query_xapian_arg *qarg;
 	struct flatcurve_fts_query_xapian *x = query->xapian;
 
 	if (x->start) {
-		if (x->and_search) {
-			op = Xapian::Query::OP_AND;
+		if (x->and_search)
 			str_append(query->qtext, " AND ");
-		} else {
-			op = Xapian::Query::OP_OR;
+		else
 			str_append(query->qtext, " OR ");
-		}
 	}
 	x->start = TRUE;
 
-	if (arg->match_not)
-		str_append(query->qtext, "NOT ");
+	if (arg->match_not)
+		str_append(query->qtext, "NOT ");
+
+	qarg = array_append_space(&x->args);
+	p_array_init(&qarg->terms, query->pool, 2);
+	qarg->match_not = arg->match_not;
+	qarg->slot = FLATCURVE_XAPIAN_VALUE_NONE;
+
+	return qarg;
+}
+
+/* Search dates are days, given as the UTC timestamp of their midnight.
+ * Unless the search uses UTC times, Dovecot compares them to the local time
+ * of the received date, so return the UTC timestamp of the local midnight
+ * (which mktime() adjusts for DST as well). */
+static double
+fts_flatcurve_build_query_arg_date(time_t date, bool local)
+{
+	struct tm tm;
+
+	if (!local)
+		return date;
+
+	tm = *gmtime(&date);
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/* Returns FALSE if the search argument can't be filtered via Xapian. */
+static bool
+fts_flatcurve_build_query_arg_value(struct flatcurve_fts_query *query,
+				    struct mail_search_arg *arg)
+{
+	double begin = 0, end = 0;
+	bool has_begin = FALSE, has_end = FALSE, local = FALSE;
+	const char *qp;
+	struct flatcurve_fts_query_xapian_arg *qarg;
+	Xapian::valueno slot;
+
+	switch (arg->type) {
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+		switch (arg->value.date_type) {
+		case MAIL_SEARCH_DATE_TYPE_RECEIVED:
+			/* Received dates are stored in UTC. */
+			local = ((arg->value.search_flags &
+				  MAIL_SEARCH_ARG_FLAG_UTC_TIMES) == 0);
+			slot = FLATCURVE_XAPIAN_VALUE_RECEIVED;
+			qp = FLATCURVE_XAPIAN_RECEIVED_QP;
+			break;
+		case MAIL_SEARCH_DATE_TYPE_SENT:
+			/* Sent dates are stored in the timezone of the
+			 * message, so only standard IMAP searches can be
+			 * filtered. */
+			if ((arg->value.search_flags &
+			     MAIL_SEARCH_ARG_FLAG_UTC_TIMES) != 0)
+				return FALSE;
+			slot = FLATCURVE_XAPIAN_VALUE_SENT;
+			qp = FLATCURVE_XAPIAN_SENT_QP;
+			break;
+		default:
+			return FALSE;
+		}
+
+		if (arg->type != SEARCH_BEFORE) {
+			begin = fts_flatcurve_build_query_arg_date(
+				arg->value.time, local);
+			has_begin = TRUE;
+		}
+		if (arg->type != SEARCH_SINCE) {
+			end = fts_flatcurve_build_query_arg_date(
+				(arg->type == SEARCH_ON)
+					? arg->value.time + 24*3600
+					: arg->value.time, local) - 1;
+			has_end = TRUE;
+		}
+		break;
+
+	case SEARCH_SMALLER:
+		slot = FLATCURVE_XAPIAN_VALUE_SIZE;
+		qp = FLATCURVE_XAPIAN_SIZE_QP;
+		end = (double)arg->value.size - 1;
+		has_end = TRUE;
+		break;
+
+	case SEARCH_LARGER:
+		slot = FLATCURVE_XAPIAN_VALUE_SIZE;
+		qp = FLATCURVE_XAPIAN_SIZE_QP;
+		begin = (double)arg->value.size + 1;
+		has_begin = TRUE;
+		break;
+
+	default:
+		return FALSE;
+	}
+
+	qarg = fts_flatcurve_build_query_arg_add(query, arg);
+	qarg->slot = slot;
+
+	if (has_begin && has_end) {
+		qarg->query = new Xapian::Query(Xapian::Query::OP_VALUE_RANGE,
+			slot, Xapian::sortable_serialise(begin),
+			Xapian::sortable_serialise(end));
+		str_printfa(query->qtext, "%s:%.0f..%.0f", qp, begin, end);
+	} else if (has_begin) {
+		qarg->query = new Xapian::Query(Xapian::Query::OP_VALUE_GE,
+			slot, Xapian::sortable_serialise(begin));
+		str_printfa(query->qtext, "%s:%.0f..", qp, begin);
+	} else {
+		qarg->query = new Xapian::Query(Xapian::Query::OP_VALUE_LE,
+			slot, Xapian::sortable_serialise(end));
+		str_printfa(query->qtext, "%s:..%.0f", qp, end);
+	}
+
+	return TRUE;
+}
+
+static void
+fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
+				   struct mail_search_arg *arg,
+				   const char *term)
+{
+	struct flatcurve_fts_query_xapian_arg *qarg;
+	const char *hdr, *t;
+	Xapian::Query q;
+
+	qarg = fts_flatcurve_build_query_arg_add(query, arg);
+	qarg->wildcard = TRUE;
 
 	switch (arg->type) {
 	case SEARCH_TEXT:
+		t = p_strdup_printf(query->pool, "%s%s",
+				    FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX, term);
+		array_push_back(&qarg->terms, &t);
+		t = p_strdup(query->pool, term);
+		array_push_back(&qarg->terms, &t);
 		q = Xapian::Query(Xapian::Query::OP_OR,
-			Xapian::Query(Xapian::Query::OP_WILDCARD,
+			fts_flatcurve_build_query_wildcard(query,
 				t_strdup_printf("%s%s",
 					FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX,
 					term)),
-			Xapian::Query(Xapian::Query::OP_WILDCARD, term));
+			fts_flatcurve_build_query_wildcard(query, term));
 		str_printfa(query->qtext, "(%s:%s* OR %s:%s*)",
 			    FLATCURVE_XAPIAN_ALL_HEADERS_QP, term,
 			    FLATCURVE_XAPIAN_BODY_QP, term);
 		break;
 
 	case SEARCH_BODY:
-		q = Xapian::Query(Xapian::Query::OP_WILDCARD, term);
+		t = p_strdup(query->pool, term);
+		array_push_back(&qarg->terms, &t);
+		q = fts_flatcurve_build_query_wildcard(query, term);
 		str_printfa(query->qtext, "%s:%s*",
 			    FLATCURVE_XAPIAN_BODY_QP, term);
 		break;
@@ -1546,63 +3673,61 @@ fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
 	case SEARCH_HEADER_COMPRESS_LWSP:
 		if (strlen(term)) {
 			if (fts_header_want_indexed(arg->hdr_field_name)) {
-				q = Xapian::Query(
-					Xapian::Query::OP_WILDCARD,
-					t_strdup_printf("%s%s%s",
-						FLATCURVE_XAPIAN_HEADER_PREFIX,
-						t_str_ucase(arg->hdr_field_name),
-						term));
+				t = p_strdup_printf(query->pool, "%s%s%s",
+					FLATCURVE_XAPIAN_HEADER_PREFIX,
+					t_str_ucase(arg->hdr_field_name),
+					term);
+				array_push_back(&qarg->terms, &t);
+				q = fts_flatcurve_build_query_wildcard(
+					query, t);
 				str_printfa(query->qtext, "%s%s:%s*",
 					    FLATCURVE_XAPIAN_HEADER_QP,
 					    t_str_lcase(arg->hdr_field_name),
 					    term);
 			} else {
-				q = Xapian::Query(
-					Xapian::Query::OP_WILDCARD,
-					t_strdup_printf("%s%s",
-						FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX,
-						term));
+				t = p_strdup_printf(query->pool, "%s%s",
+					FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX,
+					term);
+				array_push_back(&qarg->terms, &t);
+				q = fts_flatcurve_build_query_wildcard(
+					query, t);
 				str_printfa(query->qtext, "%s:%s*",
 					    FLATCURVE_XAPIAN_ALL_HEADERS_QP,
 					    term);
 				/* Non-indexed headers only match if it
 				 * appears in the general pool of header
 				 * terms for the message, not to a specific
-				 * header, so this is only a maybe match. */
-				if (x->and_search)
-					x->maybe = TRUE;
-				else
-					maybe_or = TRUE;
+				 * header, so this is only a maybe match
+				 * (unless the header has been learned; see
+				 * the query planner). */
+				qarg->maybe = TRUE;
+
+				qarg->hdr = p_strdup(query->pool,
+					t_str_lcase(arg->hdr_field_name));
+				p_array_init(&qarg->hdr_terms, query->pool, 1);
+				t = p_strdup_printf(query->pool, "%s%s%s",
+					FLATCURVE_XAPIAN_HEADER_PREFIX,
+					t_str_ucase(arg->hdr_field_name),
+					term);
+				array_push_back(&qarg->hdr_terms, &t);
+				qarg->hdr_query = new Xapian::Query(
+					fts_flatcurve_build_query_wildcard(
+						query, t));
 			}
 		} else {
 			hdr = t_str_lcase(arg->hdr_field_name);
-			q = Xapian::Query(t_strdup_printf("%s%s",
-				FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX, hdr));
+			t = p_strdup_printf(query->pool, "%s%s",
+				FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX, hdr);
+			array_push_back(&qarg->terms, &t);
+			qarg->wildcard = FALSE;
+			q = Xapian::Query(t);
 			str_printfa(query->qtext, "%s:%s",
 				    FLATCURVE_XAPIAN_HEADER_BOOL_QP, hdr);
 		}
 		break;
 	}
 
-	if (arg->match_not)
-		q = Xapian::Query(Xapian::Query::OP_AND_NOT,
-				  Xapian::Query::MatchAll, q);
-
-	if (maybe_or) {
-		/* Maybe searches are not added to the "master search" query if this
-		 * is an OR search; they will be run independently. Matches will be
-		 * placed in the maybe results array. */
-		if (!array_is_created(&x->maybe_queries))
-			p_array_init(&x->maybe_queries, query->pool, 4);
-		mquery = array_append_space(&x->maybe_queries);
-		mquery->query = new Xapian::Query(std_move(q));
-	} else if (x->query == NULL) {
-		x->query = new Xapian::Query(std_move(q));
-	} else {
-		oldq = x->query;
-		x->query = new Xapian::Query(op, *(x->query), q);
-		delete(oldq);
-	}
+	qarg->query = new Xapian::Query(std_move(q));
 }
 
 static void
@@ -1626,6 +3751,17 @@ fts_flatcurve_build_query_arg(struct flatcurve_fts_query *query,
 		arg->match_always = TRUE;
 		break;
 
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+	case SEARCH_SMALLER:
+	case SEARCH_LARGER:
+		/* Dates and sizes are stored as values, so these can be
+		 * handled directly by Xapian (as a filter). */
+		if (fts_flatcurve_build_query_arg_value(query, arg))
+			arg->match_always = TRUE;
+		return;
+
 	case SEARCH_MAILBOX:
 		/* doveadm will pass this through in 'doveadm search'
 		 * commands with a 'mailbox' search argument. The code has
@@ -1672,172 +3808,982 @@ void fts_flatcurve_xapian_build_query(struct flatcurve_fts_query *query)
 {
 	struct mail_search_arg *args = query->args;
 	struct flatcurve_fts_query_xapian *x;
+	struct timeval start, now;
+
+	i_gettimeofday(&start);
 
 	x = query->xapian = p_new(query->pool,
 				  struct flatcurve_fts_query_xapian, 1);
-
-	if (query->match_all) {
-		str_append(query->qtext, "[Match All]");
-		x->query = new Xapian::Query(Xapian::Query::MatchAll);
-		return;
-	}
+	p_array_init(&x->args, query->pool, 4);
 
 	x->and_search = ((query->flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0);
 
 	for (; args != NULL ; args = args->next) {
 		fts_flatcurve_build_query_arg(query, args);
 	}
+
+	i_gettimeofday(&now);
+	x->profile.build_usecs = timeval_diff_usecs(&now, &start);
 }
 
-struct fts_flatcurve_xapian_query_iter *
-fts_flatcurve_xapian_query_iter_init(struct flatcurve_fts_query *query)
+/* Estimate the number of documents matched by the (positive form of the)
+ * argument. An estimate of 0 is exact: the argument can not match any
+ * document in the DB. */
+static Xapian::doccount
+fts_flatcurve_xapian_plan_estimate(Xapian::Database *db,
+				   const ARRAY_TYPE(const_string) *terms)
 {
-	struct fts_flatcurve_xapian_query_iter *iter;
+	Xapian::doccount est = 0;
+	const char *const *term;
 
-	iter = p_new(query->pool, struct fts_flatcurve_xapian_query_iter, 1);
-	iter->init = FALSE;
-	iter->main_query = TRUE;
-	iter->query = query;
-	iter->result = p_new(query->pool,
-			     struct fts_flatcurve_xapian_query_result, 1);
+	array_foreach(terms, term)
+		est += db->get_termfreq(*term);
 
-	return iter;
+	return I_MIN(est, db->get_doccount());
 }
 
-struct fts_flatcurve_xapian_query_result *
-fts_flatcurve_xapian_query_iter_next(struct fts_flatcurve_xapian_query_iter *iter)
+static bool
+fts_flatcurve_xapian_expand_term_cmp(const std::pair<std::string, Xapian::doccount> &a,
+				     const std::pair<std::string, Xapian::doccount> &b)
 {
-	Xapian::Query maybe, *q = NULL;
-	const struct flatcurve_fts_query_xapian_maybe *mquery;
-	enum flatcurve_xapian_db_opts opts =
-		ENUM_EMPTY(flatcurve_xapian_db_opts);
+	return (a.first < b.first);
+}
+
+/* Expand a wildcard pattern against a single shard, appending at most
+ * limit (term, termfreq) pairs to terms. Returns FALSE if there are more
+ * matching terms than that. */
+static bool
+fts_flatcurve_xapian_plan_expand_shard(struct flatcurve_xapian_db *xdb,
+				       const char *pattern, unsigned int limit,
+				       flatcurve_xapian_expand_terms &terms)
+{
+	flatcurve_xapian_expand_terms shard;
+	Xapian::TermIterator t, tend;
+	bool complete = TRUE;
+#ifdef XAPIAN_HAS_GET_REVISION
+	std::map<std::string, struct flatcurve_xapian_expand_cache_entry>::iterator it;
+	struct flatcurve_xapian_expand_cache_entry *entry;
+	std::string key;
+	Xapian::rev rev = 0;
+	bool cache = (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX);
+
+	if (cache) {
+		key = fts_flatcurve_xapian_expand_cache_shard(xdb) + pattern;
+		rev = xdb->db->get_revision();
+		it = flatcurve_xapian_expand_cache.find(key);
+		if ((it != flatcurve_xapian_expand_cache.end()) &&
+		    (it->second.revision == rev) &&
+		    (it->second.complete || (it->second.limit >= limit))) {
+			entry = &it->second;
+			if (entry->terms.size() > limit) {
+				terms.insert(terms.end(), entry->terms.begin(),
+					     entry->terms.begin() + limit);
+				return FALSE;
+			}
+			terms.insert(terms.end(), entry->terms.begin(),
+				     entry->terms.end());
+			return entry->complete;
+		}
+	}
+#endif
+
+	for (t = xdb->db->allterms_begin(pattern),
+	     tend = xdb->db->allterms_end(pattern); t != tend; ++t) {
+		if (shard.size() >= limit) {
+			complete = FALSE;
+			break;
+		}
+		shard.push_back(std::make_pair(*t, t.get_termfreq()));
+	}
+	terms.insert(terms.end(), shard.begin(), shard.end());
+
+#ifdef XAPIAN_HAS_GET_REVISION
+	if (cache) {
+		if (flatcurve_xapian_expand_cache_terms + shard.size() >
+		    FLATCURVE_XAPIAN_EXPAND_CACHE_MAX_TERMS) {
+			flatcurve_xapian_expand_cache.clear();
+			flatcurve_xapian_expand_cache_terms = 0;
+		}
+		if (shard.size() <= FLATCURVE_XAPIAN_EXPAND_CACHE_MAX_TERMS) {
+			entry = &flatcurve_xapian_expand_cache[key];
+			flatcurve_xapian_expand_cache_terms -=
+				entry->terms.size();
+			flatcurve_xapian_expand_cache_terms += shard.size();
+			entry->revision = rev;
+			entry->limit = limit;
+			entry->complete = complete;
+			entry->terms.swap(shard);
+		}
+	}
+#endif
+
+	return complete;
+}
+
+/* Expand a wildcard pattern into the list of matching terms, or return the
+ * cached expansion if the pattern has already been seen in this query. The
+ * estimate (sum of the term frequencies) overestimates the number of
+ * matching documents, since a document may contain several of the terms.
+ * The expansion is done per shard, as index shard expansions are cached
+ * across queries. */
+static const struct flatcurve_fts_query_xapian_expansion &
+fts_flatcurve_xapian_plan_expand(struct flatcurve_fts_query *query,
+				 Xapian::Database *db,
+				 const std::chrono::steady_clock::time_point *deadline,
+				 flatcurve_fts_query_xapian_expansions &cache,
+				 const char *pattern)
+{
+	flatcurve_fts_query_xapian_expansions::iterator it;
+	struct flatcurve_fts_query_xapian_expansion e;
+	flatcurve_xapian_expand_terms terms;
+	flatcurve_xapian_expand_terms::iterator t, merged;
+	std::vector<std::string> synonyms;
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	struct flatcurve_xapian_db *xdb;
+	unsigned int limit, shards = 0;
+	bool complete = TRUE;
+	struct flatcurve_xapian *x = query->backend->xapian;
+	unsigned int max = query->backend->fuser->set.query_max_expansion;
+
+	if ((it = cache.find(pattern)) != cache.end())
+		return it->second;
+
+	/* Enough terms to know whether either limit has been reached. */
+	limit = I_MAX(max, FLATCURVE_XAPIAN_PLAN_EXPAND_MAX) + 1;
+
+	iter = hash_table_iterate_init(x->dbs);
+	while (!query->xapian->timed_out &&
+	       hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (xdb->db == NULL)
+			continue;
+		/* Expanding can be as expensive as matching, so the query
+		 * timeout applies here as well. Once it is exceeded, the
+		 * query isn't run at all. */
+		if ((deadline != NULL) &&
+		    (std::chrono::steady_clock::now() >= *deadline)) {
+			query->xapian->timed_out = TRUE;
+			break;
+		}
+		if (!fts_flatcurve_xapian_plan_expand_shard(xdb, pattern,
+							    limit, terms))
+			complete = FALSE;
+		++shards;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	if (query->xapian->timed_out) {
+		e.query = Xapian::Query::MatchNothing;
+		e.estimate = e.terms = 0;
+		e.truncated = FALSE;
+		return (cache[pattern] = e);
+	}
+
+	/* Merge the shard expansions: sum frequencies of identical terms. */
+	if (shards > 1) {
+		std::sort(terms.begin(), terms.end(),
+			  fts_flatcurve_xapian_expand_term_cmp);
+		merged = terms.begin();
+		for (t = terms.begin(); t != terms.end(); ++t) {
+			if (t == terms.begin())
+				continue;
+			if (t->first == merged->first)
+				merged->second += t->second;
+			else
+				*(++merged) = *t;
+		}
+		if (!terms.empty())
+			terms.erase(merged + 1, terms.end());
+	}
+
+	e.estimate = 0;
+	for (t = terms.begin(); t != terms.end(); ++t)
+		e.estimate += t->second;
+	e.estimate = I_MIN(e.estimate, db->get_doccount());
+	e.terms = terms.size();
+
+	e.truncated = (max > 0) && (!complete || (terms.size() > max));
+	if (e.truncated || !complete ||
+	    (terms.size() > FLATCURVE_XAPIAN_PLAN_EXPAND_MAX)) {
+		/* Leave the expansion to Xapian (a truncated expansion is
+		 * not searched, see fts_flatcurve_xapian_run_query). */
+		e.query = fts_flatcurve_build_query_wildcard(query, pattern);
+	} else {
+		for (t = terms.begin(); t != terms.end(); ++t)
+			synonyms.push_back(t->first);
+		e.query = Xapian::Query(Xapian::Query::OP_SYNONYM,
+					synonyms.begin(), synonyms.end());
+	}
+
+	return (cache[pattern] = e);
+}
+
+static Xapian::Query
+fts_flatcurve_xapian_plan_not(const Xapian::Query *query)
+{
+	return Xapian::Query(Xapian::Query::OP_AND_NOT,
+			     Xapian::Query::MatchAll, *query);
+}
+
+/* Values can only be filtered on if every document in the DB has them
+ * (documents indexed by older versions do not). */
+static bool
+fts_flatcurve_xapian_plan_values(Xapian::Database *db, Xapian::valueno slot)
+{
+	return (db->get_value_freq(slot) == db->get_doccount());
+}
+
+/* A learned header can only be searched via its dedicated header index if
+ * every document in the DB was indexed after the header was learned. */
+static bool
+fts_flatcurve_xapian_plan_promoted(Xapian::Database *db, const char *hdr)
+{
+	Xapian::doccount doccount = db->get_doccount();
+
+	return ((doccount > 0) &&
+		(db->get_termfreq(FLATCURVE_XAPIAN_PROMOTED_PREFIX +
+				  std::string(hdr)) == doccount));
+}
+
+/* Build the Xapian queries for a specific DB. Subqueries that can't match
+ * anything are pruned, AND queries containing such a subquery are
+ * short-circuited, and AND subqueries are ordered rarest first. If it is
+ * known that nothing can match, no query is generated at all, so that the
+ * Enquire doesn't need to be run. */
+/* Negations that can't be applied against positive siblings are placed in
+ * not_query, to be evaluated as a set difference by the caller. */
+static void
+fts_flatcurve_xapian_plan_query(struct flatcurve_fts_query *query,
+				Xapian::Database *db,
+				const std::chrono::steady_clock::time_point *deadline)
+{
+	const struct flatcurve_fts_query_xapian_arg *arg;
+	std::vector<Xapian::Query> maybe;
+	std::vector<struct flatcurve_fts_query_xapian_plan> neg, pos;
+	struct flatcurve_fts_query_xapian_plan p;
+	Xapian::Query q;
+	const ARRAY_TYPE(const_string) *terms;
+	const char *const *term;
+	flatcurve_fts_query_xapian_expansions expansions;
+	std::deque<Xapian::Query> expanded;
+	std::vector<Xapian::Query> wildcards;
+	bool match_all = FALSE, match_none = FALSE, maybe_arg;
+	struct flatcurve_fts_query_xapian *x = query->xapian;
 
-	if (!iter->init) {
-		iter->init = TRUE;
+	delete(x->query);
+	delete(x->maybe_query);
+	delete(x->not_query);
+	x->query = x->maybe_query = x->not_query = NULL;
+	x->maybe = x->truncated = x->timed_out = FALSE;
+
+	array_foreach(&x->args, arg) {
+		if (arg->slot != FLATCURVE_XAPIAN_VALUE_NONE) {
+			if (!fts_flatcurve_xapian_plan_values(db, arg->slot)) {
+				/* Can't filter: everything is a maybe
+				 * match for this argument, and Dovecot
+				 * will need to verify the results. */
+				if (x->and_search)
+					x->maybe = TRUE;
+				else
+					maybe.push_back(Xapian::Query::MatchAll);
+				continue;
+			}
 
-		/* Master query. */
-		if (iter->main_query) {
-			if (iter->query->xapian->query == NULL)
-				iter->main_query = FALSE;
+			p.query = arg->query;
+			p.estimate = db->get_doccount();
+			if (arg->match_not)
+				neg.push_back(p);
 			else
-				q = iter->query->xapian->query;
+				pos.push_back(p);
+			continue;
 		}
 
-		/* Maybe queries. */
-		if (!iter->main_query &&
-			array_is_created(&iter->query->xapian->maybe_queries)) {
-			maybe = Xapian::Query();
-			array_foreach(&iter->query->xapian->maybe_queries, mquery)
-				maybe = Xapian::Query(Xapian::Query::OP_OR, maybe, *mquery->query);
-			/* Add main query to merge Xapian scores correctly. */
-			if (iter->query->xapian->query != NULL)
-				maybe = Xapian::Query(Xapian::Query::OP_AND_MAYBE, maybe,
-					*iter->query->xapian->query);
-			q = &maybe;
+		maybe_arg = arg->maybe;
+		p.query = arg->query;
+		terms = &arg->terms;
+
+		if (maybe_arg && (arg->hdr != NULL) &&
+		    fts_flatcurve_xapian_plan_promoted(db, arg->hdr)) {
+			maybe_arg = FALSE;
+			p.query = arg->hdr_query;
+			terms = &arg->hdr_terms;
 		}
 
-		if ((q != NULL) && (iter->db == NULL))
-		    iter->db = fts_flatcurve_xapian_read_db(iter->query->backend, opts);
+		if (arg->wildcard) {
+			/* The query is the OR of the wildcard terms; build it
+			 * from the (shared) expansions. */
+			wildcards.clear();
+			p.estimate = 0;
+			array_foreach(terms, term) {
+				const struct flatcurve_fts_query_xapian_expansion &e =
+					fts_flatcurve_xapian_plan_expand(
+						query, db, deadline,
+						expansions, *term);
+				++x->profile.wildcards;
+				x->profile.wildcard_terms += e.terms;
+				wildcards.push_back(e.query);
+				p.estimate += e.estimate;
+				if (e.truncated)
+					x->truncated = TRUE;
+			}
+			expanded.push_back((wildcards.size() == 1) ? wildcards[0] :
+				Xapian::Query(Xapian::Query::OP_OR,
+					      wildcards.begin(), wildcards.end()));
+			p.query = &expanded.back();
+			p.estimate = I_MIN(p.estimate, db->get_doccount());
+		} else {
+			p.estimate = fts_flatcurve_xapian_plan_estimate(db,
+									terms);
+		}
 
-		if ((q == NULL) || (iter->db == NULL))
-			return NULL;
+		/* A maybe match in an AND search makes the entire result
+		 * a maybe match. */
+		if (maybe_arg && x->and_search) {
+			x->maybe = TRUE;
+			maybe_arg = FALSE;
+		}
 
-		if (iter->enquire == NULL) {
-			iter->enquire = new Xapian::Enquire(*iter->db);
-			iter->enquire->set_docid_order(Xapian::Enquire::DONT_CARE);
+		if (maybe_arg) {
+			/* Maybe searches are not added to the "master
+			 * search" query if this is an OR search; they will
+			 * be run independently. Matches will be placed in
+			 * the maybe results array. */
+			if (arg->match_not)
+				maybe.push_back(fts_flatcurve_xapian_plan_not(p.query));
+			else if (p.estimate > 0)
+				maybe.push_back(*p.query);
+		} else if (arg->match_not) {
+			/* Negation of a query that matches nothing matches
+			 * everything: it is a no-op for an AND search and
+			 * matches the entire DB for an OR search. */
+			if (p.estimate > 0)
+				neg.push_back(p);
+			else if (!x->and_search)
+				match_all = TRUE;
+		} else if (p.estimate > 0) {
+			pos.push_back(p);
+		} else if (x->and_search) {
+			match_none = TRUE;
 		}
-		iter->enquire->set_query(*q);
+	}
 
-		try {
-			iter->m = iter->enquire->get_mset(0, iter->db->get_doccount());
-		} catch (Xapian::DatabaseModifiedError &e) {
-			/* Per documentation, this is only thrown if more than
-			 * one change has been made to the database. To
-			 * resolve you need to reopen the DB (Xapian can
-			 * handle a single snapshot of a modified DB natively,
-			 * so this only occurs if there have been multiple
-			 * writes). However, we ALWAYS want to use the
-			 * most up-to-date version, so we have already
-			 * explicitly called reopen() above. Thus, we should
-			 * never see this exception. */
-			i_unreached();
+	/* The results of a truncated wildcard are incomplete, so Dovecot
+	 * needs to verify all of them. */
+	if (x->truncated)
+		x->maybe = TRUE;
+
+	if (match_none) {
+		/* AND search with a term that has no postings; nothing can
+		 * match. (For OR searches, reaching the end of this chain
+		 * means all subqueries were pruned.) */
+	} else if (match_all) {
+		q = Xapian::Query::MatchAll;
+		x->query = new Xapian::Query(std_move(q));
+	} else if (!pos.empty() || !neg.empty()) {
+		std::vector<Xapian::Query> subq, nots;
+		std::vector<struct flatcurve_fts_query_xapian_plan>::iterator i;
+		Xapian::Query::op op = x->and_search
+			? Xapian::Query::OP_AND : Xapian::Query::OP_OR;
+
+		/* Run the most selective subqueries first. */
+		if (x->and_search)
+			std::stable_sort(pos.begin(), pos.end());
+
+		for (i = pos.begin(); i != pos.end(); ++i)
+			subq.push_back(*i->query);
+		for (i = neg.begin(); i != neg.end(); ++i)
+			nots.push_back(*i->query);
+
+		if (nots.empty()) {
+			q = Xapian::Query(op, subq.begin(), subq.end());
+			x->query = new Xapian::Query(std_move(q));
+		} else if (x->and_search && !subq.empty()) {
+			/* Negations only need to be checked against the
+			 * documents matched by the positive searches. */
+			q = Xapian::Query(Xapian::Query::OP_AND_NOT,
+				Xapian::Query(op, subq.begin(), subq.end()),
+				Xapian::Query(Xapian::Query::OP_OR,
+					      nots.begin(), nots.end()));
+			x->query = new Xapian::Query(std_move(q));
+		} else {
+			/* AND: documents matching none of the negations.
+			 * OR: documents not matching all of the negations
+			 * (in addition to those matching a positive). */
+			if (!subq.empty()) {
+				q = Xapian::Query(op, subq.begin(), subq.end());
+				x->query = new Xapian::Query(std_move(q));
+			}
+			q = Xapian::Query(x->and_search
+					  ? Xapian::Query::OP_OR
+					  : Xapian::Query::OP_AND,
+					  nots.begin(), nots.end());
+			x->not_query = new Xapian::Query(std_move(q));
 		}
+	} else if (x->and_search && !array_is_empty(&x->args)) {
+		/* Every subquery of the AND search was a no-op negation. */
+		q = Xapian::Query::MatchAll;
+		x->query = new Xapian::Query(std_move(q));
+	}
+
+	if (!maybe.empty()) {
+		q = Xapian::Query(Xapian::Query::OP_OR, maybe.begin(),
+				  maybe.end());
+		x->maybe_query = new Xapian::Query(std_move(q));
+	}
+}
+
+static bool
+fts_flatcurve_xapian_hit_uid_cmp(const struct flatcurve_fts_query_xapian_hit &a,
+				 const struct flatcurve_fts_query_xapian_hit &b)
+{
+	return (a.uid < b.uid);
+}
+
+/* Stable sort of hits by UID. MSets are returned in DONT_CARE order, which
+ * is frequently already sorted (single shard), so check for that first.
+ * Large lists are sorted with an LSD radix sort (two 16-bit passes), whose
+ * buckets are only worth allocating above FLATCURVE_XAPIAN_RADIX_SORT_MIN
+ * hits. */
+static void
+fts_flatcurve_xapian_sort_hits(std::vector<struct flatcurve_fts_query_xapian_hit> &hits)
+{
+	std::vector<struct flatcurve_fts_query_xapian_hit> tmp;
+	std::vector<size_t> lo, hi;
+	size_t i;
 
-		iter->i = iter->m.begin();
+	for (i = 1; i < hits.size(); ++i) {
+		if (hits[i].uid < hits[i - 1].uid)
+			break;
 	}
+	if (i >= hits.size())
+		return;
 
-	if (iter->i == iter->m.end()) {
-		if (!iter->main_query)
-			return NULL;
-		iter->main_query = iter->init = FALSE;
-		return fts_flatcurve_xapian_query_iter_next(iter);
+	if (hits.size() < FLATCURVE_XAPIAN_RADIX_SORT_MIN) {
+		std::stable_sort(hits.begin(), hits.end(),
+				 fts_flatcurve_xapian_hit_uid_cmp);
+		return;
 	}
 
-	iter->result->maybe = !iter->main_query;
-	iter->result->score = iter->i.get_weight();
-	/* MSet docid can be an "interleaved" docid generated by
-	 * Xapian::Database when handling multiple DBs at once. Instead, we
-	 * want the "unique docid", which is obtained by looking at the
-	 * doc id from the Document object itself. */
-	iter->result->uid = iter->i.get_document().get_docid();
-	++iter->i;
+	lo.resize(0x10001);
+	hi.resize(0x10001);
+	for (i = 0; i < hits.size(); ++i) {
+		++lo[(hits[i].uid & 0xffff) + 1];
+		++hi[(hits[i].uid >> 16) + 1];
+	}
+	for (i = 1; i < lo.size(); ++i) {
+		lo[i] += lo[i - 1];
+		hi[i] += hi[i - 1];
+	}
 
-	return iter->result;
+	tmp.resize(hits.size());
+	for (i = 0; i < hits.size(); ++i)
+		tmp[lo[hits[i].uid & 0xffff]++] = hits[i];
+	for (i = 0; i < tmp.size(); ++i)
+		hits[hi[tmp[i].uid >> 16]++] = tmp[i];
 }
 
-void
-fts_flatcurve_xapian_query_iter_deinit(struct fts_flatcurve_xapian_query_iter **_iter)
+/* Hits must be sorted and unique. */
+static void
+fts_flatcurve_xapian_hits_to_ranges(const std::vector<struct flatcurve_fts_query_xapian_hit> &hits,
+				    ARRAY_TYPE(seq_range) *uids)
 {
-	struct fts_flatcurve_xapian_query_iter *iter = *_iter;
+	std::vector<struct flatcurve_fts_query_xapian_hit>::const_iterator i;
+	struct seq_range *range = NULL;
 
-	/* Need to explicitly call dtor, or else MSet doesn't release memory
-	 * allocated internally. */
-	*_iter = NULL;
-	iter->i.~MSetIterator();
-	iter->m.~MSet();
-	delete(iter->enquire);
-	p_free(iter->query->pool, iter->result);
-	p_free(iter->query->pool, iter);
+	for (i = hits.begin(); i != hits.end(); ++i) {
+		if ((range != NULL) && (i->uid == range->seq2 + 1)) {
+			range->seq2 = i->uid;
+		} else {
+			range = array_append_space(uids);
+			range->seq1 = range->seq2 = i->uid;
+		}
+	}
+}
+
+static bool
+fts_flatcurve_xapian_hit_uid_eq(const struct flatcurve_fts_query_xapian_hit &a,
+				const struct flatcurve_fts_query_xapian_hit &b)
+{
+	return (a.uid == b.uid);
+}
+
+static void
+fts_flatcurve_xapian_shard_query_mset(struct flatcurve_xapian_shard_query *sq,
+				      Xapian::Enquire &enquire,
+				      const Xapian::Query &q,
+				      std::vector<struct flatcurve_fts_query_xapian_hit> &hits)
+{
+	struct flatcurve_fts_query_xapian_hit hit;
+	Xapian::MSet m;
+	Xapian::MSetIterator i;
+	flatcurve_xapian_deadline_decider decider(sq);
+
+	if (sq->use_deadline &&
+	    (sq->timed_out ||
+	     (std::chrono::steady_clock::now() >= sq->deadline))) {
+		sq->timed_out = TRUE;
+		return;
+	}
+
+	enquire.set_query(q);
+	try {
+		m = enquire.get_mset(0, sq->db->get_doccount(), 0, NULL,
+				     sq->use_deadline ? &decider : NULL);
+	} catch (struct flatcurve_xapian_deadline_exceeded &e) {
+		/* Out of time: return what has been matched so far. */
+		sq->timed_out = TRUE;
+		hits.insert(hits.end(), decider.matched.begin(),
+			    decider.matched.end());
+		return;
+	}
+	hits.reserve(hits.size() + m.size());
+	for (i = m.begin(); i != m.end(); ++i) {
+		/* A shard DB searched on its own returns the message UIDs as
+		 * docids. The combined DB returns "interleaved" docids, so
+		 * the unique docid needs to be obtained from the Document
+		 * object itself. */
+		hit.uid = sq->combined ? i.get_document().get_docid() : *i;
+		hit.score = (float)i.get_weight();
+		hits.push_back(hit);
+	}
+}
+
+static void fts_flatcurve_xapian_shard_query_job(void *context,
+						 unsigned int idx)
+{
+	struct flatcurve_xapian_shard_query *sq =
+		&((struct flatcurve_xapian_shard_query *)context)[idx];
+
+	try {
+		Xapian::Enquire enquire(*sq->db);
+		enquire.set_docid_order(Xapian::Enquire::DONT_CARE);
+
+		if (sq->has_query)
+			fts_flatcurve_xapian_shard_query_mset(sq, enquire,
+				sq->query, sq->maybe ? sq->maybe_hits : sq->hits);
+		if (sq->has_maybe_query)
+			fts_flatcurve_xapian_shard_query_mset(sq, enquire,
+				sq->maybe_query, sq->maybe_hits);
+		if (sq->has_not_query) {
+			/* Only the matching docids are needed. */
+			enquire.set_weighting_scheme(Xapian::BoolWeight());
+			fts_flatcurve_xapian_shard_query_mset(sq, enquire,
+				sq->not_query, sq->nots);
+		}
+	} catch (Xapian::Error &e) {
+		sq->error = e.get_description();
+	} catch (std::bad_alloc &b) {
+		sq->error = "Out of memory";
+	}
+}
+
+/* Returns TRUE if the DB is large enough to be searched on multiple
+ * threads. */
+static bool fts_flatcurve_xapian_query_threaded(Xapian::Database *db)
+{
+	try {
+		return (db->get_doccount() >=
+			FLATCURVE_XAPIAN_QUERY_THREADS_MIN_DOCS);
+	} catch (Xapian::Error &e) {
+		/* The search on the calling thread reports the error. */
+		return FALSE;
+	}
+}
+
+/* Give every shard job a private deep copy of the queries: copying a
+ * Xapian::Query only copies the (non-atomic) reference, so the jobs must
+ * never touch the objects owned by the query struct. Returns FALSE on
+ * error. */
+static bool
+fts_flatcurve_xapian_shard_query_copy(struct flatcurve_fts_query *query,
+				      std::vector<struct flatcurve_xapian_shard_query> &sq)
+{
+	std::string query_str, maybe_str, not_str;
+	unsigned int i;
+	struct flatcurve_fts_query_xapian *qx = query->xapian;
+
+	try {
+		if (qx->query != NULL)
+			query_str = qx->query->serialise();
+		if (qx->maybe_query != NULL)
+			maybe_str = (qx->query != NULL) ?
+				Xapian::Query(Xapian::Query::OP_AND_MAYBE,
+					      *qx->maybe_query,
+					      *qx->query).serialise() :
+				qx->maybe_query->serialise();
+		if (qx->not_query != NULL)
+			not_str = qx->not_query->serialise();
+
+		for (i = 0; i < sq.size(); ++i) {
+			if (qx->query != NULL)
+				sq[i].query = Xapian::Query::unserialise(
+					query_str);
+			if (qx->maybe_query != NULL)
+				sq[i].maybe_query = Xapian::Query::unserialise(
+					maybe_str);
+			if (qx->not_query != NULL)
+				sq[i].not_query = Xapian::Query::unserialise(
+					not_str);
+		}
+	} catch (Xapian::Error &e) {
+		e_error(query->backend->event, "Query failed; %s",
+			e.get_description().c_str());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Returns the sorted UIDs of the documents of the shard searches that ran
+ * out of time. Throws Xapian::Error. */
+static void
+fts_flatcurve_xapian_shard_query_unevaluated(struct flatcurve_fts_backend *backend,
+					     const std::vector<struct flatcurve_xapian_shard_query> &sq,
+					     std::vector<uint32_t> &unevaluated)
+{
+	const std::vector<uint32_t> *uids;
+	Xapian::PostingIterator p;
+	unsigned int i;
+
+	for (i = 0; i < sq.size(); ++i) {
+		if (!sq[i].timed_out)
+			continue;
+		if (sq[i].db == backend->xapian->db_read) {
+			/* The combined DB: nothing can be ruled out. */
+			uids = fts_flatcurve_xapian_all_uids(backend);
+			unevaluated.assign(uids->begin(), uids->end());
+			return;
+		}
+		for (p = sq[i].db->postlist_begin("");
+		     p != sq[i].db->postlist_end(""); ++p)
+			unevaluated.push_back(*p);
+	}
+
+	std::sort(unevaluated.begin(), unevaluated.end());
+}
+
+/* Run the planned query. If fts_flatcurve_query_threads is set (and the
+ * mailbox has multiple shards and enough documents), each shard is searched
+ * separately, on multiple threads; the plan was created against the
+ * combined DB, which is valid for each shard as the shards are disjoint
+ * subsets of it. If the query times out, the UIDs of the shards that were
+ * not completely searched are returned in unevaluated. Returns FALSE on
+ * error. */
+static bool
+fts_flatcurve_xapian_run_query_shards(struct flatcurve_fts_query *query,
+				      Xapian::Database *db,
+				      std::vector<struct flatcurve_fts_query_xapian_hit> &hits,
+				      std::vector<struct flatcurve_fts_query_xapian_hit> &maybe,
+				      std::vector<struct flatcurve_fts_query_xapian_hit> &nots,
+				      const std::chrono::steady_clock::time_point *deadline,
+				      bool &timed_out,
+				      std::vector<uint32_t> &unevaluated)
+{
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	std::vector<struct flatcurve_xapian_shard_query> sq;
+	struct flatcurve_xapian_shard_query shard;
+	struct flatcurve_xapian_db *xdb;
+	unsigned int i, threads;
+	struct flatcurve_fts_backend *backend = query->backend;
+	struct flatcurve_fts_query_xapian *qx = query->xapian;
+	struct flatcurve_xapian *x = backend->xapian;
+
+	shard.has_query = (qx->query != NULL);
+	shard.has_maybe_query = (qx->maybe_query != NULL);
+	shard.has_not_query = (qx->not_query != NULL);
+	shard.maybe = qx->maybe;
+	shard.combined = FALSE;
+	shard.timed_out = FALSE;
+	shard.use_deadline = (deadline != NULL);
+	if (shard.use_deadline)
+		shard.deadline = *deadline;
+
+	threads = backend->fuser->set.query_threads;
+	if ((threads > 0) && (x->shards > 1) &&
+	    fts_flatcurve_xapian_query_threaded(db)) {
+		iter = hash_table_iterate_init(x->dbs);
+		while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+			xdb = (struct flatcurve_xapian_db *)val;
+			if (xdb->db != NULL) {
+				shard.db = xdb->db;
+				sq.push_back(shard);
+			}
+		}
+		hash_table_iterate_deinit(&iter);
+	}
+
+	if (sq.empty()) {
+		/* The combined DB is searched on this thread, so the queries
+		 * don't need to be copied. */
+		shard.db = db;
+		shard.combined = (x->shards > 1);
+		if (shard.has_query)
+			shard.query = *qx->query;
+		if (shard.has_maybe_query)
+			shard.maybe_query = shard.has_query ?
+				Xapian::Query(Xapian::Query::OP_AND_MAYBE,
+					      *qx->maybe_query, *qx->query) :
+				*qx->maybe_query;
+		if (shard.has_not_query)
+			shard.not_query = *qx->not_query;
+		sq.push_back(shard);
+		fts_flatcurve_xapian_shard_query_job(&sq[0], 0);
+		threads = 1;
+	} else {
+		if (!fts_flatcurve_xapian_shard_query_copy(query, sq))
+			return FALSE;
+		fts_flatcurve_xapian_run_jobs(threads, sq.size(),
+					      fts_flatcurve_xapian_shard_query_job,
+					      &sq[0]);
+	}
+
+	for (i = 0; i < sq.size(); ++i) {
+		if (!sq[i].error.empty()) {
+			e_error(backend->event, "Query failed; %s",
+				sq[i].error.c_str());
+			return FALSE;
+		}
+		hits.insert(hits.end(), sq[i].hits.begin(), sq[i].hits.end());
+		maybe.insert(maybe.end(), sq[i].maybe_hits.begin(),
+			     sq[i].maybe_hits.end());
+		nots.insert(nots.end(), sq[i].nots.begin(), sq[i].nots.end());
+		if (sq[i].timed_out)
+			timed_out = TRUE;
+	}
+
+	if (timed_out) {
+		try {
+			fts_flatcurve_xapian_shard_query_unevaluated(backend,
+				sq, unevaluated);
+		} catch (Xapian::Error &e) {
+			e_error(backend->event, "Query failed; %s",
+				e.get_description().c_str());
+			return FALSE;
+		}
+	}
+
+	if (threads > 1)
+		e_debug(backend->event, "Query searched shards=%u threads=%u",
+			(unsigned int)sq.size(),
+			I_MIN(threads, (unsigned int)sq.size()));
+
+	return TRUE;
 }
 
 bool fts_flatcurve_xapian_run_query(struct flatcurve_fts_query *query,
 				    struct flatcurve_fts_result *r)
 {
-	struct fts_flatcurve_xapian_query_iter *iter;
-	struct fts_flatcurve_xapian_query_result *result;
+	std::vector<struct flatcurve_fts_query_xapian_hit> hits, maybe, nots, tmp;
+	std::vector<struct flatcurve_fts_query_xapian_hit>::const_iterator i, j;
+	std::vector<uint32_t>::const_iterator u, v;
+	std::vector<uint32_t> unevaluated;
+	const std::vector<uint32_t> *uids;
+	struct flatcurve_fts_query_xapian_hit hit;
+	Xapian::Database *db;
 	struct fts_score_map *score;
+	uint32_t prev = 0;
+	bool maybe_all, timed_out = FALSE;
+	std::chrono::steady_clock::time_point deadline;
+	enum flatcurve_xapian_db_opts opts =
+		ENUM_EMPTY(flatcurve_xapian_db_opts);
+	struct flatcurve_fts_backend *backend = query->backend;
+	struct flatcurve_fts_query_xapian *x = query->xapian;
+	struct fts_flatcurve_xapian_query_profile *profile = &x->profile;
+	unsigned int timeout = backend->fuser->set.query_timeout;
+	struct timeval start, now;
+
+	/* Reset everything but the build time (the query is only built
+	 * once, for all of the mailboxes searched). */
+	profile->open_usecs = profile->plan_usecs = profile->mset_usecs =
+		profile->results_usecs = 0;
+	profile->shards = profile->wildcards = profile->wildcard_terms = 0;
+
+	/* Nothing to search for. */
+	if (array_is_empty(&x->args))
+		return TRUE;
+
+	/* The timeout covers planning (wildcard expansion) as well as
+	 * matching. */
+	if (timeout > 0)
+		deadline = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(timeout);
+
+	i_gettimeofday(&start);
+	db = fts_flatcurve_xapian_read_db(backend, opts);
+	i_gettimeofday(&now);
+	profile->open_usecs = timeval_diff_usecs(&now, &start);
+	if (db == NULL)
+		return TRUE;
+	profile->shards = backend->xapian->shards;
+
+	/* The plan depends on the contents of the DB, so it must be created
+	 * every time a new DB is searched. */
+	start = now;
+	fts_flatcurve_xapian_plan_query(query, db,
+					(timeout > 0) ? &deadline : NULL);
+	i_gettimeofday(&now);
+	profile->plan_usecs = timeval_diff_usecs(&now, &start);
+	timed_out = x->timed_out;
+	if (!timed_out && !x->truncated &&
+	    (x->query == NULL) && (x->maybe_query == NULL) &&
+	    (x->not_query == NULL))
+		return TRUE;
 
-	if ((iter = fts_flatcurve_xapian_query_iter_init(query)) == NULL)
+	/* Searching with a truncated wildcard expansion can't tell which
+	 * messages don't match, so it isn't run at all. */
+	start = now;
+	if (!timed_out && !x->truncated &&
+	    !fts_flatcurve_xapian_run_query_shards(query, db, hits, maybe,
+						   nots,
+						   (timeout > 0) ? &deadline : NULL,
+						   timed_out, unevaluated))
 		return FALSE;
-	while ((result = fts_flatcurve_xapian_query_iter_next(iter)) != NULL) {
-		bool add_score = TRUE;
-		if (result->maybe || query->xapian->maybe) {
-			add_score = (!seq_range_exists(&r->uids, result->uid) &&
-				!seq_range_exists(&r->maybe_uids, result->uid));
-			seq_range_array_add(&r->maybe_uids, result->uid);
-		} else
-			seq_range_array_add(&r->uids, result->uid);
-		if (add_score) {
-			score = array_append_space(&r->scores);
-			score->score = (float)result->score;
-			score->uid = result->uid;
-		}
-	}
-	fts_flatcurve_xapian_query_iter_deinit(&iter);
+	i_gettimeofday(&now);
+	profile->mset_usecs = timeval_diff_usecs(&now, &start);
+	start = now;
+
+	if (timed_out || x->truncated) {
+		/* If the budget was exceeded while planning, the query was
+		 * not run at all and no message can be ruled out. */
+		if (x->timed_out || x->truncated) {
+			try {
+				uids = fts_flatcurve_xapian_all_uids(backend);
+			} catch (Xapian::Error &e) {
+				e_error(backend->event, "Query failed; %s",
+					e.get_description().c_str());
+				return FALSE;
+			}
+			unevaluated.assign(uids->begin(), uids->end());
+		}
+
+		e_debug(event_create_passthrough(backend->event)->
+			set_name("fts_flatcurve_query_budget")->
+			add_str("mailbox", str_c(backend->boxname))->
+			add_str("query", str_c(query->qtext))->
+			add_str("reason", timed_out ? "timeout" : "expansion")->
+			add_int("unevaluated", unevaluated.size())->
+			event(), "Query budget exceeded (%s); returning "
+			"%u unevaluated messages as maybe matches",
+			timed_out ? "timeout" : "expansion",
+			(unsigned int)unevaluated.size());
+
+		/* The matches found are kept. Messages that were not
+		 * evaluated may match too, so they are maybe matches
+		 * (definite matches take precedence, see below). */
+		hit.score = 0;
+		for (u = unevaluated.begin(); u != unevaluated.end(); ++u) {
+			hit.uid = *u;
+			maybe.push_back(hit);
+		}
+	}
+
+	maybe_all = x->maybe;
+	if ((x->not_query != NULL) && !x->timed_out && !x->truncated) {
+		/* Negations that could not be applied against a positive
+		 * search are evaluated as the complement of the documents
+		 * they match. */
+		try {
+			uids = fts_flatcurve_xapian_all_uids(backend);
+		} catch (Xapian::Error &e) {
+			e_error(backend->event, "Query failed; %s",
+				e.get_description().c_str());
+			return FALSE;
+		}
+
+		/* The negations of unevaluated messages are incomplete;
+		 * these messages are already maybe matches. */
+		fts_flatcurve_xapian_sort_hits(nots);
+		hit.score = 0;
+		j = nots.begin();
+		v = unevaluated.begin();
+		for (u = uids->begin(); u != uids->end(); ++u) {
+			while ((v != unevaluated.end()) && (*v < *u))
+				++v;
+			if ((v != unevaluated.end()) && (*v == *u))
+				continue;
+			while ((j != nots.end()) && (j->uid < *u))
+				++j;
+			if ((j == nots.end()) || (j->uid != *u)) {
+				hit.uid = *u;
+				if (maybe_all)
+					maybe.push_back(hit);
+				else
+					hits.push_back(hit);
+			}
+		}
+	}
+
+	/* Hits can contain duplicates (e.g. an OR search matching a UID
+	 * from both a positive and a negated search). Since the sort is
+	 * stable, the first score seen for a UID is kept. */
+	fts_flatcurve_xapian_sort_hits(hits);
+	hits.erase(std::unique(hits.begin(), hits.end(),
+			       fts_flatcurve_xapian_hit_uid_eq), hits.end());
+	fts_flatcurve_xapian_sort_hits(maybe);
+
+	/* Maybe results may also contain duplicates (an AND search with a
+	 * maybe match will see the same UID from both the main and maybe
+	 * queries), and definite matches take precedence. */
+	j = hits.begin();
+	for (i = maybe.begin(); i != maybe.end(); ++i) {
+		if (i->uid == prev)
+			continue;
+		prev = i->uid;
+		while ((j != hits.end()) && (j->uid < i->uid))
+			++j;
+		if ((j == hits.end()) || (j->uid != i->uid))
+			tmp.push_back(*i);
+	}
+	maybe.swap(tmp);
+
+	fts_flatcurve_xapian_hits_to_ranges(hits, &r->uids);
+	fts_flatcurve_xapian_hits_to_ranges(maybe, &r->maybe_uids);
+
+	/* Both lists are now sorted and disjoint, so scores can be merged
+	 * in UID order. */
+	i = hits.begin();
+	j = maybe.begin();
+	while ((i != hits.end()) || (j != maybe.end())) {
+		score = array_append_space(&r->scores);
+		if ((j == maybe.end()) ||
+		    ((i != hits.end()) && (i->uid < j->uid))) {
+			score->uid = i->uid;
+			score->score = i->score;
+			++i;
+		} else {
+			score->uid = j->uid;
+			score->score = j->score;
+			++j;
+		}
+	}
+
+	i_gettimeofday(&now);
+	profile->results_usecs = timeval_diff_usecs(&now, &start);
+
 	return TRUE;
 }
 
+void
+fts_flatcurve_xapian_query_profile(struct flatcurve_fts_query *query,
+				   struct fts_flatcurve_xapian_query_profile *profile_r)
+{
+	*profile_r = query->xapian->profile;
+}
+
 void fts_flatcurve_xapian_destroy_query(struct flatcurve_fts_query *query)
 {
-	struct flatcurve_fts_query_xapian_maybe *mquery;
+	struct flatcurve_fts_query_xapian_arg *arg;
 
 	delete(query->xapian->query);
-	if (array_is_created(&query->xapian->maybe_queries)) {
-		array_foreach_modifiable(&query->xapian->maybe_queries, mquery) {
-			delete(mquery->query);
-		}
-		array_free(&query->xapian->maybe_queries);
+	delete(query->xapian->maybe_query);
+	delete(query->xapian->not_query);
+	array_foreach_modifiable(&query->xapian->args, arg) {
+		delete(arg->query);
+		delete(arg->hdr_query);
 	}
+	array_free(&query->xapian->args);
 }
 
 const char *fts_flatcurve_xapian_library_version()
@@ -4,15 +4,9 @@
 #ifndef FTS_BACKEND_FLATCURVE_XAPIAN_H
 #define FTS_BACKEND_FLATCURVE_XAPIAN_H
 
-struct fts_flatcurve_xapian_query_result {
-	double score;
-	uint32_t uid;
-
-	bool maybe:1;
-};
-
 struct fts_flatcurve_xapian_db_check {
 	int errors;
+	unsigned int checked;
 	unsigned int shards;
 };
 
@@ -22,9 +16,59 @@ struct fts_flatcurve_xapian_db_stats {
 	unsigned int version;
 };
 
-HASH_TABLE_DEFINE_TYPE(term_counter, char *, void *);
+struct fts_flatcurve_xapian_shard_stats {
+	const char *shard;
+	const char *type;
+	uoff_t bytes;
+	/* Estimated from the UIDs missing in the shard's UID range. */
+	uoff_t reclaimable;
+	unsigned int messages;
+	unsigned int terms;
+	uint32_t first_uid;
+	uint32_t last_uid;
+	double avg_length;
+	time_t last_commit;
+};
+ARRAY_DEFINE_TYPE(fts_flatcurve_xapian_shard_stats,
+		  struct fts_flatcurve_xapian_shard_stats);
+
+/* Execution profile of the last run of a query, i.e. of its search of a
+ * mailbox (times are in usecs). */
+struct fts_flatcurve_xapian_query_profile {
+	/* Building the query from the search arguments. */
+	unsigned int build_usecs;
+	/* Opening (or reopening) the mailbox DB. */
+	unsigned int open_usecs;
+	/* Planning the query, including the wildcard expansions. */
+	unsigned int plan_usecs;
+	/* Matching (Xapian MSets). */
+	unsigned int mset_usecs;
+	/* Assembling the result UIDs and scores. */
+	unsigned int results_usecs;
+	unsigned int shards;
+	/* Wildcard (prefix/substring) terms expanded, and the number of index
+	 * terms they were expanded to. */
+	unsigned int wildcards;
+	unsigned int wildcard_terms;
+};
 
-struct fts_flatcurve_xapian_query_iter;
+/* Approximate memory held by the backend, in bytes. */
+struct fts_flatcurve_xapian_memory {
+	/* The document being indexed. */
+	size_t document;
+	/* The documents indexed since the last commit. */
+	size_t uncommitted;
+	/* The read database: its open shards, and the cached UIDs. */
+	size_t db;
+	/* The backend and Xapian memory pools. */
+	size_t pools;
+	/* The peak of the total since the backend was initialized. */
+	size_t peak;
+};
+
+struct fts_flatcurve_xapian_optimize;
+struct fts_flatcurve_xapian_prefetch;
+struct fts_flatcurve_xapian_terms;
 
 void fts_flatcurve_xapian_init(struct flatcurve_fts_backend *backend);
 void fts_flatcurve_xapian_refresh(struct flatcurve_fts_backend *backend);
@@ -33,11 +77,27 @@ void fts_flatcurve_xapian_deinit(struct flatcurve_fts_backend *backend);
 
 void fts_flatcurve_xapian_get_last_uid(struct flatcurve_fts_backend *backend,
 				       uint32_t *last_uid_r);
-/* Return -1 if DB doesn't exist, 0 if UID doesn't exist, 1 if UID exists */
-int fts_flatcurve_xapian_uid_exists(struct flatcurve_fts_backend *backend,
-				    uint32_t uid);
+
+/* Reads the indexed UIDs of several mailboxes in parallel: add() each
+ * mailbox (after setting it in the backend), run(), and then uids() returns
+ * the sorted UIDs of the idx'th mailbox added. uids() returns -1 on error,
+ * 0 if the DB doesn't exist, 1 on success. */
+struct fts_flatcurve_xapian_prefetch *
+fts_flatcurve_xapian_prefetch_init(struct flatcurve_fts_backend *backend);
+void fts_flatcurve_xapian_prefetch_add(struct fts_flatcurve_xapian_prefetch *pf);
+void fts_flatcurve_xapian_prefetch_run(struct fts_flatcurve_xapian_prefetch *pf,
+				       unsigned int threads);
+int fts_flatcurve_xapian_prefetch_uids(struct fts_flatcurve_xapian_prefetch *pf,
+				       unsigned int idx,
+				       ARRAY_TYPE(uint32_t) *uids);
+void
+fts_flatcurve_xapian_prefetch_deinit(struct fts_flatcurve_xapian_prefetch **_pf);
+
 void fts_flatcurve_xapian_expunge(struct flatcurve_fts_backend *backend,
 				  uint32_t uid);
+/* Expunges all indexed messages with UIDs >= first_uid. */
+void fts_flatcurve_xapian_expunge_from(struct flatcurve_fts_backend *backend,
+				       uint32_t first_uid);
 bool
 fts_flatcurve_xapian_init_msg(struct flatcurve_fts_backend_update_context *ctx);
 void
@@ -47,34 +107,74 @@ void
 fts_flatcurve_xapian_index_body(struct flatcurve_fts_backend_update_context *ctx,
 				const unsigned char *data, size_t size);
 void fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend);
+/* Optimizes several mailboxes in parallel: add() each mailbox (after
+ * setting it in the backend), and run() them. run() returns the number of
+ * mailboxes that failed; failed() lists their names. */
+struct fts_flatcurve_xapian_optimize *
+fts_flatcurve_xapian_optimize_init(struct flatcurve_fts_backend *backend);
+void fts_flatcurve_xapian_optimize_add(struct fts_flatcurve_xapian_optimize *opt);
+unsigned int
+fts_flatcurve_xapian_optimize_run(struct fts_flatcurve_xapian_optimize *opt,
+				  unsigned int threads);
+const ARRAY_TYPE(const_string) *
+fts_flatcurve_xapian_optimize_failed(struct fts_flatcurve_xapian_optimize *opt);
+void
+fts_flatcurve_xapian_optimize_deinit(struct fts_flatcurve_xapian_optimize **_opt);
 void fts_flatcurve_xapian_build_query(struct flatcurve_fts_query *query);
 bool fts_flatcurve_xapian_run_query(struct flatcurve_fts_query *query,
 				    struct flatcurve_fts_result *r);
 void fts_flatcurve_xapian_destroy_query(struct flatcurve_fts_query *query);
-void fts_flatcurve_xapian_delete_index(struct flatcurve_fts_backend *backend);
-
-struct fts_flatcurve_xapian_query_iter *
-fts_flatcurve_xapian_query_iter_init(struct flatcurve_fts_query *query);
-struct fts_flatcurve_xapian_query_result *
-fts_flatcurve_xapian_query_iter_next(struct fts_flatcurve_xapian_query_iter *iter);
 void
-fts_flatcurve_xapian_query_iter_deinit(struct fts_flatcurve_xapian_query_iter **_iter);
+fts_flatcurve_xapian_query_profile(struct flatcurve_fts_query *query,
+				   struct fts_flatcurve_xapian_query_profile *profile_r);
+void fts_flatcurve_xapian_delete_index(struct flatcurve_fts_backend *backend);
 
+/* Check (and fix) the shards of the mailbox, using up to
+ * fts_flatcurve_maintenance_workers threads. In quick mode, a full check is
+ * only done for shards that changed since their last successful check. */
 void
 fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
-				   struct fts_flatcurve_xapian_db_check *check);
+				   struct fts_flatcurve_xapian_db_check *check,
+				   bool quick);
 bool
 fts_flatcurve_xapian_mailbox_rotate(struct flatcurve_fts_backend *backend);
 void
 fts_flatcurve_xapian_mailbox_stats(struct flatcurve_fts_backend *backend,
                                    struct fts_flatcurve_xapian_db_stats *stats);
+/* Appends the statistics of every shard (ordered by shard name); strings are
+ * allocated from pool. */
+void
+fts_flatcurve_xapian_mailbox_shard_stats(struct flatcurve_fts_backend *backend,
+					 pool_t pool,
+					 ARRAY_TYPE(fts_flatcurve_xapian_shard_stats) *stats);
 
-void fts_flatcurve_xapian_mailbox_terms(struct flatcurve_fts_backend *backend,
-					HASH_TABLE_TYPE(term_counter) terms);
-void fts_flatcurve_xapian_mailbox_headers(struct flatcurve_fts_backend *backend,
-					  HASH_TABLE_TYPE(term_counter) hdrs);
+/* Streams the terms (or the indexed header names, if headers is TRUE) that
+ * start with prefix of all mailboxes added, in term order, with the number of
+ * messages each appears in summed over all mailboxes. The term returned by
+ * next() is only valid until the next call. Only a bounded number of shards
+ * is kept open; the terms of earlier shards are spooled to temporary files. */
+struct fts_flatcurve_xapian_terms *
+fts_flatcurve_xapian_terms_init(struct flatcurve_fts_backend *backend,
+				const char *prefix, bool headers);
+void fts_flatcurve_xapian_terms_add(struct fts_flatcurve_xapian_terms *terms);
+bool fts_flatcurve_xapian_terms_next(struct fts_flatcurve_xapian_terms *terms,
+				     const char **term_r,
+				     unsigned int *count_r);
+void
+fts_flatcurve_xapian_terms_deinit(struct fts_flatcurve_xapian_terms **_terms);
 
 void fts_flatcurve_xapian_set_mailbox(struct flatcurve_fts_backend *backend);
+/* Asks the kernel to read ahead (up to limit bytes of) the Xapian tables
+ * used when searching the mailbox. Returns the number of bytes. */
+uoff_t fts_flatcurve_xapian_warmup(struct flatcurve_fts_backend *backend,
+				   uoff_t limit);
+
+void fts_flatcurve_xapian_memory(struct flatcurve_fts_backend *backend,
+				 struct fts_flatcurve_xapian_memory *mem_r);
+/* Adds the memory_* fields (see fts_flatcurve_xapian_memory()) to e. */
+struct event_passthrough *
+fts_flatcurve_xapian_memory_event(struct flatcurve_fts_backend *backend,
+				  struct event_passthrough *e);
 
 const char *fts_flatcurve_xapian_library_version();
 #endif
@@ -3,17 +3,33 @@
 
 #include "lib.h"
 #include "array.h"
+#include "imap-util.h"
+#include "istream.h"
 #include "mail-storage-private.h"
-#include "mail-search-build.h"
 #include "mailbox-list-iter.h"
 #include "str.h"
+#include "strnum.h"
 #include "time-util.h"
 #include "unlink-directory.h"
+#include "write-full.h"
+#include "fts-build-mail.h"
 #include "fts-backend-flatcurve.h"
 #include "fts-backend-flatcurve-xapian.h"
 
 #define FTS_FLATCURVE_MAX_TERM_SIZE 200
 
+/* UIDs that rescan found missing from the index, and that still need to be
+ * indexed; stored in the mailbox fts directory. */
+#define FTS_FLATCURVE_PENDING_FNAME "pending-uids"
+#define FTS_FLATCURVE_PENDING_FAILURES_PREFIX "failures="
+/* After this many failed attempts to index the pending UIDs, give up and
+ * let Dovecot reindex the mailbox from the first pending UID instead. */
+#define FTS_FLATCURVE_PENDING_MAX_FAILURES 3
+
+/* List of learned headers; stored in the namespace index root. */
+#define FTS_FLATCURVE_LEARN_HEADERS_FNAME FTS_FLATCURVE_LABEL "-headers"
+#define FTS_FLATCURVE_LEARN_HEADERS_MAX_LEN 64
+
 enum fts_backend_flatcurve_action {
 	FTS_BACKEND_FLATCURVE_ACTION_OPTIMIZE,
 	FTS_BACKEND_FLATCURVE_ACTION_RESCAN
@@ -38,6 +54,165 @@ static struct fts_backend *fts_backend_flatcurve_alloc(void)
 	return &backend->backend;
 }
 
+static bool
+fts_backend_flatcurve_header_learned(struct flatcurve_fts_backend *backend,
+				     const char *hdr)
+{
+	const char *const *h;
+
+	if (!array_is_created(&backend->learn_hdrs))
+		return FALSE;
+
+	array_foreach(&backend->learn_hdrs, h) {
+		if (strcasecmp(*h, hdr) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+fts_backend_flatcurve_learn_load(struct flatcurve_fts_backend *backend)
+{
+	struct istream *input;
+	const char *line;
+	struct stat st;
+
+	if (backend->learn_path == NULL)
+		return;
+
+	if (stat(backend->learn_path, &st) < 0) {
+		if (errno != ENOENT)
+			e_error(backend->event, "stat(%s) failed: %m",
+				backend->learn_path);
+		return;
+	}
+
+	/* Another process may have learned headers since we last looked.
+	 * The file is only ever appended to, so a same-second append (which
+	 * mtime doesn't show) still changes the size. */
+	if (array_is_created(&backend->learn_hdrs) &&
+	    (st.st_mtime == backend->learn_mtime) &&
+	    (st.st_size == backend->learn_size))
+		return;
+
+	p_clear(backend->learn_pool);
+	p_array_init(&backend->learn_hdrs, backend->learn_pool, 8);
+
+	input = i_stream_create_file(backend->learn_path, 1024);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if ((*line != '\0') &&
+		    (array_count(&backend->learn_hdrs) <
+		     backend->fuser->set.learn_headers) &&
+		    !fts_backend_flatcurve_header_learned(backend, line)) {
+			line = p_strdup(backend->learn_pool, t_str_lcase(line));
+			array_push_back(&backend->learn_hdrs, &line);
+		}
+	}
+	if (input->stream_errno != 0)
+		e_error(backend->event, "read(%s) failed: %s",
+			backend->learn_path, i_stream_get_error(input));
+	i_stream_unref(&input);
+
+	backend->learn_mtime = st.st_mtime;
+	backend->learn_size = st.st_size;
+}
+
+/* Returns FALSE if no more headers can be learned. */
+static bool
+fts_backend_flatcurve_learn_args(struct flatcurve_fts_backend *backend,
+				 struct mail_search_arg *args)
+{
+	int fd;
+	ssize_t ret;
+	const char *hdr, *line;
+
+	for (; args != NULL; args = args->next) {
+		switch (args->type) {
+		case SEARCH_OR:
+		case SEARCH_SUB:
+			/* e.g. OR HEADER X-Foo ... */
+			if (!fts_backend_flatcurve_learn_args(backend,
+						args->value.subargs))
+				return FALSE;
+			continue;
+		case SEARCH_HEADER:
+		case SEARCH_HEADER_ADDRESS:
+		case SEARCH_HEADER_COMPRESS_LWSP:
+			break;
+		default:
+			continue;
+		}
+
+		/* Existence searches are always definite matches. */
+		if (args->no_fts || (*args->value.str == '\0') ||
+		    fts_header_want_indexed(args->hdr_field_name) ||
+		    fts_backend_flatcurve_header_learned(backend,
+							 args->hdr_field_name))
+			continue;
+
+		if (array_count(&backend->learn_hdrs) >=
+		    backend->fuser->set.learn_headers)
+			return FALSE;
+
+		if ((strlen(args->hdr_field_name) >
+		     FTS_FLATCURVE_LEARN_HEADERS_MAX_LEN) ||
+		    (strpbrk(args->hdr_field_name, " \t\r\n:") != NULL))
+			continue;
+
+		hdr = p_strdup(backend->learn_pool,
+			       t_str_lcase(args->hdr_field_name));
+		array_push_back(&backend->learn_hdrs, &hdr);
+
+		/* Other processes may append at the same time. With O_APPEND,
+		 * a line written with a single write() is never interleaved
+		 * with theirs, so no lock is needed. A duplicate line is
+		 * ignored when the file is loaded. */
+		fd = open(backend->learn_path, O_WRONLY | O_APPEND | O_CREAT,
+			  0600);
+		if (fd == -1) {
+			e_error(backend->event, "open(%s) failed: %m",
+				backend->learn_path);
+			return FALSE;
+		}
+		line = t_strconcat(hdr, "\n", NULL);
+		ret = write(fd, line, strlen(line));
+		if (ret < 0)
+			e_error(backend->event, "write(%s) failed: %m",
+				backend->learn_path);
+		else if ((size_t)ret != strlen(line))
+			e_error(backend->event, "write(%s) failed: "
+				"Short write (%"PRIuSIZE_T" of %"PRIuSIZE_T
+				" bytes)", backend->learn_path, (size_t)ret,
+				strlen(line));
+		i_close_fd(&fd);
+
+		e_debug(event_create_passthrough(backend->event)->
+			set_name("fts_flatcurve_learn_header")->
+			add_str("header", hdr)->event(),
+			"Learned header=%s", hdr);
+	}
+
+	return TRUE;
+}
+
+/* Searches on headers that are not in fts_header_indexes can only return
+ * maybe matches, which need to be verified by reading the message. Record
+ * these headers so that they will be indexed separately in the future. */
+static void
+fts_backend_flatcurve_learn_headers(struct flatcurve_fts_backend *backend,
+				    struct mail_search_arg *args)
+{
+	if (backend->learn_path == NULL)
+		return;
+
+	fts_backend_flatcurve_learn_load(backend);
+	if (!array_is_created(&backend->learn_hdrs))
+		p_array_init(&backend->learn_hdrs, backend->learn_pool, 8);
+
+	(void)fts_backend_flatcurve_learn_args(backend, args);
+}
+
 static int
 fts_backend_flatcurve_init(struct fts_backend *_backend, const char **error_r)
 {
@@ -64,6 +239,16 @@ fts_backend_flatcurve_init(struct fts_backend *_backend, const char **error_r)
 	backend->event = event_create(_backend->ns->user->event);
 	event_add_category(backend->event, &event_category_fts_flatcurve);
 
+	if (fuser->set.learn_headers > 0) {
+		backend->learn_pool = pool_alloconly_create(
+			FTS_FLATCURVE_LABEL " learn pool", 512);
+		backend->learn_path = p_strdup_printf(backend->pool,
+			"%s/" FTS_FLATCURVE_LEARN_HEADERS_FNAME,
+			mailbox_list_get_root_forced(_backend->ns->list,
+				MAILBOX_LIST_PATH_TYPE_INDEX));
+		fts_backend_flatcurve_learn_load(backend);
+	}
+
 	fts_backend_flatcurve_close_mailbox(backend);
 
 	return 0;
@@ -97,11 +282,20 @@ static void fts_backend_flatcurve_deinit(struct fts_backend *_backend)
 {
 	struct flatcurve_fts_backend *backend =
 		(struct flatcurve_fts_backend *)_backend;
+	struct fts_flatcurve_xapian_memory mem;
+
+	fts_flatcurve_xapian_memory(backend, &mem);
+	e_debug(fts_flatcurve_xapian_memory_event(backend,
+		event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_deinit"))->event(),
+		"Deinit (memory peak=%"PRIuSIZE_T")", mem.peak);
 
 	fts_backend_flatcurve_close_mailbox(backend);
 	fts_flatcurve_xapian_deinit(backend);
 
 	event_unref(&backend->event);
+	if (backend->learn_pool != NULL)
+		pool_unref(&backend->learn_pool);
 	pool_unref(&backend->pool);
 
 	i_free(backend);
@@ -147,6 +341,146 @@ void fts_backend_flatcurve_set_mailbox(struct flatcurve_fts_backend *backend,
 	fts_flatcurve_xapian_set_mailbox(backend);
 }
 
+/* Warms up the current mailbox before it is first searched in this session.
+ * Not done when indexing (which doesn't read the tables being warmed up),
+ * and only once per mailbox, as the page cache outlives mailbox switches. */
+static void
+fts_backend_flatcurve_warmup(struct flatcurve_fts_backend *backend)
+{
+	const char *name;
+
+	if ((backend->fuser->set.warmup_bytes == 0) ||
+	    (str_len(backend->boxname) == 0))
+		return;
+
+	if (!array_is_created(&backend->warmup_boxes))
+		p_array_init(&backend->warmup_boxes, backend->pool, 8);
+	array_foreach_elem(&backend->warmup_boxes, name) {
+		if (strcmp(name, str_c(backend->boxname)) == 0)
+			return;
+	}
+	name = p_strdup(backend->pool, str_c(backend->boxname));
+	array_push_back(&backend->warmup_boxes, &name);
+
+	(void)fts_flatcurve_xapian_warmup(backend,
+					  backend->fuser->set.warmup_bytes);
+}
+
+static string_t
+*fts_backend_flatcurve_seq_range_string(ARRAY_TYPE(seq_range) *uids,
+					pool_t pool)
+{
+	unsigned int count, i;
+	const struct seq_range *range;
+	string_t *ret;
+
+	ret = str_new(pool, 256);
+
+	range = array_get(uids, &count);
+	for (i = 0; i < count; i++) {
+		if (i != 0)
+			str_append(ret, ",");
+		str_printfa(ret, "%u", range[i].seq1);
+		if (range[i].seq1 != range[i].seq2)
+			str_printfa(ret, ":%u", range[i].seq2);
+	}
+
+	return ret;
+}
+
+static const char *
+fts_backend_flatcurve_pending_path(struct flatcurve_fts_backend *backend)
+{
+	return t_strconcat(str_c(backend->db_path),
+			   FTS_FLATCURVE_PENDING_FNAME, NULL);
+}
+
+/* Returns -1 on error, 0 if there are no pending UIDs, 1 on success. */
+static int
+fts_backend_flatcurve_pending_read(struct flatcurve_fts_backend *backend,
+				   ARRAY_TYPE(seq_range) *uids,
+				   unsigned int *failures_r)
+{
+	struct istream *input;
+	const char *line, *path, *failures;
+	int ret = 0;
+
+	*failures_r = 0;
+	path = fts_backend_flatcurve_pending_path(backend);
+
+	input = i_stream_create_file(path, 1024);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (str_begins(line, FTS_FLATCURVE_PENDING_FAILURES_PREFIX)) {
+			failures = line +
+				strlen(FTS_FLATCURVE_PENDING_FAILURES_PREFIX);
+			if (str_to_uint(failures, failures_r) < 0)
+				*failures_r = 0;
+		} else if ((*line != '\0') &&
+			   (imap_seq_set_nostar_parse(line, uids) < 0)) {
+			e_error(backend->event, "Invalid pending UIDs in %s",
+				path);
+			ret = -1;
+			break;
+		}
+	}
+	if ((input->stream_errno != 0) && (input->stream_errno != ENOENT)) {
+		e_error(backend->event, "read(%s) failed: %s", path,
+			i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_unref(&input);
+
+	if (ret < 0)
+		return -1;
+	return array_is_empty(uids) ? 0 : 1;
+}
+
+static void
+fts_backend_flatcurve_pending_write(struct flatcurve_fts_backend *backend,
+				    ARRAY_TYPE(seq_range) *uids,
+				    unsigned int failures, pool_t pool)
+{
+	const char *path, *temp;
+	string_t *str;
+	int fd;
+
+	path = fts_backend_flatcurve_pending_path(backend);
+
+	if (array_is_empty(uids)) {
+		if ((unlink(path) < 0) && (errno != ENOENT))
+			e_error(backend->event, "unlink(%s) failed: %m", path);
+		return;
+	}
+
+	str = fts_backend_flatcurve_seq_range_string(uids, pool);
+	str_append_c(str, '\n');
+	if (failures > 0)
+		str_printfa(str, FTS_FLATCURVE_PENDING_FAILURES_PREFIX "%u\n",
+			    failures);
+
+	/* Write to a temporary file first, so that readers never see a
+	 * partial list. */
+	temp = t_strconcat(path, ".tmp", NULL);
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		e_error(backend->event, "open(%s) failed: %m", temp);
+		return;
+	}
+	if (write_full(fd, str_data(str), str_len(str)) < 0) {
+		e_error(backend->event, "write(%s) failed: %m", temp);
+		i_close_fd(&fd);
+		i_unlink(temp);
+		return;
+	}
+	i_close_fd(&fd);
+
+	if (rename(temp, path) < 0) {
+		e_error(backend->event, "rename(%s, %s) failed: %m",
+			temp, path);
+		i_unlink(temp);
+	}
+}
+
 static int
 fts_backend_flatcurve_get_last_uid(struct fts_backend *_backend,
 				   struct mailbox *box, uint32_t *last_uid_r)
@@ -181,14 +515,94 @@ static struct fts_backend_update_context
 	ctx->hdr_name = str_new(backend->pool, 128);
 	i_gettimeofday(&ctx->start);
 
+	fts_backend_flatcurve_learn_load(backend);
+
 	return &ctx->ctx;
 }
 
+static void
+fts_backend_flatcurve_update_close_mail(struct flatcurve_fts_backend_update_context *ctx)
+{
+	if (ctx->mail != NULL) {
+		mail_free(&ctx->mail);
+		(void)mailbox_transaction_commit(&ctx->trans);
+	}
+	ctx->box = NULL;
+}
+
+static void
+fts_backend_flatcurve_update_values_failed(struct flatcurve_fts_backend_update_context *ctx,
+					   const char *field)
+{
+	enum mail_error error;
+	const char *errstr;
+
+	errstr = mailbox_get_last_internal_error(ctx->box, &error);
+	if (error == MAIL_ERROR_LOOKUP_ABORTED) {
+		e_debug(event_create_passthrough(ctx->backend->event)->
+			set_name("fts_flatcurve_index_values")->
+			add_str("mailbox", str_c(ctx->backend->boxname))->
+			add_int("uid", ctx->uid)->
+			add_str("field", field)->event(),
+			"Value %s not stored for uid=%u: Not available "
+			"without reading the message", field, ctx->uid);
+	} else {
+		e_error(ctx->backend->event, "Value %s not stored for "
+			"uid=%u: %s", field, ctx->uid, errstr);
+	}
+}
+
+/* Look up the values stored alongside the indexed terms, so that date and
+ * size searches can be filtered by Xapian. The backend doesn't have access
+ * to the mail fts_build_mail() is processing, so only values that can be
+ * looked up without reading the message (again) are stored: the planner
+ * only filters on a value if every document in the DB has it. */
+static void
+fts_backend_flatcurve_update_values(struct flatcurve_fts_backend_update_context *ctx)
+{
+	time_t date;
+	int tz;
+
+	ctx->has_received_date = ctx->has_sent_date = ctx->has_size = FALSE;
+
+	if (ctx->box == NULL)
+		return;
+
+	if (ctx->mail == NULL) {
+		ctx->trans = mailbox_transaction_begin(ctx->box, 0, __func__);
+		ctx->mail = mail_alloc(ctx->trans, 0, NULL);
+		ctx->mail->lookup_abort = MAIL_LOOKUP_ABORT_READ_MAIL;
+	}
+
+	if (!mail_set_uid(ctx->mail, ctx->uid))
+		return;
+
+	if (mail_get_received_date(ctx->mail, &ctx->received_date) < 0)
+		fts_backend_flatcurve_update_values_failed(ctx, "received");
+	else
+		ctx->has_received_date = TRUE;
+
+	if (mail_get_date(ctx->mail, &date, &tz) < 0)
+		fts_backend_flatcurve_update_values_failed(ctx, "sent");
+	else {
+		/* IMAP compares sent dates in the timezone of the
+		 * message. */
+		ctx->sent_date = date + tz * 60;
+		ctx->has_sent_date = TRUE;
+	}
+
+	if (mail_get_virtual_size(ctx->mail, &ctx->size) < 0)
+		fts_backend_flatcurve_update_values_failed(ctx, "size");
+	else
+		ctx->has_size = TRUE;
+}
+
 static int
 fts_backend_flatcurve_update_deinit(struct fts_backend_update_context *_ctx)
 {
 	struct flatcurve_fts_backend_update_context *ctx =
 		(struct flatcurve_fts_backend_update_context *)_ctx;
+	struct fts_flatcurve_xapian_memory mem;
 	int diff, ret = _ctx->failed ? -1 : 0;
 	struct timeval now;
 
@@ -196,16 +610,121 @@ fts_backend_flatcurve_update_deinit(struct fts_backend_update_context *_ctx)
 		i_gettimeofday(&now);
 		diff = timeval_diff_msecs(&now, &ctx->start);
 
-		e_debug(ctx->backend->event, "Update transaction completed in "
-			"%u.%03u secs", diff/1000, diff%1000);
+		fts_flatcurve_xapian_memory(ctx->backend, &mem);
+		e_debug(fts_flatcurve_xapian_memory_event(ctx->backend,
+			event_create_passthrough(ctx->backend->event)->
+			set_name("fts_flatcurve_update")->
+			add_str("mailbox", str_c(ctx->backend->boxname))->
+			add_int("duration", diff))->event(),
+			"Update transaction completed in %u.%03u secs "
+			"(memory peak=%"PRIuSIZE_T")", diff/1000, diff%1000,
+			mem.peak);
 	}
 
+	fts_backend_flatcurve_update_close_mail(ctx);
 	str_free(&ctx->hdr_name);
 	p_free(ctx->backend->pool, ctx);
 
 	return ret;
 }
 
+/* Indexing the pending UIDs keeps failing: expunge every indexed message
+ * from the first pending UID onwards instead, so that Dovecot reindexes
+ * them (and the pending ones) as part of its normal indexing. */
+static void
+fts_backend_flatcurve_pending_give_up(struct flatcurve_fts_backend *backend,
+				      const ARRAY_TYPE(seq_range) *uids)
+{
+	fts_flatcurve_xapian_expunge_from(backend, array_front(uids)->seq1);
+}
+
+/* Index the UIDs that rescan found missing from the index. Returns the
+ * number of messages indexed, or -1 on error. */
+static int
+fts_backend_flatcurve_update_pending(struct flatcurve_fts_backend_update_context *ctx)
+{
+	struct flatcurve_fts_backend *backend = ctx->backend;
+	struct event_passthrough *e;
+	int count = 0, ret;
+	struct mail *mail;
+	const struct seq_range *range;
+	struct mailbox_transaction_context *trans;
+	uint32_t uid;
+	unsigned int failures;
+	ARRAY_TYPE(seq_range) uids;
+
+	t_array_init(&uids, 32);
+	if ((ret = fts_backend_flatcurve_pending_read(backend, &uids,
+						      &failures)) <= 0)
+		return ret;
+
+	e = event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_index_pending")->
+		add_str("mailbox", str_c(backend->boxname))->
+		add_str("uids", str_c(fts_backend_flatcurve_seq_range_string(
+			&uids, pool_datastack_create())));
+
+	trans = mailbox_transaction_begin(ctx->box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+
+	/* fts_build_mail() calls back into the update context; the pending
+	 * flag makes the nested update_set_mailbox() call a no-op. */
+	ctx->pending = TRUE;
+	array_foreach(&uids, range) {
+		for (uid = range->seq1; ; uid++) {
+			/* Messages expunged since rescan are skipped. */
+			if (mail_set_uid(mail, uid)) {
+				ctx->skip_uid = FALSE;
+				if (fts_build_mail(&ctx->ctx, mail) < 0) {
+					ret = -1;
+					break;
+				}
+				count++;
+			}
+			if (uid == range->seq2)
+				break;
+		}
+		if (ret < 0)
+			break;
+	}
+	ctx->pending = FALSE;
+	ctx->skip_uid = FALSE;
+
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&trans);
+
+	if ((ret < 0) || ctx->ctx.failed) {
+		e->add_int("failures", ++failures);
+		if (failures < FTS_FLATCURVE_PENDING_MAX_FAILURES) {
+			/* Keep the pending list; it is retried by the next
+			 * rescan or reindex. */
+			e_debug(e->add_str("status", "failed")->event(),
+				"Indexing pending messages failed "
+				"failures=%u", failures);
+			fts_backend_flatcurve_pending_write(backend, &uids,
+							    failures, NULL);
+			return -1;
+		}
+
+		e_error(e->add_str("status", "gave_up")->event(),
+			"Indexing pending messages failed %u times; "
+			"reindexing the mailbox from UID %u instead",
+			failures, array_front(&uids)->seq1);
+		fts_backend_flatcurve_pending_give_up(backend, &uids);
+		array_clear(&uids);
+		fts_backend_flatcurve_pending_write(backend, &uids, 0, NULL);
+		return -1;
+	}
+
+	array_clear(&uids);
+	fts_backend_flatcurve_pending_write(backend, &uids, 0, NULL);
+
+	e_debug(e->add_int("count", count)->add_str("status", "ok")->event(),
+		"Indexed pending messages count=%d", count);
+
+	return count;
+}
+
 static void
 fts_backend_flatcurve_update_set_mailbox(struct fts_backend_update_context *_ctx,
 					 struct mailbox *box)
@@ -213,10 +732,17 @@ fts_backend_flatcurve_update_set_mailbox(struct fts_backend_update_context *_ctx
 	struct flatcurve_fts_backend_update_context *ctx =
 		(struct flatcurve_fts_backend_update_context *)_ctx;
 
+	if (ctx->pending)
+		return;
+
+	fts_backend_flatcurve_update_close_mail(ctx);
+
 	if (box == NULL)
 		fts_backend_flatcurve_close_mailbox(ctx->backend);
-	else
+	else {
 		fts_backend_flatcurve_set_mailbox(ctx->backend, box);
+		ctx->box = box;
+	}
 }
 
 static void
@@ -259,6 +785,7 @@ fts_backend_flatcurve_update_set_build_key(struct fts_backend_update_context *_c
 	 * is no valid search info in a message so the message will
 	 * not be saved to DB after processing. */
 	if (changed) {
+		fts_backend_flatcurve_update_values(ctx);
 		if (!fts_flatcurve_xapian_init_msg(ctx)) {
 			/* This UID has already been indexed, so skip all
 			 * future update calls. */
@@ -277,7 +804,9 @@ fts_backend_flatcurve_update_set_build_key(struct fts_backend_update_context *_c
 	case FTS_BACKEND_BUILD_KEY_HDR:
 		i_assert(key->hdr_name != NULL);
 		str_append(ctx->hdr_name, key->hdr_name);
-		ctx->indexed_hdr = fts_header_want_indexed(key->hdr_name);
+		ctx->indexed_hdr = fts_header_want_indexed(key->hdr_name) ||
+			fts_backend_flatcurve_header_learned(ctx->backend,
+							     key->hdr_name);
 		break;
 	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
 	case FTS_BACKEND_BUILD_KEY_BODY_PART:
@@ -341,28 +870,6 @@ fts_backend_flatcurve_update_build_more(struct fts_backend_update_context *_ctx,
 	return (_ctx->failed) ? -1 : 0;
 }
 
-static string_t
-*fts_backend_flatcurve_seq_range_string(ARRAY_TYPE(seq_range) *uids,
-					pool_t pool)
-{
-	unsigned int count, i;
-	const struct seq_range *range;
-	string_t *ret;
-
-	ret = str_new(pool, 256);
-
-	range = array_get(uids, &count);
-	for (i = 0; i < count; i++) {
-		if (i != 0)
-			str_append(ret, ",");
-		str_printfa(ret, "%u", range[i].seq1);
-		if (range[i].seq1 != range[i].seq2)
-			str_printfa(ret, ":%u", range[i].seq2);
-	}
-
-	return ret;
-}
-
 static struct flatcurve_fts_query *
 fts_backend_flatcurve_create_query(struct flatcurve_fts_backend *backend,
 				   pool_t pool)
@@ -377,98 +884,91 @@ fts_backend_flatcurve_create_query(struct flatcurve_fts_backend *backend,
 	return query;
 }
 
-static void
+static bool
 fts_backend_flatcurve_rescan_box(struct flatcurve_fts_backend *backend,
 				 struct mailbox *box,
-				 pool_t pool)
+				 struct fts_flatcurve_xapian_prefetch *pf,
+				 unsigned int idx, pool_t pool)
 {
-	bool dbexist = FALSE;
 	struct event_passthrough *e;
-	struct fts_flatcurve_xapian_query_iter *iter;
-	struct seq_range_iter iter2;
-	uint32_t low_uid = 0;
-	struct mail *mail;
-	ARRAY_TYPE(seq_range) expunged, missing, uids;
-	struct flatcurve_fts_query *query;
-	struct fts_flatcurve_xapian_query_result *result;
-	int ret;
-	struct mail_search_args *search_args;
-	struct mail_search_context *search_ctx;
-	struct mailbox_transaction_context *trans;
+	uint32_t last_uid = 0, uid;
+	const uint32_t *db_uids;
+	unsigned int count, i = 0;
+	ARRAY_TYPE(uint32_t) indexed;
+	ARRAY_TYPE(seq_range) expunged, missing, pending, seqs, uids;
+	const struct seq_range *range;
+	struct mailbox_status status;
+	unsigned int failures;
 	const char *u, *u2;
+	int ret;
 
 	/* Check for non-indexed mails. */
 	if (mailbox_sync(box, MAILBOX_SYNC_FLAG_FULL_READ) < 0)
-		return;
-
-	trans = mailbox_transaction_begin(box, 0, __func__);
-	search_args = mail_search_build_init();
-	mail_search_build_add_all(search_args);
+		return FALSE;
 
-	p_array_init(&missing, pool, 32);
-	p_array_init(&uids, pool, 256);
-
-	search_ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
-	while (mailbox_search_next(search_ctx, &mail)) {
-		seq_range_array_add(&uids, mail->uid);
-		switch (fts_flatcurve_xapian_uid_exists(backend, mail->uid)) {
-		case -1:
-			/* DB doesn't exist. No sense in continuing. */
-			goto end;
-		case 0:
-			seq_range_array_add(&missing, mail->uid);
-			dbexist = TRUE;
-			break;
-		default:
-			dbexist = TRUE;
-			break;
-		}
+	p_array_init(&indexed, pool, 256);
+	if ((ret = fts_flatcurve_xapian_prefetch_uids(pf, idx, &indexed)) <= 0) {
+		/* DB doesn't exist. No sense in continuing. */
+		return (ret == 0);
 	}
-end:
-	(void)mailbox_search_deinit(&search_ctx);
-
-	mail_search_args_unref(&search_args);
-	(void)mailbox_transaction_commit(&trans);
 
-	if (!dbexist)
-		return;
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	p_array_init(&seqs, pool, 1);
+	p_array_init(&uids, pool, 32);
+	if (status.messages > 0) {
+		seq_range_array_add_range(&seqs, 1, status.messages);
+		mailbox_get_uid_range(box, &seqs, &uids);
+	}
 
 	e = event_create_passthrough(backend->event)->
 				     set_name("fts_flatcurve_rescan")->
 				     add_str("mailbox", box->name);
 
-	if (!array_is_empty(&missing)) {
-		/* There does not seem to be an easy way via FTS API (as of
-		 * 2.3.15) to indicate what specific uids need to be indexed.
-		 * Instead, delete all messages above the lowest, non-indexed
-		 * UID and recreate the index the next time the mailbox
-		 * is accessed. */
-		seq_range_array_iter_init(&iter2, &missing);
-		ret = seq_range_array_iter_nth(&iter2, 0, &low_uid);
-		i_assert(ret);
-	}
-
-	query = fts_backend_flatcurve_create_query(backend, pool);
-	query->match_all = TRUE;
-	fts_flatcurve_xapian_build_query(query);
-
-	p_array_init(&expunged, pool, 256);
+	p_array_init(&expunged, pool, 32);
+	p_array_init(&missing, pool, 32);
 
-	if ((iter = fts_flatcurve_xapian_query_iter_init(query)) != NULL) {
-		while ((result = fts_flatcurve_xapian_query_iter_next(iter)) != NULL) {
-			if (((low_uid > 0) && (result->uid >= low_uid)) ||
-			    ((low_uid == 0) && (!seq_range_exists(&uids, result->uid)))) {
-				fts_flatcurve_xapian_expunge(backend,
-							     result->uid);
-				seq_range_array_add(&expunged, result->uid);
-			}
+	/* Both UID lists are sorted, so missing (in mailbox, not in DB)
+	 * and stale (in DB, not in mailbox) UIDs are found in one pass. */
+	db_uids = array_get(&indexed, &count);
+	array_foreach(&uids, range) {
+		for (uid = range->seq1; ; uid++) {
+			for (; (i < count) && (db_uids[i] < uid); i++)
+				seq_range_array_add(&expunged, db_uids[i]);
+			if ((i < count) && (db_uids[i] == uid)) {
+				last_uid = uid;
+				i++;
+			} else
+				seq_range_array_add(&missing, uid);
+			if (uid == range->seq2)
+				break;
+		}
+	}
+	for (; i < count; i++)
+		seq_range_array_add(&expunged, db_uids[i]);
+
+	/* Missing UIDs above the last indexed UID are indexed by Dovecot
+	 * the next time the mailbox is updated. The ones below it are saved
+	 * and indexed below, so that only those messages are indexed (instead
+	 * of expunging and reindexing everything above the lowest missing
+	 * UID). The failure count of an earlier attempt is kept. */
+	if (last_uid < (uint32_t)-1)
+		seq_range_array_remove_range(&missing, last_uid + 1,
+					     (uint32_t)-1);
+	p_array_init(&pending, pool, 4);
+	if (fts_backend_flatcurve_pending_read(backend, &pending,
+					       &failures) < 0)
+		failures = 0;
+	fts_backend_flatcurve_pending_write(backend, &missing, failures, pool);
+
+	array_foreach(&expunged, range) {
+		for (uid = range->seq1; ; uid++) {
+			fts_flatcurve_xapian_expunge(backend, uid);
+			if (uid == range->seq2)
+				break;
 		}
-		fts_flatcurve_xapian_query_iter_deinit(&iter);
 	}
 
-	fts_flatcurve_xapian_destroy_query(query);
-
-	if (array_is_empty(&expunged)) {
+	if (array_is_empty(&expunged) && array_is_empty(&missing)) {
 		e_debug(e->add_str("status", "ok")->event(),
 			"Rescan: no issues found");
 	} else {
@@ -476,7 +976,7 @@ end:
 								 pool));
 		e->add_str("expunged", u);
 
-		if (low_uid > 0) {
+		if (array_not_empty(&missing)) {
 			u2 = str_c(fts_backend_flatcurve_seq_range_string(
 					&missing, pool));
 			e_debug(e->add_str("status", "missing_msgs")->
@@ -489,6 +989,83 @@ end:
 				"expunged=%s", u);
 		}
 	}
+
+	if (array_not_empty(&missing) &&
+	    (fts_backend_flatcurve_index_pending(backend, box) < 0))
+		return FALSE;
+
+	return TRUE;
+}
+
+static void
+fts_backend_flatcurve_optimize_boxes(struct flatcurve_fts_backend *backend,
+				     const char *const *names,
+				     unsigned int count,
+				     ARRAY_TYPE(const_string) *failed,
+				     pool_t pool)
+{
+	struct mailbox *box;
+	const char *name;
+	const ARRAY_TYPE(const_string) *opt_failed;
+	unsigned int i;
+	struct fts_flatcurve_xapian_optimize *opt;
+
+	opt = fts_flatcurve_xapian_optimize_init(backend);
+	for (i = 0; i < count; i++) {
+		box = mailbox_alloc(backend->backend.ns->list, names[i], 0);
+		fts_backend_flatcurve_set_mailbox(backend, box);
+		fts_flatcurve_xapian_optimize_add(opt);
+		mailbox_free(&box);
+	}
+
+	(void)fts_flatcurve_xapian_optimize_run(opt,
+		backend->fuser->set.maintenance_workers);
+
+	opt_failed = fts_flatcurve_xapian_optimize_failed(opt);
+	array_foreach_elem(opt_failed, name) {
+		name = p_strdup(pool, name);
+		array_push_back(failed, &name);
+	}
+	fts_flatcurve_xapian_optimize_deinit(&opt);
+}
+
+static void
+fts_backend_flatcurve_rescan_boxes(struct flatcurve_fts_backend *backend,
+				   const char *const *names,
+				   unsigned int count,
+				   ARRAY_TYPE(const_string) *failed)
+{
+	struct mailbox *box;
+	unsigned int i;
+	struct fts_flatcurve_xapian_prefetch *pf;
+	pool_t rescan_pool;
+
+	/* Read the indexed UIDs of all mailboxes first, which (unlike the
+	 * mailbox syncing) can be done in parallel. */
+	pf = fts_flatcurve_xapian_prefetch_init(backend);
+	for (i = 0; i < count; i++) {
+		box = mailbox_alloc(backend->backend.ns->list, names[i], 0);
+		fts_backend_flatcurve_set_mailbox(backend, box);
+		fts_flatcurve_xapian_prefetch_add(pf);
+		mailbox_free(&box);
+	}
+	fts_flatcurve_xapian_prefetch_run(pf,
+		backend->fuser->set.maintenance_workers);
+
+	rescan_pool = pool_alloconly_create(FTS_FLATCURVE_LABEL " rescan pool",
+					    4096);
+	for (i = 0; i < count; i++) {
+		box = mailbox_alloc(backend->backend.ns->list, names[i], 0);
+		fts_backend_flatcurve_set_mailbox(backend, box);
+		if (!fts_backend_flatcurve_rescan_box(backend, box, pf, i,
+						      rescan_pool))
+			array_push_back(failed, &names[i]);
+		p_clear(rescan_pool);
+		mailbox_free(&box);
+	}
+	pool_unref(&rescan_pool);
+
+	fts_flatcurve_xapian_prefetch_deinit(&pf);
 }
 
 static int
@@ -497,48 +1074,95 @@ fts_backend_flatcurve_iterate_ns(struct fts_backend *_backend,
 {
 	struct flatcurve_fts_backend *backend =
 		(struct flatcurve_fts_backend *)_backend;
-	struct mailbox *box;
+	const char *action, *name, *const *names;
+	ARRAY_TYPE(const_string) boxes, failed;
 	const struct mailbox_info *info;
 	struct mailbox_list_iterate_context *iter;
 	const enum mailbox_list_iter_flags iter_flags =
 		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
 		MAILBOX_LIST_ITER_RETURN_NO_FLAGS |
 		MAILBOX_LIST_ITER_SKIP_ALIASES;
-	enum mailbox_flags mbox_flags = 0;
+	unsigned int batch, count, diff, i;
+	struct timeval now, start;
+	string_t *f;
 	pool_t pool;
-	bool pool_alloc = FALSE;
+
+	pool = pool_alloconly_create(FTS_FLATCURVE_LABEL " maintenance pool",
+				     1024);
+	p_array_init(&boxes, pool, 32);
+	p_array_init(&failed, pool, 4);
 
 	iter = mailbox_list_iter_init(_backend->ns->list, "*", iter_flags);
 	while ((info = mailbox_list_iter_next(iter)) != NULL) {
 		if ((info->flags & (MAILBOX_NOSELECT | MAILBOX_NONEXISTENT)) != 0)
 			continue;
+		name = p_strdup(pool, info->vname);
+		array_push_back(&boxes, &name);
+	}
+	(void)mailbox_list_iter_deinit(&iter);
 
-		box = mailbox_alloc(backend->backend.ns->list, info->vname,
-				    mbox_flags);
-		fts_backend_flatcurve_set_mailbox(backend, box);
+	switch (act) {
+	case FTS_BACKEND_FLATCURVE_ACTION_OPTIMIZE:
+		action = "optimize";
+		break;
+	case FTS_BACKEND_FLATCURVE_ACTION_RESCAN:
+		action = "rescan";
+		break;
+	default:
+		i_unreached();
+	}
 
+	/* Mailboxes are processed in batches of maintenance_workers; the
+	 * Xapian work of each batch is done in parallel. */
+	batch = I_MAX(backend->fuser->set.maintenance_workers, 1);
+	names = array_get(&boxes, &count);
+	i_gettimeofday(&start);
+
+	for (i = 0; i < count; i += batch) {
 		switch (act) {
 		case FTS_BACKEND_FLATCURVE_ACTION_OPTIMIZE:
-			fts_flatcurve_xapian_optimize_box(backend);
+			fts_backend_flatcurve_optimize_boxes(backend, names + i,
+				I_MIN(batch, count - i), &failed, pool);
 			break;
 		case FTS_BACKEND_FLATCURVE_ACTION_RESCAN:
-			if (!pool_alloc) {
-				pool = pool_alloconly_create(
-					FTS_FLATCURVE_LABEL " rescan pool",
-					4096);
-				pool_alloc = TRUE;
-			}
-			fts_backend_flatcurve_rescan_box(backend, box, pool);
-			p_clear(pool);
+			fts_backend_flatcurve_rescan_boxes(backend, names + i,
+				I_MIN(batch, count - i), &failed);
 			break;
 		}
 
-		mailbox_free(&box);
+		if (batch > 1)
+			e_debug(backend->event, "Maintenance (%s) progress: "
+				"%u/%u mailboxes", action,
+				I_MIN(i + batch, count), count);
+	}
+
+	i_gettimeofday(&now);
+	diff = (unsigned int)timeval_diff_msecs(&now, &start);
+
+	f = t_str_new(128);
+	array_foreach_elem(&failed, name) {
+		if (str_len(f) > 0)
+			str_append_c(f, ',');
+		str_append(f, name);
 	}
-	(void)mailbox_list_iter_deinit(&iter);
 
-	if (pool_alloc)
-		pool_unref(&pool);
+	e_debug(event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_maintenance")->
+		add_str("action", action)->
+		add_int("mailboxes", count)->
+		add_int("failed", array_count(&failed))->
+		add_str("failed_mailboxes", str_c(f))->
+		add_int("workers", batch)->
+		add_int("duration", diff)->event(),
+		"Maintenance (%s) completed mailboxes=%u failed=%u "
+		"in %u.%03u secs", action, count, array_count(&failed),
+		diff/1000, diff%1000);
+
+	if (array_not_empty(&failed))
+		e_error(backend->event, "Maintenance (%s) failed for "
+			"mailboxes: %s", action, str_c(f));
+
+	pool_unref(&pool);
 
 	return 0;
 }
@@ -555,6 +1179,15 @@ static int fts_backend_flatcurve_rescan(struct fts_backend *_backend)
 			FTS_BACKEND_FLATCURVE_ACTION_RESCAN);
 }
 
+/* Approximate memory used by the result arrays. */
+static size_t
+fts_backend_flatcurve_result_size(const struct flatcurve_fts_result *r)
+{
+	return (array_count(&r->uids) + array_count(&r->maybe_uids)) *
+		sizeof(struct seq_range) +
+		array_count(&r->scores) * sizeof(struct fts_score_map);
+}
+
 static int
 fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 				   struct mailbox *const boxes[],
@@ -566,12 +1199,16 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 		(struct flatcurve_fts_backend *)_backend;
 	ARRAY(struct fts_result) box_results;
 	struct flatcurve_fts_result *fresult;
+	struct fts_flatcurve_xapian_query_profile profile;
+	struct event_passthrough *e;
 	unsigned int i;
-	const char *m_debug = "", *u_debug = "";
+	const char *m_debug, *u_debug, *uids_debug;
 	struct flatcurve_fts_query *query;
 	struct fts_result *r;
 	int ret = 0;
 
+	fts_backend_flatcurve_learn_headers(backend, args);
+
 	/* Create query */
 	query = fts_backend_flatcurve_create_query(backend, result->pool);
 	query->args = args;
@@ -589,6 +1226,7 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 		p_array_init(&fresult->uids, result->pool, 32);
 
 		fts_backend_flatcurve_set_mailbox(backend, r->box);
+		fts_backend_flatcurve_warmup(backend);
 
 		if (!fts_flatcurve_xapian_run_query(query, fresult)) {
 			ret = -1;
@@ -603,23 +1241,56 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 		if (!str_len(query->qtext))
 			continue;
 
-		if (array_not_empty(&fresult->maybe_uids))
-			m_debug = str_c(fts_backend_flatcurve_seq_range_string(
-								&fresult->maybe_uids, query->pool));
-		if (array_not_empty(&fresult->uids))
-			u_debug = str_c(fts_backend_flatcurve_seq_range_string(
-								&fresult->uids, query->pool));
-
+		fts_flatcurve_xapian_query_profile(query, &profile);
 		e_debug(event_create_passthrough(backend->event)->
+			set_name("fts_flatcurve_query_profile")->
+			add_int("build_usecs", profile.build_usecs)->
+			add_str("mailbox", r->box->vname)->
+			add_int("mset_usecs", profile.mset_usecs)->
+			add_int("open_usecs", profile.open_usecs)->
+			add_int("plan_usecs", profile.plan_usecs)->
+			add_str("query", str_c(query->qtext))->
+			add_int("results_usecs", profile.results_usecs)->
+			add_int("shards", profile.shards)->
+			add_int("wildcard_terms", profile.wildcard_terms)->
+			add_int("wildcards", profile.wildcards)->event(),
+			"Query profile (%s) build=%u open=%u plan=%u mset=%u "
+			"results=%u usecs; shards=%u wildcards=%u "
+			"wildcard_terms=%u", str_c(query->qtext),
+			profile.build_usecs, profile.open_usecs,
+			profile.plan_usecs, profile.mset_usecs,
+			profile.results_usecs, profile.shards,
+			profile.wildcards, profile.wildcard_terms);
+
+		e = event_create_passthrough(backend->event)->
 			set_name("fts_flatcurve_query")->
 			add_int("count", seq_range_count(&fresult->uids))->
 			add_str("mailbox", r->box->vname)->
-			add_str("maybe_uids", m_debug)->
-			add_str("query", str_c(query->qtext))->
-			add_str("uids", u_debug)->event(), "Query (%s) "
-			"matches=%d uids=%s maybe_matches=%d maybe_uids=%s",
-			str_c(query->qtext), seq_range_count(&fresult->uids), u_debug,
-			seq_range_count(&fresult->maybe_uids), m_debug);
+			add_int("memory_results",
+				fts_backend_flatcurve_result_size(fresult))->
+			add_str("query", str_c(query->qtext));
+
+		/* Formatting the UID lists is expensive for large results,
+		 * so it is only done if explicitly enabled. */
+		uids_debug = "";
+		if (backend->fuser->set.query_log_uids) {
+			m_debug = u_debug = "";
+			if (array_not_empty(&fresult->maybe_uids))
+				m_debug = str_c(fts_backend_flatcurve_seq_range_string(
+									&fresult->maybe_uids, query->pool));
+			if (array_not_empty(&fresult->uids))
+				u_debug = str_c(fts_backend_flatcurve_seq_range_string(
+									&fresult->uids, query->pool));
+			e->add_str("maybe_uids", m_debug)->
+				add_str("uids", u_debug);
+			uids_debug = t_strdup_printf(" uids=%s maybe_uids=%s",
+						     u_debug, m_debug);
+		}
+
+		e_debug(fts_flatcurve_xapian_memory_event(backend, e)->event(),
+			"Query (%s) matches=%d maybe_matches=%d%s",
+			str_c(query->qtext), seq_range_count(&fresult->uids),
+			seq_range_count(&fresult->maybe_uids), uids_debug);
 	}
 
 	if (ret == 0) {
@@ -671,6 +1342,27 @@ fts_backend_flatcurve_lookup(struct fts_backend *_backend, struct mailbox *box,
 	return ret;
 }
 
+int fts_backend_flatcurve_index_pending(struct flatcurve_fts_backend *backend,
+				       struct mailbox *box)
+{
+	struct flatcurve_fts_backend_update_context *ctx;
+	struct fts_backend_update_context *update_ctx;
+	int ret;
+
+	update_ctx = fts_backend_update_init(&backend->backend);
+	fts_backend_update_set_mailbox(update_ctx, box);
+
+	ctx = (struct flatcurve_fts_backend_update_context *)update_ctx;
+	fts_backend_flatcurve_set_mailbox(backend, box);
+	ctx->box = box;
+	ret = fts_backend_flatcurve_update_pending(ctx);
+
+	if (fts_backend_update_deinit(&update_ctx) < 0)
+		ret = -1;
+
+	return ret;
+}
+
 int fts_backend_flatcurve_delete_dir(struct flatcurve_fts_backend *backend,
 				     const char *path)
 {
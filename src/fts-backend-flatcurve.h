@@ -21,6 +21,18 @@ struct flatcurve_fts_backend {
 
 	enum file_lock_method parsed_lock_method;
 
+	/* Non-indexed headers that have been searched for, and are now
+	 * indexed as if they were listed in fts_header_indexes. */
+	ARRAY_TYPE(const_string) learn_hdrs;
+	const char *learn_path;
+	time_t learn_mtime;
+	off_t learn_size;
+	pool_t learn_pool;
+
+	/* Mailboxes warmed up (fts_flatcurve_warmup_bytes) in this
+	 * session. */
+	ARRAY_TYPE(const_string) warmup_boxes;
+
 	pool_t pool;
 
 	bool debug_init:1;
@@ -35,8 +47,21 @@ struct flatcurve_fts_backend_update_context {
 	uint32_t uid;
 	struct timeval start;
 
+	/* Used to look up the values (dates/size) of the message being
+	 * indexed, without reading the message itself. */
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	time_t received_date, sent_date;
+	uoff_t size;
+
 	bool indexed_hdr:1;
+	/* Pending UIDs (found missing by rescan) are being indexed. */
+	bool pending:1;
 	bool skip_uid:1;
+	bool has_received_date:1;
+	bool has_sent_date:1;
+	bool has_size:1;
 };
 
 struct flatcurve_fts_query {
@@ -48,8 +73,6 @@ struct flatcurve_fts_query {
 	struct flatcurve_fts_query_xapian *xapian;
 
 	pool_t pool;
-
-	bool match_all:1;
 };
 
 struct flatcurve_fts_result {
@@ -64,6 +87,10 @@ void fts_backend_flatcurve_set_mailbox(struct flatcurve_fts_backend *backend,
 void
 fts_backend_flatcurve_close_mailbox(struct flatcurve_fts_backend *backend);
 
+// Returns -1 on error, otherwise the number of pending messages indexed
+int fts_backend_flatcurve_index_pending(struct flatcurve_fts_backend *backend,
+				       struct mailbox *box);
+
 // Returns -1 on error, 0 if FTS directory doesn't exist, 1 on success
 int fts_backend_flatcurve_delete_dir(struct flatcurve_fts_backend *backend,
 				     const char *path);
@@ -0,0 +1,989 @@
+/* Copyright (c) Michael Slusarz <slusarz@curecanti.org>
+ * See the included COPYING file */
+
+/* Standalone benchmark of the Xapian layer: a synthetic mail corpus is
+ * indexed through fts-backend-flatcurve-xapian.cpp directly, without a
+ * Dovecot server, mail storage or the fts plugin. Each mode is run in its
+ * own process, so that the peak RSS reported is the mode's own.
+ *
+ * The query benchmark (-q) indexes the corpus into mailboxes of 1 and 10
+ * shards, and replays mixes of searches against them with concurrent
+ * readers. */
+
+#include "lib.h"
+#include "array.h"
+#include "mail-search.h"
+#include "mkdir-parents.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+#include "fts-backend-flatcurve.h"
+#include "fts-backend-flatcurve-xapian.h"
+#include "fts-flatcurve-plugin.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef M_PI
+#  define M_PI 3.14159265358979323846
+#endif
+
+#define FTS_FLATCURVE_BENCH_MESSAGES_DEFAULT 10000
+#define FTS_FLATCURVE_BENCH_BATCH_DEFAULT 500
+#define FTS_FLATCURVE_BENCH_WORDS_DEFAULT 50000
+#define FTS_FLATCURVE_BENCH_SEED_DEFAULT 1
+
+/* Word frequencies follow Zipf's law (the frequency of the word of rank r
+ * is proportional to 1/r^s); s is close to 1 for natural language. */
+#define FTS_FLATCURVE_BENCH_ZIPF_EXPONENT 1.07
+
+/* Message body sizes (in words) follow a log-normal distribution. */
+#define FTS_FLATCURVE_BENCH_BODY_WORDS_MEDIAN 150
+#define FTS_FLATCURVE_BENCH_BODY_WORDS_SIGMA 1.2
+#define FTS_FLATCURVE_BENCH_BODY_WORDS_MAX 20000
+
+/* Bytes added to the size of every message for the headers that are not
+ * indexed (Received:, DKIM-Signature:, ...). */
+#define FTS_FLATCURVE_BENCH_HEADER_BYTES 2048
+
+/* Words are built from these syllables, by writing their rank in base
+ * N_ELEMENTS(syllables): frequent words are short, and all are unique. */
+static const char *const fts_flatcurve_bench_syllables[] = {
+	"ba", "ce", "di", "fo", "gu", "ha", "je", "ki", "lo", "mu",
+	"na", "pe", "ri", "so", "tu", "va", "we", "xi", "yo", "ze",
+	"ar", "en", "is", "on", "ul", "st", "tr", "ch"
+};
+
+/* Query benchmark: the number of shards of every mailbox in each of the
+ * index layouts, and the number of mailboxes (searched together by the
+ * multi-mailbox mix). */
+static const unsigned int fts_flatcurve_bench_layouts[] = { 1, 10 };
+#define FTS_FLATCURVE_BENCH_QUERY_MAILBOXES 4
+#define FTS_FLATCURVE_BENCH_READERS_DEFAULT 4
+
+enum fts_flatcurve_bench_mix {
+	/* BODY search of a 2 character prefix */
+	FTS_FLATCURVE_BENCH_MIX_PREFIX,
+	/* TEXT search */
+	FTS_FLATCURVE_BENCH_MIX_TEXT,
+	/* From: header search */
+	FTS_FLATCURVE_BENCH_MIX_HEADER,
+	/* TEXT search AND NOT a BODY search */
+	FTS_FLATCURVE_BENCH_MIX_NOT,
+	/* Non-indexed header search OR a TEXT search */
+	FTS_FLATCURVE_BENCH_MIX_OR_HEADER,
+	/* TEXT search of all mailboxes */
+	FTS_FLATCURVE_BENCH_MIX_MULTI,
+
+	FTS_FLATCURVE_BENCH_MIX_COUNT
+};
+
+static const char *const fts_flatcurve_bench_mix_names[] = {
+	"prefix",
+	"text",
+	"header",
+	"negated",
+	"or_header",
+	"multi"
+};
+
+static const char *const fts_flatcurve_bench_modes[] = {
+	"prefix",
+	"substring",
+	NULL
+};
+
+ARRAY_DEFINE_TYPE(fts_flatcurve_bench_usecs, long long);
+
+struct fts_flatcurve_bench {
+	unsigned int messages;
+	unsigned int batch;
+	unsigned int words;
+	unsigned int seed;
+	unsigned int memory_limit;
+	/* Query benchmark: queries per reader and mix, maximum number of
+	 * concurrent readers. */
+	unsigned int queries;
+	unsigned int readers;
+	const char *dir;
+	ARRAY_TYPE(const_string) modes;
+
+	char **vocabulary;
+	double *cdf;
+	uint64_t rand;
+
+	bool keep:1;
+};
+
+static struct fts_flatcurve_bench bench;
+
+/* The benchmark drives the Xapian layer without a mail storage or the fts
+ * plugin: these replace the functions it uses from them. */
+bool fts_header_want_indexed(const char *hdr_name)
+{
+	/* The headers indexed by the default fts header configuration. */
+	return (strcasecmp(hdr_name, "From") == 0 ||
+		strcasecmp(hdr_name, "To") == 0 ||
+		strcasecmp(hdr_name, "Cc") == 0 ||
+		strcasecmp(hdr_name, "Subject") == 0);
+}
+
+int mailbox_list_mkdir_root(struct mailbox_list *list ATTR_UNUSED,
+			    const char *path,
+			    enum mailbox_list_path_type type ATTR_UNUSED)
+{
+	if ((mkdir_parents(path, 0700) < 0) && (errno != EEXIST)) {
+		i_error("mkdir_parents(%s) failed: %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+int fts_backend_flatcurve_delete_dir(struct flatcurve_fts_backend *backend ATTR_UNUSED,
+				     const char *path)
+{
+	const char *error;
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+	if (unlink_directory(path, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0) {
+		i_error("%s", error);
+		return -1;
+	}
+	return 1;
+}
+
+void fts_backend_flatcurve_close_mailbox(struct flatcurve_fts_backend *backend)
+{
+	fts_flatcurve_xapian_close(backend);
+	str_truncate(backend->boxname, 0);
+	str_truncate(backend->db_path, 0);
+}
+
+/* xorshift64*: the same seed always generates the same corpus. */
+static uint64_t fts_flatcurve_bench_rand(void)
+{
+	bench.rand ^= bench.rand >> 12;
+	bench.rand ^= bench.rand << 25;
+	bench.rand ^= bench.rand >> 27;
+	return bench.rand * 2685821657736338717ULL;
+}
+
+static double fts_flatcurve_bench_rand_double(void)
+{
+	return (fts_flatcurve_bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double fts_flatcurve_bench_rand_normal(void)
+{
+	double u1, u2;
+
+	/* Box-Muller transform */
+	do {
+		u1 = fts_flatcurve_bench_rand_double();
+	} while (u1 <= 0);
+	u2 = fts_flatcurve_bench_rand_double();
+
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static void fts_flatcurve_bench_vocabulary_init(void)
+{
+	string_t *word;
+	unsigned int i, r;
+	double sum = 0;
+
+	bench.vocabulary = i_new(char *, bench.words);
+	bench.cdf = i_new(double, bench.words);
+	word = t_str_new(32);
+
+	for (i = 0; i < bench.words; i++) {
+		str_truncate(word, 0);
+		r = i;
+		do {
+			str_append(word, fts_flatcurve_bench_syllables[
+				r % N_ELEMENTS(fts_flatcurve_bench_syllables)]);
+			r /= N_ELEMENTS(fts_flatcurve_bench_syllables);
+		} while (r > 0);
+		bench.vocabulary[i] = i_strdup(str_c(word));
+
+		sum += 1 / pow(i + 1, FTS_FLATCURVE_BENCH_ZIPF_EXPONENT);
+		bench.cdf[i] = sum;
+	}
+}
+
+static void fts_flatcurve_bench_vocabulary_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < bench.words; i++)
+		i_free(bench.vocabulary[i]);
+	i_free(bench.vocabulary);
+	i_free(bench.cdf);
+}
+
+static const char *fts_flatcurve_bench_word(void)
+{
+	double u;
+	unsigned int left = 0, right = bench.words - 1, mid;
+
+	u = fts_flatcurve_bench_rand_double() * bench.cdf[bench.words - 1];
+	while (left < right) {
+		mid = (left + right) / 2;
+		if (bench.cdf[mid] <= u)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return bench.vocabulary[left];
+}
+
+static void
+fts_flatcurve_bench_token(struct flatcurve_fts_backend_update_context *ctx,
+			  const char *token)
+{
+	size_t len = strlen(token);
+
+	if (len < ctx->backend->fuser->set.min_term_size)
+		return;
+
+	if (ctx->type == FTS_BACKEND_BUILD_KEY_HDR)
+		fts_flatcurve_xapian_index_header(ctx,
+			(const unsigned char *)token, len);
+	else
+		fts_flatcurve_xapian_index_body(ctx,
+			(const unsigned char *)token, len);
+}
+
+static void
+fts_flatcurve_bench_key(struct flatcurve_fts_backend_update_context *ctx,
+			enum fts_backend_build_key_type type,
+			const char *hdr_name)
+{
+	ctx->type = type;
+	str_truncate(ctx->hdr_name, 0);
+	if (hdr_name != NULL)
+		str_append(ctx->hdr_name, hdr_name);
+	ctx->indexed_hdr = FALSE;
+}
+
+/* Tokens of an address header, as output by the email-address and generic
+ * tokenizers. */
+static void
+fts_flatcurve_bench_address(struct flatcurve_fts_backend_update_context *ctx,
+			    const char *hdr_name)
+{
+	const char *first, *last, *domain;
+
+	first = fts_flatcurve_bench_word();
+	last = fts_flatcurve_bench_word();
+	domain = fts_flatcurve_bench_word();
+
+	fts_flatcurve_bench_key(ctx, FTS_BACKEND_BUILD_KEY_HDR, hdr_name);
+	fts_flatcurve_bench_token(ctx, t_strdup_printf("%s.%s@%s.example",
+						       first, last, domain));
+	fts_flatcurve_bench_token(ctx, first);
+	fts_flatcurve_bench_token(ctx, last);
+	fts_flatcurve_bench_token(ctx, domain);
+	fts_flatcurve_bench_token(ctx, "example");
+}
+
+static int
+fts_flatcurve_bench_message(struct flatcurve_fts_backend_update_context *ctx,
+			    uint32_t uid)
+{
+	unsigned int body_words, i, words;
+
+	body_words = (unsigned int)(FTS_FLATCURVE_BENCH_BODY_WORDS_MEDIAN *
+		exp(FTS_FLATCURVE_BENCH_BODY_WORDS_SIGMA *
+		    fts_flatcurve_bench_rand_normal()));
+	body_words = I_MIN(I_MAX(body_words, 1),
+			   FTS_FLATCURVE_BENCH_BODY_WORDS_MAX);
+
+	ctx->uid = uid;
+	ctx->received_date = 1600000000 + uid * 60;
+	ctx->sent_date = ctx->received_date -
+		(fts_flatcurve_bench_rand() % 3600);
+	ctx->size = FTS_FLATCURVE_BENCH_HEADER_BYTES + body_words * 7;
+	if (!fts_flatcurve_xapian_init_msg(ctx))
+		return -1;
+
+	fts_flatcurve_bench_address(ctx, "From");
+	fts_flatcurve_bench_address(ctx, "To");
+	if ((fts_flatcurve_bench_rand() % 10) < 3)
+		fts_flatcurve_bench_address(ctx, "Cc");
+
+	fts_flatcurve_bench_key(ctx, FTS_BACKEND_BUILD_KEY_HDR, "Subject");
+	words = 3 + (fts_flatcurve_bench_rand() % 8);
+	for (i = 0; i < words; i++)
+		fts_flatcurve_bench_token(ctx, fts_flatcurve_bench_word());
+
+	/* Unique, random tokens (junk for the index). */
+	fts_flatcurve_bench_key(ctx, FTS_BACKEND_BUILD_KEY_HDR, "Message-ID");
+	fts_flatcurve_bench_token(ctx, t_strdup_printf("%016llx",
+		(unsigned long long)fts_flatcurve_bench_rand()));
+
+	fts_flatcurve_bench_key(ctx, FTS_BACKEND_BUILD_KEY_BODY_PART, NULL);
+	for (i = 0; i < body_words; i++)
+		fts_flatcurve_bench_token(ctx, fts_flatcurve_bench_word());
+
+	return (ctx->ctx.failed) ? -1 : 0;
+}
+
+static int fts_flatcurve_bench_usecs_cmp(const long long *u1,
+					 const long long *u2)
+{
+	return (*u1 < *u2) ? -1 : ((*u1 > *u2) ? 1 : 0);
+}
+
+/* Returns the percentile (nearest rank; in per mille) of the usecs, in
+ * msecs. The usecs are sorted. */
+static double
+fts_flatcurve_bench_percentile(ARRAY_TYPE(fts_flatcurve_bench_usecs) *usecs,
+			       unsigned int permille)
+{
+	unsigned int count = array_count(usecs);
+
+	if (count == 0)
+		return 0;
+	array_sort(usecs, fts_flatcurve_bench_usecs_cmp);
+	return array_idx_elem(usecs, (count * permille + 999) / 1000 - 1) /
+		1000.0;
+}
+
+static struct flatcurve_fts_backend *
+fts_flatcurve_bench_backend_init(struct fts_flatcurve_user *fuser)
+{
+	struct flatcurve_fts_backend *backend;
+
+	backend = i_new(struct flatcurve_fts_backend, 1);
+	backend->pool = pool_alloconly_create(FTS_FLATCURVE_LABEL " bench",
+					      1024);
+	backend->boxname = str_new(backend->pool, 128);
+	backend->db_path = str_new(backend->pool, 256);
+	backend->volatile_dir = str_new(backend->pool, 128);
+	backend->event = event_create(NULL);
+	backend->fuser = fuser;
+	backend->parsed_lock_method = FILE_LOCK_METHOD_FCNTL;
+	fts_flatcurve_xapian_init(backend);
+
+	return backend;
+}
+
+static void
+fts_flatcurve_bench_backend_deinit(struct flatcurve_fts_backend **_backend)
+{
+	struct flatcurve_fts_backend *backend = *_backend;
+
+	*_backend = NULL;
+
+	fts_backend_flatcurve_close_mailbox(backend);
+	fts_flatcurve_xapian_deinit(backend);
+	event_unref(&backend->event);
+	pool_unref(&backend->pool);
+	i_free(backend);
+}
+
+/* The mailbox name is the path of its directory, relative to bench.dir. */
+static void
+fts_flatcurve_bench_set_mailbox(struct flatcurve_fts_backend *backend,
+				const char *name)
+{
+	fts_backend_flatcurve_close_mailbox(backend);
+	str_append(backend->boxname, name);
+	str_printfa(backend->db_path, "%s/%s/%s/", bench.dir, name,
+		    FTS_FLATCURVE_LABEL);
+	fts_flatcurve_xapian_set_mailbox(backend);
+}
+
+/* The settings are the defaults of the plugin, but commits are done (and
+ * timed) by the benchmark every batch of messages. */
+static void fts_flatcurve_bench_settings(struct fts_flatcurve_user *fuser)
+{
+	i_zero(fuser);
+	fuser->set.commit_limit = 0;
+	fuser->set.min_term_size = 2;
+	fuser->set.rotate_size = 5000;
+	fuser->set.rotate_time = 5000;
+}
+
+/* Indexes the corpus of the seed into the current mailbox. Returns the
+ * number of messages indexed, or -1 on error. */
+static int
+fts_flatcurve_bench_index_box(struct flatcurve_fts_backend *backend,
+			      unsigned int seed,
+			      ARRAY_TYPE(fts_flatcurve_bench_usecs) *commits)
+{
+	struct flatcurve_fts_backend_update_context ctx;
+	struct timeval start, end;
+	long long usecs;
+	uint32_t uid;
+	int ret = 0;
+
+	i_zero(&ctx);
+	ctx.backend = backend;
+	ctx.hdr_name = str_new(backend->pool, 128);
+	ctx.values = TRUE;
+
+	bench.rand = (seed * 0x9E3779B97F4A7C15ULL) | 1;
+
+	for (uid = 1; uid <= bench.messages; uid++) {
+		T_BEGIN {
+			ret = fts_flatcurve_bench_message(&ctx, uid);
+		} T_END;
+		if (ret < 0) {
+			i_error("Indexing failed (mailbox=%s, uid=%u)",
+				str_c(backend->boxname), uid);
+			break;
+		}
+
+		/* Closing the mailbox commits the last batch. */
+		if (((uid % bench.batch) != 0) && (uid != bench.messages))
+			continue;
+
+		i_gettimeofday(&start);
+		if (uid == bench.messages)
+			fts_flatcurve_xapian_close(backend);
+		else
+			fts_flatcurve_xapian_refresh(backend);
+		i_gettimeofday(&end);
+		usecs = timeval_diff_usecs(&end, &start);
+		if (commits != NULL)
+			array_push_back(commits, &usecs);
+	}
+
+	return (ret < 0) ? -1 : (int)(uid - 1);
+}
+
+static void
+fts_flatcurve_bench_shards(struct flatcurve_fts_backend *backend,
+			   uoff_t *bytes_r, unsigned int *shards_r)
+{
+	ARRAY_TYPE(fts_flatcurve_xapian_shard_stats) stats;
+	const struct fts_flatcurve_xapian_shard_stats *s;
+
+	*bytes_r = 0;
+	t_array_init(&stats, 8);
+	fts_flatcurve_xapian_mailbox_shard_stats(backend,
+						 pool_datastack_create(),
+						 &stats);
+	array_foreach(&stats, s)
+		*bytes_r += s->bytes;
+	*shards_r = array_count(&stats);
+	fts_flatcurve_xapian_close(backend);
+}
+
+static int fts_flatcurve_bench_index(const char *mode)
+{
+	struct fts_flatcurve_user fuser;
+	struct flatcurve_fts_backend *backend;
+	ARRAY_TYPE(fts_flatcurve_bench_usecs) commits;
+	struct timeval start, end;
+	struct rusage usage;
+	double secs;
+	uoff_t bytes;
+	unsigned int shards;
+	int ret;
+
+	fts_flatcurve_bench_settings(&fuser);
+	fuser.set.substring_search = (strcmp(mode, "substring") == 0);
+
+	backend = fts_flatcurve_bench_backend_init(&fuser);
+	fts_flatcurve_bench_set_mailbox(backend, mode);
+	i_array_init(&commits, bench.messages / bench.batch + 1);
+
+	i_gettimeofday(&start);
+	ret = fts_flatcurve_bench_index_box(backend, bench.seed, &commits);
+	i_gettimeofday(&end);
+	secs = timeval_diff_usecs(&end, &start) / 1000000.0;
+
+	T_BEGIN {
+		fts_flatcurve_bench_shards(backend, &bytes, &shards);
+	} T_END;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		i_zero(&usage);
+
+	printf("mode=%s messages=%d seconds=%.2f msgs_per_sec=%.1f "
+	       "commits=%u commit_p50_ms=%.1f commit_p90_ms=%.1f "
+	       "commit_p99_ms=%.1f commit_max_ms=%.1f peak_rss_kb=%ld "
+	       "index_bytes=%"PRIuUOFF_T" shards=%u\n",
+	       mode, ret, secs, I_MAX(ret, 0) / secs, array_count(&commits),
+	       fts_flatcurve_bench_percentile(&commits, 500),
+	       fts_flatcurve_bench_percentile(&commits, 900),
+	       fts_flatcurve_bench_percentile(&commits, 990),
+	       fts_flatcurve_bench_percentile(&commits, 1000),
+	       usage.ru_maxrss, bytes, shards);
+	fflush(stdout);
+
+	array_free(&commits);
+	fts_flatcurve_bench_backend_deinit(&backend);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Builds the mailboxes of a query layout, unless they already exist (i.e.
+ * were kept by an earlier run using the same directory). */
+static int fts_flatcurve_bench_query_layout(unsigned int shards)
+{
+	struct fts_flatcurve_user fuser;
+	struct flatcurve_fts_backend *backend;
+	const char *dir, *name;
+	struct stat st;
+	unsigned int i;
+	int ret = 0;
+
+	dir = t_strdup_printf("%s/query-%u", bench.dir, shards);
+	if (stat(dir, &st) == 0) {
+		printf("layout=%u built=no\n", shards);
+		return 0;
+	}
+
+	fts_flatcurve_bench_settings(&fuser);
+	/* Only rotate by size, so that all mailboxes have the same number
+	 * of shards. */
+	fuser.set.rotate_size = (shards > 1)
+		? (bench.messages + shards - 1) / shards : 0;
+	fuser.set.rotate_time = 0;
+
+	backend = fts_flatcurve_bench_backend_init(&fuser);
+	for (i = 0; (i < FTS_FLATCURVE_BENCH_QUERY_MAILBOXES) && (ret == 0);
+	     i++) {
+		name = t_strdup_printf("query-%u/box%u", shards, i);
+		fts_flatcurve_bench_set_mailbox(backend, name);
+		if (fts_flatcurve_bench_index_box(backend, bench.seed + i,
+						  NULL) < 0)
+			ret = -1;
+	}
+	fts_flatcurve_bench_backend_deinit(&backend);
+
+	printf("layout=%u built=yes\n", shards);
+	fflush(stdout);
+
+	return ret;
+}
+
+static const char *
+fts_flatcurve_bench_query_word(unsigned int min_rank, unsigned int max_rank)
+{
+	max_rank = I_MIN(max_rank, bench.words);
+	min_rank = I_MIN(min_rank, max_rank - 1);
+
+	return bench.vocabulary[min_rank +
+		(fts_flatcurve_bench_rand() % (max_rank - min_rank))];
+}
+
+static struct mail_search_arg *
+fts_flatcurve_bench_query_arg(pool_t pool, enum mail_search_arg_type type,
+			      const char *hdr_field_name, const char *value,
+			      struct mail_search_arg *next)
+{
+	struct mail_search_arg *arg;
+
+	arg = p_new(pool, struct mail_search_arg, 1);
+	arg->type = type;
+	arg->hdr_field_name = hdr_field_name;
+	arg->value.str = value;
+	arg->next = next;
+
+	return arg;
+}
+
+/* Sets the search arguments of a query of the mix (words are picked from
+ * the frequent, or less frequent ranks of the vocabulary). */
+static void
+fts_flatcurve_bench_query_args(struct flatcurve_fts_query *query,
+			       enum fts_flatcurve_bench_mix mix)
+{
+	const char *frequent, *word;
+
+	frequent = fts_flatcurve_bench_query_word(10, 100);
+	word = fts_flatcurve_bench_query_word(100, 2000);
+
+	query->flags = FTS_LOOKUP_FLAG_AND_ARGS;
+	switch (mix) {
+	case FTS_FLATCURVE_BENCH_MIX_PREFIX:
+		/* The first syllable: matches 1/28th of the vocabulary. */
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_BODY, NULL, p_strndup(query->pool, word, 2),
+			NULL);
+		break;
+	case FTS_FLATCURVE_BENCH_MIX_TEXT:
+	case FTS_FLATCURVE_BENCH_MIX_MULTI:
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_TEXT, NULL, word, NULL);
+		break;
+	case FTS_FLATCURVE_BENCH_MIX_HEADER:
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_HEADER_ADDRESS, "From", word, NULL);
+		break;
+	case FTS_FLATCURVE_BENCH_MIX_NOT:
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_BODY, NULL, word, NULL);
+		query->args->match_not = TRUE;
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_TEXT, NULL, frequent, query->args);
+		break;
+	case FTS_FLATCURVE_BENCH_MIX_OR_HEADER:
+		/* X-Mailer is not one of the indexed headers (see
+		 * fts_header_want_indexed() above), so its matches are maybe
+		 * matches. */
+		query->flags = 0;
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_TEXT, NULL, word, NULL);
+		query->args = fts_flatcurve_bench_query_arg(query->pool,
+			SEARCH_HEADER, "X-Mailer", frequent, query->args);
+		break;
+	}
+}
+
+/* Runs the queries of a reader, and writes the number of usecs it ran
+ * for, followed by the usecs of every query, to fd. */
+static int
+fts_flatcurve_bench_query_reader(unsigned int shards,
+				 enum fts_flatcurve_bench_mix mix,
+				 unsigned int reader, int fd)
+{
+	struct fts_flatcurve_user fuser;
+	struct flatcurve_fts_backend *backend;
+	struct flatcurve_fts_query *query;
+	struct flatcurve_fts_result result;
+	ARRAY_TYPE(fts_flatcurve_bench_usecs) usecs;
+	struct timeval start, end, qstart;
+	long long diff;
+	unsigned int boxes, i, j;
+	pool_t pool;
+	int ret = 0;
+
+	fts_flatcurve_bench_settings(&fuser);
+	backend = fts_flatcurve_bench_backend_init(&fuser);
+	boxes = (mix == FTS_FLATCURVE_BENCH_MIX_MULTI)
+		? FTS_FLATCURVE_BENCH_QUERY_MAILBOXES : 1;
+	if (boxes == 1) {
+		fts_flatcurve_bench_set_mailbox(backend,
+			t_strdup_printf("query-%u/box0", shards));
+	}
+
+	/* Each reader searches for different words. */
+	bench.rand = ((bench.seed + reader + 1) * 0xBF58476D1CE4E5B9ULL) | 1;
+	i_array_init(&usecs, bench.queries + 1);
+	diff = 0;
+	array_push_back(&usecs, &diff);
+
+	i_gettimeofday(&start);
+	for (i = 0; (i < bench.queries) && (ret == 0); i++) T_BEGIN {
+		pool = pool_alloconly_create(FTS_FLATCURVE_LABEL " bench query",
+					     1024);
+		query = p_new(pool, struct flatcurve_fts_query, 1);
+		query->backend = backend;
+		query->pool = pool;
+		query->qtext = str_new(pool, 128);
+		fts_flatcurve_bench_query_args(query, mix);
+
+		i_gettimeofday(&qstart);
+		fts_flatcurve_xapian_build_query(query);
+		for (j = 0; j < boxes; j++) {
+			if (boxes > 1) {
+				fts_flatcurve_bench_set_mailbox(backend,
+					t_strdup_printf("query-%u/box%u",
+							shards, j));
+			}
+			i_zero(&result);
+			p_array_init(&result.maybe_uids, pool, 32);
+			p_array_init(&result.scores, pool, 32);
+			p_array_init(&result.uids, pool, 32);
+			if (!fts_flatcurve_xapian_run_query(query, &result))
+				ret = -1;
+		}
+		fts_flatcurve_xapian_destroy_query(query);
+		i_gettimeofday(&end);
+
+		diff = timeval_diff_usecs(&end, &qstart);
+		array_push_back(&usecs, &diff);
+		pool_unref(&pool);
+	} T_END;
+
+	diff = timeval_diff_usecs(&end, &start);
+	array_idx_set(&usecs, 0, &diff);
+	if (write_full(fd, array_front(&usecs),
+		       array_count(&usecs) * sizeof(diff)) < 0) {
+		i_error("write() failed: %m");
+		ret = -1;
+	}
+
+	array_free(&usecs);
+	fts_flatcurve_bench_backend_deinit(&backend);
+
+	return ret;
+}
+
+/* Runs a mix with concurrent readers (each its own process, as IMAP
+ * processes are), and reports the latencies of all of their queries. */
+static int
+fts_flatcurve_bench_query_run(unsigned int shards,
+			      enum fts_flatcurve_bench_mix mix,
+			      unsigned int readers)
+{
+	ARRAY_TYPE(fts_flatcurve_bench_usecs) usecs;
+	ARRAY(int) fds;
+	long long diff, elapsed = 0;
+	unsigned int i, queries = 0;
+	int fd[2], *fdp, status, ret = 0;
+	ssize_t len;
+	pid_t pid;
+
+	t_array_init(&fds, readers);
+	for (i = 0; i < readers; i++) {
+		if (pipe(fd) < 0)
+			i_fatal("pipe() failed: %m");
+		if ((pid = fork()) < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			i_close_fd(&fd[0]);
+			ret = fts_flatcurve_bench_query_reader(shards, mix, i,
+							       fd[1]);
+			lib_deinit();
+			exit((ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		i_close_fd(&fd[1]);
+		array_push_back(&fds, &fd[0]);
+	}
+
+	/* Every reader outputs its results only when it is done, so they
+	 * can be read one at a time. */
+	i_array_init(&usecs, readers * bench.queries);
+	array_foreach_modifiable(&fds, fdp) {
+		for (i = 0;; i++) {
+			len = read(*fdp, &diff, sizeof(diff));
+			if (len <= 0)
+				break;
+			i_assert(len == sizeof(diff));
+			if (i == 0)
+				elapsed = I_MAX(elapsed, diff);
+			else
+				array_push_back(&usecs, &diff);
+		}
+		if (len < 0)
+			i_error("read() failed: %m");
+		i_close_fd(fdp);
+	}
+
+	for (i = 0; i < readers; i++) {
+		if (wait(&status) < 0)
+			i_fatal("wait() failed: %m");
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+			ret = -1;
+	}
+	queries = array_count(&usecs);
+
+	printf("layout=%u mix=%s readers=%u queries=%u p50_ms=%.2f "
+	       "p99_ms=%.2f p999_ms=%.2f queries_per_sec=%.1f\n",
+	       shards, fts_flatcurve_bench_mix_names[mix], readers, queries,
+	       fts_flatcurve_bench_percentile(&usecs, 500),
+	       fts_flatcurve_bench_percentile(&usecs, 990),
+	       fts_flatcurve_bench_percentile(&usecs, 999),
+	       (elapsed > 0) ? queries * 1000000.0 / elapsed : 0);
+	fflush(stdout);
+
+	array_free(&usecs);
+	if (ret < 0)
+		i_error("Query benchmark failed (layout=%u, mix=%s)", shards,
+			fts_flatcurve_bench_mix_names[mix]);
+
+	return ret;
+}
+
+static int fts_flatcurve_bench_query(void)
+{
+	unsigned int i, mix, readers;
+	int ret = 0;
+
+	for (i = 0; i < N_ELEMENTS(fts_flatcurve_bench_layouts); i++) T_BEGIN {
+		if (fts_flatcurve_bench_query_layout(
+			fts_flatcurve_bench_layouts[i]) < 0)
+			ret = -1;
+		for (mix = 0; (mix < FTS_FLATCURVE_BENCH_MIX_COUNT) &&
+		     (ret == 0); mix++) {
+			/* 1, 2, 4, ... readers, up to bench.readers */
+			for (readers = 1;; readers = I_MIN(readers * 2,
+							   bench.readers)) {
+				if (fts_flatcurve_bench_query_run(
+					fts_flatcurve_bench_layouts[i],
+					mix, readers) < 0)
+					ret = -1;
+				if (readers == bench.readers)
+					break;
+			}
+		}
+	} T_END;
+
+	return ret;
+}
+
+static int fts_flatcurve_bench_fork(const char *mode)
+{
+	pid_t pid;
+	int ret, status;
+
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		ret = fts_flatcurve_bench_index(mode);
+		lib_deinit();
+		exit((ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		i_error("Benchmark failed (mode=%s)", mode);
+		return -1;
+	}
+	return 0;
+}
+
+static void ATTR_NORETURN fts_flatcurve_bench_usage(void)
+{
+	fprintf(stderr, "Usage: fts-flatcurve-bench [-c <messages>] "
+		"[-b <batch>] [-w <words>] [-s <seed>] [-l <MB>] "
+		"[-m prefix|substring] [-q <queries> [-r <readers>]] "
+		"[-d <dir>] [-k]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *mode, *const *modep;
+	struct rlimit rl;
+	char *tmpdir = NULL;
+	unsigned int i;
+	int c, ret = 0;
+
+	lib_init();
+
+	bench.messages = FTS_FLATCURVE_BENCH_MESSAGES_DEFAULT;
+	bench.batch = FTS_FLATCURVE_BENCH_BATCH_DEFAULT;
+	bench.words = FTS_FLATCURVE_BENCH_WORDS_DEFAULT;
+	bench.seed = FTS_FLATCURVE_BENCH_SEED_DEFAULT;
+	bench.readers = FTS_FLATCURVE_BENCH_READERS_DEFAULT;
+	i_array_init(&bench.modes, 2);
+
+	while ((c = getopt(argc, argv, "b:c:d:kl:m:q:r:s:w:")) > 0) {
+		switch (c) {
+		case 'b':
+			if ((str_to_uint(optarg, &bench.batch) < 0) ||
+			    (bench.batch == 0))
+				fts_flatcurve_bench_usage();
+			break;
+		case 'c':
+			if ((str_to_uint(optarg, &bench.messages) < 0) ||
+			    (bench.messages == 0))
+				fts_flatcurve_bench_usage();
+			break;
+		case 'd':
+			bench.dir = optarg;
+			break;
+		case 'k':
+			bench.keep = TRUE;
+			break;
+		case 'l':
+			if (str_to_uint(optarg, &bench.memory_limit) < 0)
+				fts_flatcurve_bench_usage();
+			break;
+		case 'm':
+			if (!str_array_find(fts_flatcurve_bench_modes, optarg))
+				fts_flatcurve_bench_usage();
+			mode = optarg;
+			array_push_back(&bench.modes, &mode);
+			break;
+		case 'q':
+			if ((str_to_uint(optarg, &bench.queries) < 0) ||
+			    (bench.queries == 0))
+				fts_flatcurve_bench_usage();
+			break;
+		case 'r':
+			if ((str_to_uint(optarg, &bench.readers) < 0) ||
+			    (bench.readers == 0))
+				fts_flatcurve_bench_usage();
+			break;
+		case 's':
+			if (str_to_uint(optarg, &bench.seed) < 0)
+				fts_flatcurve_bench_usage();
+			break;
+		case 'w':
+			if ((str_to_uint(optarg, &bench.words) < 0) ||
+			    (bench.words == 0))
+				fts_flatcurve_bench_usage();
+			break;
+		default:
+			fts_flatcurve_bench_usage();
+		}
+	}
+	if ((array_count(&bench.modes) == 0) && (bench.queries == 0)) {
+		for (modep = fts_flatcurve_bench_modes; *modep != NULL;
+		     modep++) {
+			mode = *modep;
+			array_push_back(&bench.modes, &mode);
+		}
+	}
+
+	/* Same as running the benchmark under "ulimit -v". */
+	if (bench.memory_limit > 0) {
+		rl.rlim_cur = rl.rlim_max =
+			(rlim_t)bench.memory_limit * 1024 * 1024;
+		if (setrlimit(RLIMIT_AS, &rl) < 0)
+			i_fatal("setrlimit(RLIMIT_AS) failed: %m");
+	}
+
+	if (bench.dir == NULL) {
+		tmpdir = i_strdup("/tmp/" FTS_FLATCURVE_LABEL "-bench.XXXXXX");
+		if (mkdtemp(tmpdir) == NULL)
+			i_fatal("mkdtemp(%s) failed: %m", tmpdir);
+		bench.dir = tmpdir;
+	}
+
+	printf("xapian=%s messages=%u batch=%u words=%u seed=%u "
+	       "memory_limit_mb=%u dir=%s\n",
+	       fts_flatcurve_xapian_library_version(), bench.messages,
+	       bench.batch, bench.words, bench.seed, bench.memory_limit,
+	       bench.dir);
+	fflush(stdout);
+
+	T_BEGIN {
+		fts_flatcurve_bench_vocabulary_init();
+	} T_END;
+	array_foreach_elem(&bench.modes, mode) {
+		if (fts_flatcurve_bench_fork(mode) < 0)
+			ret = -1;
+		if (!bench.keep)
+			(void)fts_backend_flatcurve_delete_dir(NULL,
+				t_strdup_printf("%s/%s", bench.dir, mode));
+	}
+	if (bench.queries > 0) {
+		if (fts_flatcurve_bench_query() < 0)
+			ret = -1;
+		for (i = 0; (i < N_ELEMENTS(fts_flatcurve_bench_layouts)) &&
+		     !bench.keep; i++) {
+			(void)fts_backend_flatcurve_delete_dir(NULL,
+				t_strdup_printf("%s/query-%u", bench.dir,
+						fts_flatcurve_bench_layouts[i]));
+		}
+	}
+	fts_flatcurve_bench_vocabulary_deinit();
+
+	if ((tmpdir != NULL) && !bench.keep && (rmdir(tmpdir) < 0))
+		i_error("rmdir(%s) failed: %m", tmpdir);
+	i_free(tmpdir);
+	array_free(&bench.modes);
+
+	lib_deinit();
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
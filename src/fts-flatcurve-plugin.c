@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "mail-storage-hooks.h"
+#include "settings-parser.h"
 #include "fts-user.h"
 #include "fts-backend-flatcurve.h"
 #include "fts-backend-flatcurve-xapian.h"
@@ -12,12 +13,35 @@
 #define FTS_FLATCURVE_PLUGIN_COMMIT_LIMIT "fts_flatcurve_commit_limit"
 #define FTS_FLATCURVE_COMMIT_LIMIT_DEFAULT 500
 
+#define FTS_FLATCURVE_PLUGIN_LEARN_HEADERS "fts_flatcurve_learn_headers"
+#define FTS_FLATCURVE_LEARN_HEADERS_DEFAULT 0
+
+#define FTS_FLATCURVE_PLUGIN_MAINTENANCE_HOST_LIMIT "fts_flatcurve_maintenance_host_limit"
+#define FTS_FLATCURVE_MAINTENANCE_HOST_LIMIT_DEFAULT 0
+
+#define FTS_FLATCURVE_PLUGIN_MAINTENANCE_WORKERS "fts_flatcurve_maintenance_workers"
+#define FTS_FLATCURVE_MAINTENANCE_WORKERS_DEFAULT 0
+
 #define FTS_FLATCURVE_PLUGIN_MIN_TERM_SIZE "fts_flatcurve_min_term_size"
 #define FTS_FLATCURVE_MIN_TERM_SIZE_DEFAULT 2
 
 #define FTS_FLATCURVE_PLUGIN_OPTIMIZE_LIMIT "fts_flatcurve_optimize_limit"
 #define FTS_FLATCURVE_OPTIMIZE_LIMIT_DEFAULT 10
 
+#define FTS_FLATCURVE_PLUGIN_QUERY_LOG_UIDS "fts_flatcurve_query_log_uids"
+
+#define FTS_FLATCURVE_PLUGIN_QUERY_MAX_EXPANSION "fts_flatcurve_query_max_expansion"
+#define FTS_FLATCURVE_QUERY_MAX_EXPANSION_DEFAULT 0
+
+#define FTS_FLATCURVE_PLUGIN_QUERY_THREADS "fts_flatcurve_query_threads"
+#define FTS_FLATCURVE_QUERY_THREADS_DEFAULT 0
+
+#define FTS_FLATCURVE_PLUGIN_QUERY_TIMEOUT "fts_flatcurve_query_timeout"
+#define FTS_FLATCURVE_QUERY_TIMEOUT_DEFAULT 0
+
+#define FTS_FLATCURVE_PLUGIN_ROTATE_BYTES "fts_flatcurve_rotate_bytes"
+#define FTS_FLATCURVE_ROTATE_BYTES_DEFAULT 0
+
 #define FTS_FLATCURVE_PLUGIN_ROTATE_SIZE "fts_flatcurve_rotate_size"
 #define FTS_FLATCURVE_ROTATE_SIZE_DEFAULT 5000
 
@@ -26,6 +50,9 @@
 
 #define FTS_FLATCURVE_PLUGIN_SUBSTRING_SEARCH "fts_flatcurve_substring_search"
 
+#define FTS_FLATCURVE_PLUGIN_WARMUP_BYTES "fts_flatcurve_warmup_bytes"
+#define FTS_FLATCURVE_WARMUP_BYTES_DEFAULT 0
+
 const char *fts_flatcurve_plugin_version = DOVECOT_ABI_VERSION;
 
 struct fts_flatcurve_user_module fts_flatcurve_user_module =
@@ -44,7 +71,8 @@ static int
 fts_flatcurve_plugin_init_settings(struct mail_user *user,
 				   struct fts_flatcurve_settings *set)
 {
-	const char *pset;
+	const char *error, *pset;
+	uoff_t size;
 	unsigned int val;
 
 	if (mail_user_plugin_getenv(user, "fts_flatcurve") != NULL)
@@ -64,6 +92,48 @@ fts_flatcurve_plugin_init_settings(struct mail_user *user,
 		set->commit_limit = FTS_FLATCURVE_COMMIT_LIMIT_DEFAULT;
 	}
 
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_LEARN_HEADERS);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_LEARN_HEADERS, pset);
+			return -1;
+		}
+		set->learn_headers = val;
+	} else {
+		set->learn_headers = FTS_FLATCURVE_LEARN_HEADERS_DEFAULT;
+	}
+
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_MAINTENANCE_HOST_LIMIT);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_MAINTENANCE_HOST_LIMIT, pset);
+			return -1;
+		}
+		set->maintenance_host_limit = val;
+	} else {
+		set->maintenance_host_limit = FTS_FLATCURVE_MAINTENANCE_HOST_LIMIT_DEFAULT;
+	}
+
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_MAINTENANCE_WORKERS);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_MAINTENANCE_WORKERS, pset);
+			return -1;
+		}
+		set->maintenance_workers = val;
+	} else {
+		set->maintenance_workers = FTS_FLATCURVE_MAINTENANCE_WORKERS_DEFAULT;
+	}
+
 	pset = mail_user_plugin_getenv(user,
 				       FTS_FLATCURVE_PLUGIN_MIN_TERM_SIZE);
 	if (pset != NULL) {
@@ -92,6 +162,61 @@ fts_flatcurve_plugin_init_settings(struct mail_user *user,
 		set->optimize_limit = FTS_FLATCURVE_OPTIMIZE_LIMIT_DEFAULT;
 	}
 
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_QUERY_MAX_EXPANSION);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_QUERY_MAX_EXPANSION, pset);
+			return -1;
+		}
+		set->query_max_expansion = val;
+	} else {
+		set->query_max_expansion = FTS_FLATCURVE_QUERY_MAX_EXPANSION_DEFAULT;
+	}
+
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_QUERY_THREADS);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_QUERY_THREADS, pset);
+			return -1;
+		}
+		set->query_threads = val;
+	} else {
+		set->query_threads = FTS_FLATCURVE_QUERY_THREADS_DEFAULT;
+	}
+
+	pset = mail_user_plugin_getenv(user,
+				       FTS_FLATCURVE_PLUGIN_QUERY_TIMEOUT);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_QUERY_TIMEOUT, pset);
+			return -1;
+		}
+		set->query_timeout = val;
+	} else {
+		set->query_timeout = FTS_FLATCURVE_QUERY_TIMEOUT_DEFAULT;
+	}
+
+	pset = mail_user_plugin_getenv(user, FTS_FLATCURVE_PLUGIN_ROTATE_BYTES);
+	if (pset != NULL) {
+		if (settings_get_size(pset, &size, &error) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_ROTATE_BYTES, error);
+			return -1;
+		}
+		set->rotate_bytes = size;
+	} else {
+		set->rotate_bytes = FTS_FLATCURVE_ROTATE_BYTES_DEFAULT;
+	}
+
 	pset = mail_user_plugin_getenv(user, FTS_FLATCURVE_PLUGIN_ROTATE_SIZE);
 	if (pset != NULL) {
 		if (str_to_uint(pset, &val) < 0) {
@@ -118,9 +243,25 @@ fts_flatcurve_plugin_init_settings(struct mail_user *user,
 		set->rotate_time = FTS_FLATCURVE_ROTATE_TIME_DEFAULT;
 	}
 
+	set->query_log_uids = mail_user_plugin_getenv_bool(user,
+					FTS_FLATCURVE_PLUGIN_QUERY_LOG_UIDS);
+
 	set->substring_search = mail_user_plugin_getenv_bool(user,
 					FTS_FLATCURVE_PLUGIN_SUBSTRING_SEARCH);
 
+	pset = mail_user_plugin_getenv(user, FTS_FLATCURVE_PLUGIN_WARMUP_BYTES);
+	if (pset != NULL) {
+		if (settings_get_size(pset, &size, &error) < 0) {
+			e_warning(user->event, FTS_FLATCURVE_DEBUG_PREFIX
+				  "Invalid %s: %s",
+				  FTS_FLATCURVE_PLUGIN_WARMUP_BYTES, error);
+			return -1;
+		}
+		set->warmup_bytes = size;
+	} else {
+		set->warmup_bytes = FTS_FLATCURVE_WARMUP_BYTES_DEFAULT;
+	}
+
 	return 0;
 }
 
@@ -16,10 +16,19 @@
 
 struct fts_flatcurve_settings {
 	unsigned int commit_limit;
+	unsigned int learn_headers;
+	unsigned int maintenance_host_limit;
+	unsigned int maintenance_workers;
 	unsigned int min_term_size;
 	unsigned int optimize_limit;
+	unsigned int query_max_expansion;
+	unsigned int query_threads;
+	unsigned int query_timeout;
+	uoff_t rotate_bytes;
 	unsigned int rotate_size;
 	unsigned int rotate_time;
+	uoff_t warmup_bytes;
+	bool query_log_uids;
 	bool substring_search;
 };
 